@@ -1,5 +1,6 @@
 #include "aabb.h"
 #include "ray.h"
+#include <limits>
 
 bool AABB::Intersects(const Ray& ray) const
 {
@@ -29,3 +30,22 @@ bool AABB::Intersects(const Ray& ray) const
 
     return true;
 }
+
+bool AABB::ClipRay(const Ray& ray, float* outMin, float* outMax) const
+{
+    float tmin = 0.0f;
+    float tmax = std::numeric_limits<float>::infinity();
+    for (int k = 0; k < 3; ++k)
+    {
+        float t0 = (min[k] - ray.origin[k]) * ray.inverseDirection[k];
+        float t1 = (max[k] - ray.origin[k]) * ray.inverseDirection[k];
+        if (t0 > t1)
+            std::swap(t0, t1);
+        //a ray parallel to the slab and starting on its border gives NaN, which leaves the range as it is
+        tmin = t0 > tmin ? t0 : tmin;
+        tmax = t1 < tmax ? t1 : tmax;
+    }
+    *outMin = tmin;
+    *outMax = tmax;
+    return tmin <= tmax;
+}
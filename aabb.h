@@ -8,4 +8,14 @@ struct AABB
     Vector3 max;
 public:
     bool Intersects(const Ray& ray) const;
+    //cuts the ray's parameter range [0, infinity) to the part inside the box, returns false if nothing is left
+    bool ClipRay(const Ray& ray, float* outMin, float* outMax) const;
+
+    float GetSurfaceArea() const
+    {
+        float width = max.x - min.x;
+        float height = max.y - min.y;
+        float depth = max.z - min.z;
+        return (width * height + depth * height + depth * width) * 2;
+    }
 };
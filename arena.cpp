@@ -0,0 +1,46 @@
+#include "arena.h"
+#include <algorithm>
+
+StackArena::StackArena(size_t blockSize)
+{
+    m_BlockSize = blockSize;
+}
+
+void* StackArena::Allocate(size_t bytes, size_t alignment)
+{
+    if (m_Block < m_Blocks.size())
+    {
+        size_t offset = (m_Offset + alignment - 1) & ~(alignment - 1);
+        if (offset + bytes <= m_Blocks[m_Block].size)
+        {
+            m_Offset = offset + bytes;
+            m_PeakBytes = std::max(m_PeakBytes, m_BlockStart + m_Offset);
+            return m_Blocks[m_Block].data.get() + offset;
+        }
+        //move on to the next block, the rest of this one stays unused until we rewind
+        m_BlockStart += m_Blocks[m_Block].size;
+        m_Block++;
+    }
+    //blocks after the current one are free, so a block too small for this allocation can be replaced
+    size_t size = std::max(m_BlockSize, bytes + alignment);
+    if (m_Block == m_Blocks.size())
+    {
+        m_Blocks.push_back({ std::unique_ptr<char[]>(new char[size]), size });
+    }
+    else if (m_Blocks[m_Block].size < bytes + alignment)
+    {
+        m_Blocks[m_Block] = { std::unique_ptr<char[]>(new char[size]), size };
+    }
+    m_Offset = 0;
+    return Allocate(bytes, alignment);
+}
+
+void StackArena::Release(const Marker& marker)
+{
+    for (size_t i = marker.block; i < m_Block; ++i)
+    {
+        m_BlockStart -= m_Blocks[i].size;
+    }
+    m_Block = marker.block;
+    m_Offset = marker.offset;
+}
@@ -0,0 +1,64 @@
+#pragma once
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+//pointer and length of memory owned by an arena
+template<typename T>
+struct ArenaArray
+{
+    T* data = nullptr;
+    size_t size = 0;
+
+    T& operator[](size_t i) const { return data[i]; }
+    T* begin() const { return data; }
+    T* end() const { return data + size; }
+};
+
+//stack allocator for scratch memory. Allocations are freed all at once by rewinding to a marker,
+//and blocks are kept for reuse, so once the arena is warm allocating does not call malloc at all.
+class StackArena
+{
+public:
+    struct Marker
+    {
+        size_t block;
+        size_t offset;
+    };
+
+    explicit StackArena(size_t blockSize = 1 << 20);
+    StackArena(const StackArena&) = delete;
+    StackArena& operator=(const StackArena&) = delete;
+
+    void* Allocate(size_t bytes, size_t alignment);
+
+    template<typename T>
+    ArenaArray<T> AllocateArray(size_t count)
+    {
+        ArenaArray<T> array;
+        array.data = static_cast<T*>(Allocate(count * sizeof(T), alignof(T)));
+        array.size = count;
+        return array;
+    }
+
+    Marker GetMarker() const { return { m_Block, m_Offset }; }
+    void Release(const Marker& marker);
+
+    size_t GetPeakBytes() const { return m_PeakBytes; }
+    size_t GetBlockCount() const { return m_Blocks.size(); }
+
+private:
+    struct Block
+    {
+        std::unique_ptr<char[]> data;
+        size_t size;
+    };
+
+    std::vector<Block> m_Blocks;
+    size_t m_BlockSize;
+    size_t m_Block = 0;
+    size_t m_Offset = 0;
+    //bytes of all blocks before the current one, to track the high water mark
+    size_t m_BlockStart = 0;
+    size_t m_PeakBytes = 0;
+};
@@ -0,0 +1,55 @@
+#pragma once
+#include "vector3.h"
+#include "aabb.h"
+#include "triangle.h"
+
+#define FRUSTUM_PLANE_COUNT 6
+#define FRUSTUM_ALL_PLANES ((1u << FRUSTUM_PLANE_COUNT) - 1)
+
+//convex volume bounded by six planes, the points p with Dot(normals[i], p) >= offsets[i] for every plane i.
+//The normals point inwards and need not be normalized
+struct Frustum
+{
+    Vector3 normals[FRUSTUM_PLANE_COUNT];
+    float offsets[FRUSTUM_PLANE_COUNT];
+
+    //plane i goes through point and faces the inside along normal
+    void SetPlane(int i, const Vector3& normal, const Vector3& point)
+    {
+        normals[i] = normal;
+        offsets[i] = Vector3::Dot(normal, point);
+    }
+
+    //whether the box may overlap, tested only against the planes in *planes. Returns false if the box lies entirely outside
+    //one of them, otherwise removes the planes the box lies entirely inside from *planes, they need not be tested for boxes inside it.
+    //A box near an edge can be outside the frustum and still pass
+    bool Overlaps(const AABB& box, uint32_t* planes) const
+    {
+        for (int i = 0; i < FRUSTUM_PLANE_COUNT; ++i)
+        {
+            if (!(*planes >> i & 1))
+                continue;
+            const Vector3& n = normals[i];
+            //the corners furthest along and against the normal
+            Vector3 inner(n.x >= 0.0f ? box.max.x : box.min.x, n.y >= 0.0f ? box.max.y : box.min.y, n.z >= 0.0f ? box.max.z : box.min.z);
+            Vector3 outer(n.x >= 0.0f ? box.min.x : box.max.x, n.y >= 0.0f ? box.min.y : box.max.y, n.z >= 0.0f ? box.min.z : box.max.z);
+            if (Vector3::Dot(n, inner) < offsets[i])
+                return false;
+            if (Vector3::Dot(n, outer) >= offsets[i])
+                *planes &= ~(1u << i);
+        }
+        return true;
+    }
+
+    //false only if all three vertices lie outside the same plane, so like the box test it can pass triangles near an edge
+    bool Overlaps(const Triangle& triangle) const
+    {
+        for (int i = 0; i < FRUSTUM_PLANE_COUNT; ++i)
+        {
+            if (Vector3::Dot(normals[i], triangle.vertices[0]) < offsets[i] && Vector3::Dot(normals[i], triangle.vertices[1]) < offsets[i] &&
+                Vector3::Dot(normals[i], triangle.vertices[2]) < offsets[i])
+                return false;
+        }
+        return true;
+    }
+};
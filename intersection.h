@@ -0,0 +1,365 @@
+#pragma once
+#include <cmath>
+#include <cstdint>
+#include "triangle.h"
+#include "ray.h"
+#include "aabb.h"
+#include "simd.h"
+
+//[Möller-Trumbore] http://www.graphics.cornell.edu/pubs/1997/MT97.pdf
+inline bool TestTriangle(const Vector3& vertex, const Vector3& edge1, const Vector3& edge2, const Ray& ray, float* outT)
+{
+    Vector3 pvec = Vector3::Cross(ray.direction, edge2);
+    float det = Vector3::Dot(edge1, pvec);
+    float inv_det = 1.0f / det;
+    Vector3 tvec = ray.origin - vertex;
+    float u = Vector3::Dot(tvec, pvec) * inv_det;
+    if (u < 0.0f || u > 1.0f)
+        return false;
+    Vector3 qvec = Vector3::Cross(tvec, edge1);
+    float v = Vector3::Dot(ray.direction, qvec) * inv_det;
+    if (v < 0.0f || u + v >= 1.0f)
+        return false;
+    *outT = Vector3::Dot(edge2, qvec) * inv_det;
+    return true;
+}
+
+inline bool TestTriangle(const Triangle& triangle, const Ray& ray, float* outT)
+{
+    Vector3 edge1 = triangle.vertices[1] - triangle.vertices[0];
+    Vector3 edge2 = triangle.vertices[2] - triangle.vertices[0];
+    return TestTriangle(triangle.vertices[0], edge1, edge2, ray, outT);
+}
+
+//barycentric coordinates of the point where the ray meets the triangle's plane, computed like TestTriangle, so for a ray
+//that hits the triangle they are the ones the test checked. The point is (1 - u - v) * vertices[0] + u * vertices[1] + v * vertices[2]
+inline void GetBarycentrics(const Triangle& triangle, const Ray& ray, float* outU, float* outV)
+{
+    Vector3 edge1 = triangle.vertices[1] - triangle.vertices[0];
+    Vector3 edge2 = triangle.vertices[2] - triangle.vertices[0];
+    Vector3 pvec = Vector3::Cross(ray.direction, edge2);
+    float inv_det = 1.0f / Vector3::Dot(edge1, pvec);
+    Vector3 tvec = ray.origin - triangle.vertices[0];
+    *outU = Vector3::Dot(tvec, pvec) * inv_det;
+    *outV = Vector3::Dot(ray.direction, Vector3::Cross(tvec, edge1)) * inv_det;
+}
+
+//[Ericson, Real-Time Collision Detection, 5.1.5] point of the triangle closest to p, found by checking which vertex, edge or
+//the face's Voronoi region p is in. The barycentric coordinates are the ones of GetBarycentrics
+inline Vector3 ClosestPointOnTriangle(const Triangle& triangle, const Vector3& p, float* outU, float* outV)
+{
+    const Vector3& a = triangle.vertices[0];
+    const Vector3& b = triangle.vertices[1];
+    const Vector3& c = triangle.vertices[2];
+    Vector3 ab = b - a;
+    Vector3 ac = c - a;
+    Vector3 ap = p - a;
+    float d1 = Vector3::Dot(ab, ap);
+    float d2 = Vector3::Dot(ac, ap);
+    if (d1 <= 0.0f && d2 <= 0.0f)
+    {
+        *outU = 0.0f;
+        *outV = 0.0f;
+        return a;
+    }
+    Vector3 bp = p - b;
+    float d3 = Vector3::Dot(ab, bp);
+    float d4 = Vector3::Dot(ac, bp);
+    if (d3 >= 0.0f && d4 <= d3)
+    {
+        *outU = 1.0f;
+        *outV = 0.0f;
+        return b;
+    }
+    float vc = d1 * d4 - d3 * d2;
+    if (vc <= 0.0f && d1 >= 0.0f && d3 <= 0.0f)
+    {
+        float w = d1 / (d1 - d3);
+        *outU = w;
+        *outV = 0.0f;
+        return a + ab * w;
+    }
+    Vector3 cp = p - c;
+    float d5 = Vector3::Dot(ab, cp);
+    float d6 = Vector3::Dot(ac, cp);
+    if (d6 >= 0.0f && d5 <= d6)
+    {
+        *outU = 0.0f;
+        *outV = 1.0f;
+        return c;
+    }
+    float vb = d5 * d2 - d1 * d6;
+    if (vb <= 0.0f && d2 >= 0.0f && d6 <= 0.0f)
+    {
+        float w = d2 / (d2 - d6);
+        *outU = 0.0f;
+        *outV = w;
+        return a + ac * w;
+    }
+    float va = d3 * d6 - d5 * d4;
+    if (va <= 0.0f && d4 - d3 >= 0.0f && d5 - d6 >= 0.0f)
+    {
+        float w = (d4 - d3) / ((d4 - d3) + (d5 - d6));
+        *outU = 1.0f - w;
+        *outV = w;
+        return b + (c - b) * w;
+    }
+    float denom = 1.0f / (va + vb + vc);
+    *outU = vb * denom;
+    *outV = vc * denom;
+    return a + ab * *outU + ac * *outV;
+}
+
+//[Akenine-Möller, Fast 3D Triangle-Box Overlap Testing, 2001] looks for a separating axis among the box's three axes, the
+//triangle's normal and the nine cross products of their edges. A triangle that only touches the box overlaps it
+inline bool TriangleOverlapsBox(const Triangle& triangle, const AABB& box)
+{
+    Vector3 center = (box.min + box.max) * 0.5f;
+    Vector3 half = (box.max - box.min) * 0.5f;
+    Vector3 v[3] = { triangle.vertices[0] - center, triangle.vertices[1] - center, triangle.vertices[2] - center };
+    bool inside = true;
+    for (int k = 0; k < 3; ++k)
+    {
+        float min = std::min(std::min(v[0][k], v[1][k]), v[2][k]);
+        float max = std::max(std::max(v[0][k], v[1][k]), v[2][k]);
+        if (min > half[k] || max < -half[k])
+            return false;
+        inside = inside && min >= -half[k] && max <= half[k];
+    }
+    //the triangle's bounds are in the box, so the other axes cannot separate them
+    if (inside)
+        return true;
+    Vector3 edges[3] = { v[1] - v[0], v[2] - v[1], v[0] - v[2] };
+    Vector3 normal = Vector3::Cross(edges[0], edges[1]);
+    if (fabsf(Vector3::Dot(normal, v[0])) > half.x * fabsf(normal.x) + half.y * fabsf(normal.y) + half.z * fabsf(normal.z))
+        return false;
+    for (int k = 0; k < 3; ++k)
+    {
+        Vector3 boxAxis(k == 0, k == 1, k == 2);
+        for (int i = 0; i < 3; ++i)
+        {
+            Vector3 axis = Vector3::Cross(boxAxis, edges[i]);
+            float p0 = Vector3::Dot(axis, v[0]);
+            float p1 = Vector3::Dot(axis, v[1]);
+            float p2 = Vector3::Dot(axis, v[2]);
+            float radius = half.x * fabsf(axis.x) + half.y * fabsf(axis.y) + half.z * fabsf(axis.z);
+            if (std::min(std::min(p0, p1), p2) > radius || std::max(std::max(p0, p1), p2) < -radius)
+                return false;
+        }
+    }
+    return true;
+}
+
+//Möller-Trumbore with the edges computed once, gives exactly the same results as testing the Triangle
+struct EdgeTriangle
+{
+    Vector3 vertex;
+    Vector3 edge1;
+    Vector3 edge2;
+
+    EdgeTriangle(const Vector3& vertex, const Vector3& edge1, const Vector3& edge2)
+        : vertex(vertex), edge1(edge1), edge2(edge2)
+    {}
+
+    explicit EdgeTriangle(const Triangle& triangle)
+    {
+        vertex = triangle.vertices[0];
+        edge1 = triangle.vertices[1] - triangle.vertices[0];
+        edge2 = triangle.vertices[2] - triangle.vertices[0];
+    }
+
+    bool Intersect(const Ray& ray, float* outT) const
+    {
+        return TestTriangle(vertex, edge1, edge2, ray, outT);
+    }
+};
+static_assert(sizeof(EdgeTriangle) == 36, "EdgeTriangle should stay 36 bytes");
+
+//TestTriangle for the lanes in mask at once, with the same operations in the same order, so each lane's t and result
+//are the scalar ones. Either the rays or the triangles may be the same in all lanes. t is only meaningful in the lanes that hit
+inline SimdMask TestTriangleSimd(const SimdFloat* vertex, const SimdFloat* edge1, const SimdFloat* edge2, const SimdFloat* origin, const SimdFloat* direction,
+    const SimdMask& mask, SimdFloat* outT)
+{
+    SimdFloat zero = SimdFloat::Broadcast(0.0f);
+    SimdFloat one = SimdFloat::Broadcast(1.0f);
+    SimdFloat pvec[3] = {
+        direction[1] * edge2[2] - direction[2] * edge2[1],
+        direction[2] * edge2[0] - direction[0] * edge2[2],
+        direction[0] * edge2[1] - direction[1] * edge2[0] };
+    SimdFloat det = edge1[0] * pvec[0] + edge1[1] * pvec[1] + edge1[2] * pvec[2];
+    SimdFloat invDet = one / det;
+    SimdFloat tvec[3] = { origin[0] - vertex[0], origin[1] - vertex[1], origin[2] - vertex[2] };
+    SimdFloat u = (tvec[0] * pvec[0] + tvec[1] * pvec[1] + tvec[2] * pvec[2]) * invDet;
+    SimdMask miss = (u < zero) | (u > one);
+    SimdFloat qvec[3] = {
+        tvec[1] * edge1[2] - tvec[2] * edge1[1],
+        tvec[2] * edge1[0] - tvec[0] * edge1[2],
+        tvec[0] * edge1[1] - tvec[1] * edge1[0] };
+    SimdFloat v = (direction[0] * qvec[0] + direction[1] * qvec[1] + direction[2] * qvec[2]) * invDet;
+    miss = miss | (v < zero) | (u + v >= one);
+    *outT = (edge2[0] * qvec[0] + edge2[1] * qvec[1] + edge2[2] * qvec[2]) * invDet;
+    return AndNot(mask, miss);
+}
+
+//SIMD_WIDTH EdgeTriangles as structure of arrays, so a ray is tested against all of them at once with the same results
+struct TriangleBlock
+{
+    alignas(SIMD_WIDTH * 4) float vertex[3][SIMD_WIDTH];
+    alignas(SIMD_WIDTH * 4) float edge1[3][SIMD_WIDTH];
+    alignas(SIMD_WIDTH * 4) float edge2[3][SIMD_WIDTH];
+
+    void SetTriangle(int lane, const EdgeTriangle& triangle)
+    {
+        for (int k = 0; k < 3; ++k)
+        {
+            vertex[k][lane] = triangle.vertex[k];
+            edge1[k][lane] = triangle.edge1[k];
+            edge2[k][lane] = triangle.edge2[k];
+        }
+    }
+
+    EdgeTriangle GetTriangle(int lane) const
+    {
+        return EdgeTriangle(Vector3(vertex[0][lane], vertex[1][lane], vertex[2][lane]), Vector3(edge1[0][lane], edge1[1][lane], edge1[2][lane]),
+            Vector3(edge2[0][lane], edge2[1][lane], edge2[2][lane]));
+    }
+
+    //the ray's origin and direction broadcast to all lanes
+    SimdMask Intersect(const SimdFloat* origin, const SimdFloat* direction, const SimdMask& mask, SimdFloat* outT) const
+    {
+        SimdFloat v[3], e1[3], e2[3];
+        for (int k = 0; k < 3; ++k)
+        {
+            v[k] = SimdFloat::Load(vertex[k]);
+            e1[k] = SimdFloat::Load(edge1[k]);
+            e2[k] = SimdFloat::Load(edge2[k]);
+        }
+        return TestTriangleSimd(v, e1, e2, origin, direction, mask, outT);
+    }
+};
+
+//[Wald, Realtime Ray Tracing and Interactive Global Illumination, 2004] the plane and the edges are projected
+//onto the plane of the two axes the normal is smallest in, so a test is a division and a few multiply adds.
+//Results can differ from Möller-Trumbore in the last bits, and so can the choice between triangles at the same distance
+struct WaldTriangle
+{
+    //plane: p[k] + nu * p[ku] + nv * p[kv] = nd, where k is the axis the normal is largest in
+    float nu;
+    float nv;
+    float nd;
+    uint32_t k;
+    //barycentric coordinates of the second and third vertex as linear functions of the projected hit point
+    float bnu;
+    float bnv;
+    float bd;
+    uint32_t pad0;
+    float cnu;
+    float cnv;
+    float cd;
+    uint32_t pad1;
+
+    explicit WaldTriangle(const Triangle& triangle)
+    {
+        const Vector3& a = triangle.vertices[0];
+        Vector3 b = triangle.vertices[1] - a;
+        Vector3 c = triangle.vertices[2] - a;
+        Vector3 normal = Vector3::Cross(b, c);
+        k = fabsf(normal.x) > fabsf(normal.y) ? (fabsf(normal.x) > fabsf(normal.z) ? 0 : 2) : (fabsf(normal.y) > fabsf(normal.z) ? 1 : 2);
+        uint32_t u = (k + 1) % 3;
+        uint32_t v = (k + 2) % 3;
+        nu = normal[u] / normal[k];
+        nv = normal[v] / normal[k];
+        nd = Vector3::Dot(normal, a) / normal[k];
+        //solve (hit - a) = beta * b + gamma * c in the projection plane
+        float rcpDet = 1.0f / (b[u] * c[v] - b[v] * c[u]);
+        bnu = c[v] * rcpDet;
+        bnv = -c[u] * rcpDet;
+        bd = (c[u] * a[v] - c[v] * a[u]) * rcpDet;
+        cnu = -b[v] * rcpDet;
+        cnv = b[u] * rcpDet;
+        cd = (b[v] * a[u] - b[u] * a[v]) * rcpDet;
+        pad0 = pad1 = 0;
+    }
+
+    bool Intersect(const Ray& ray, float* outT) const
+    {
+        static const uint32_t kModulo[] = { 1, 2, 0, 1 };
+        uint32_t u = kModulo[k];
+        uint32_t v = kModulo[k + 1];
+        float t = (nd - ray.origin[k] - nu * ray.origin[u] - nv * ray.origin[v]) /
+            (ray.direction[k] + nu * ray.direction[u] + nv * ray.direction[v]);
+        float hu = ray.origin[u] + t * ray.direction[u];
+        float hv = ray.origin[v] + t * ray.direction[v];
+        float beta = bnu * hu + bnv * hv + bd;
+        if (beta < 0.0f || beta > 1.0f)
+            return false;
+        float gamma = cnu * hu + cnv * hv + cd;
+        if (gamma < 0.0f || beta + gamma >= 1.0f)
+            return false;
+        *outT = t;
+        return true;
+    }
+};
+static_assert(sizeof(WaldTriangle) == 48, "WaldTriangle should stay 48 bytes");
+
+//Möller-Trumbore with the limits of the barycentric coordinates widened. tolerance is how far the edges are moved out in
+//the triangle's plane, in barycentric units. The ray meets the plane up to that distance / cos away from where it would meet
+//a triangle that lies off the plane by it, so the limits grow with the ray's angle to the plane. They are capped at 1, which
+//keeps slivers and grazing rays from hitting far outside the triangle, but can lose a hit there
+inline bool TestTriangleWidened(const Vector3& vertex, const Vector3& edge1, const Vector3& edge2, float tolerance, const Ray& ray, float* outT)
+{
+    Vector3 pvec = Vector3::Cross(ray.direction, edge2);
+    float det = Vector3::Dot(edge1, pvec);
+    float inv_det = 1.0f / det;
+    Vector3 tvec = ray.origin - vertex;
+    float u = Vector3::Dot(tvec, pvec) * inv_det;
+    //no limit is wider than 1, so most misses are known before the limit is worked out
+    if (u < -1.0f || u > 2.0f)
+        return false;
+    Vector3 qvec = Vector3::Cross(tvec, edge1);
+    float v = Vector3::Dot(ray.direction, qvec) * inv_det;
+    if (v < -1.0f || u + v > 2.0f)
+        return false;
+    if (u < 0.0f || v < 0.0f || u + v > 1.0f)
+    {
+        //|det| is |normal| * |direction| * cos, written as min(1, x) so the NaN of a degenerate triangle gives 1
+        Vector3 normal = Vector3::Cross(edge1, edge2);
+        float secant = sqrtf(Vector3::Dot(normal, normal) * Vector3::Dot(ray.direction, ray.direction)) * fabsf(inv_det);
+        float limit = std::min(1.0f, tolerance * (1.0f + secant));
+        if (u < -limit || v < -limit || u + v > 1.0f + limit)
+            return false;
+    }
+    *outT = Vector3::Dot(edge2, qvec) * inv_det;
+    return true;
+}
+
+//16 bit grid the vertices of a leaf's QuantizedTriangles are stored in, value q on axis k is origin[k] + q * step[k].
+//The grid spans the bounds of the leaf's triangles
+struct QuantizationFrame
+{
+    Vector3 origin;
+    Vector3 step;
+
+    Vector3 Dequantize(const uint16_t* q) const
+    {
+        return Vector3(origin.x + q[0] * step.x, origin.y + q[1] * step.y, origin.z + q[2] * step.z);
+    }
+};
+
+//the vertices of a triangle reference rounded to the nearest point of its leaf's grid. tolerance / 65535 is the
+//TestTriangleWidened tolerance that covers the distance of the leaf's dequantized vertices from the exact ones
+struct QuantizedTriangle
+{
+    uint32_t frame;
+    uint16_t vertices[3][3];
+    uint16_t tolerance;
+
+    //hits of the exact triangle are only lost where TestTriangleWidened caps its limits. The distance is the one to the
+    //dequantized triangle, a little off the exact one, and the widened edges can hit a neighbour first
+    bool Intersect(const QuantizationFrame& grid, const Ray& ray, float* outT) const
+    {
+        Vector3 vertex = grid.Dequantize(vertices[0]);
+        return TestTriangleWidened(vertex, grid.Dequantize(vertices[1]) - vertex, grid.Dequantize(vertices[2]) - vertex, tolerance * (1.0f / 65535.0f), ray, outT);
+    }
+};
+static_assert(sizeof(QuantizedTriangle) == 24, "QuantizedTriangle should stay 24 bytes");
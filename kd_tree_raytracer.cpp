@@ -2,11 +2,17 @@
 #include <opencv2/core/core.hpp>
 #include <opencv2/highgui/highgui.hpp>
 #include <iostream>
+#include <algorithm>
 #include <chrono>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <string>
 
 #include "ply_reader.h"
 #include "raytracer.h"
+#include "task_scheduler.h"
 #include "tga_saver.h"
 
 using namespace cv;
@@ -30,6 +36,890 @@ static void onMouse(int event, int x, int y, int, void*)
     s_LastMousePosition = Vector3(x, y, 0.0f);
 }
 
+//build the tree with 1, 2, 4... threads up to the hardware thread count and print the build times
+static void RunBuildScaling(const PLY_Model& model, KDTreeBuildParams params)
+{
+    AABB aabb;
+    aabb.min = Vector3(-10, -10, -10);
+    aabb.max = Vector3(10, 10, 10);
+    unsigned int maxThreads = TaskScheduler::GetHardwareThreadCount();
+    double serialTime = 0.0;
+    for (unsigned int threads = 1;; threads = std::min(threads * 2, maxThreads))
+    {
+        params.threadCount = threads;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        KDTree tree(model.mesh, aabb, params);
+        std::chrono::duration<double> buildTime = std::chrono::steady_clock::now() - start;
+        if (threads == 1)
+            serialTime = buildTime.count();
+        printf("%3u threads: %f seconds (%.2fx)\n", threads, buildTime.count(), serialTime / buildTime.count());
+        if (threads == maxThreads)
+            break;
+    }
+}
+
+static void SetupDefaultCamera(Raytracer& raytracer, PLY_Model* model, uint16_t width, uint16_t height)
+{
+    raytracer.SetModel(model);
+    raytracer.SetResolution(width, height);
+    raytracer.SetFOV((float)M_PI / 6.0f);
+    raytracer.SetCameraPosition(Vector3(0.0f, 0.15f, 0.5f));
+    raytracer.SetForward(Vector3(0.0f, 0.0f, -1.0f));
+}
+
+//build an exact and a binned tree of the same model and compare build time, size and the time to trace a frame
+static void RunBuildComparison(PLY_Model* model, const KDTreeBuildParams& binnedParams, uint16_t width, uint16_t height)
+{
+    KDTreeBuildParams exactParams = binnedParams;
+    exactParams.mode = kBuildModeExact;
+    const KDTreeBuildParams* params[] = { &exactParams, &binnedParams };
+    for (const KDTreeBuildParams* p : params)
+    {
+        Raytracer raytracer;
+        SetupDefaultCamera(raytracer, model, width, height);
+        raytracer.SetBuildParams(*p);
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        raytracer.Setup();
+        std::chrono::steady_clock::time_point built = std::chrono::steady_clock::now();
+        raytracer.SetUseKDTree(true);
+        raytracer.Trace();
+        std::chrono::steady_clock::time_point traced = std::chrono::steady_clock::now();
+        std::chrono::duration<double> buildTime = built - start;
+        std::chrono::duration<double> traceTime = traced - built;
+        const KDTree* tree = raytracer.GetKDTree();
+        if (p->mode == kBuildModeBinned)
+            printf("binned (%u bins, exact below %u):", p->binCount, p->exactThreshold);
+        else
+            printf("exact:");
+        printf(" build %f s, trace %f s, %zu nodes, %zu triangle references\n", buildTime.count(), traceTime.count(), tree->GetNodeCount(), tree->GetTriangleIndexCount());
+    }
+}
+
+//trace two frames with the eager and the lazy tree and compare the time to the first image and the work spent building
+static void RunLazyComparison(PLY_Model* model, const KDTreeBuildParams& params, uint16_t width, uint16_t height)
+{
+    for (int lazy = 0; lazy < 2; ++lazy)
+    {
+        Raytracer raytracer;
+        SetupDefaultCamera(raytracer, model, width, height);
+        raytracer.SetBuildParams(params);
+        raytracer.SetLazyBuild(lazy);
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        raytracer.Setup();
+        std::chrono::steady_clock::time_point built = std::chrono::steady_clock::now();
+        raytracer.Trace();
+        std::chrono::steady_clock::time_point first = std::chrono::steady_clock::now();
+        raytracer.Trace();
+        std::chrono::steady_clock::time_point second = std::chrono::steady_clock::now();
+        std::chrono::duration<double> setupTime = built - start;
+        std::chrono::duration<double> firstImageTime = first - start;
+        std::chrono::duration<double> secondTraceTime = second - first;
+        printf("%s: first image %f s (setup %f s), next frame %f s,", lazy ? "lazy" : "eager", firstImageTime.count(), setupTime.count(), secondTraceTime.count());
+        if (lazy)
+        {
+            const LazyKDTree* tree = raytracer.GetLazyKDTree();
+            printf(" %zu nodes expanded of %zu created, %zu triangles swept, %f s expanding\n", tree->GetExpandedNodeCount(), tree->GetNodeCount(),
+                tree->GetExpandedTriangleCount(), tree->GetExpansionSeconds());
+        }
+        else
+        {
+            const KDTree* tree = raytracer.GetKDTree();
+            printf(" %zu nodes built, %f s building nodes\n", tree->GetNodeCount(), tree->GetNodeBuildSeconds());
+        }
+    }
+}
+
+static const char* s_LeafFormatNames[] = { "indices", "edges", "wald", "blocks", "quantized" };
+
+//mirror rays leaving the hits of the primary rays, an incoherent second bounce
+static std::vector<Ray> CreateReflectionRays(const KDTree& tree, const TriangleMesh& mesh, const std::vector<Ray>& rays)
+{
+    std::vector<Ray> reflections;
+    for (const Ray& ray : rays)
+    {
+        uint32_t triangle;
+        float distance;
+        if (!tree.Intersect(ray, &triangle, &distance))
+            continue;
+        Vector3 n = mesh.GetTriangle(triangle).GetNormal();
+        float cosine = Vector3::Dot(ray.direction, n);
+        //start a little off the surface on the side the ray came from, so it does not hit its own triangle
+        Vector3 origin = ray.origin + ray.direction * distance + n * (cosine < 0.0f ? 1e-4f : -1e-4f);
+        reflections.push_back(Ray(origin, (ray.direction - n * 2.0f * cosine).Normalized()));
+    }
+    return reflections;
+}
+
+//best of 3 rounds of tracing the rays one by one on this thread
+static double MeasureRaysPerSecond(const KDTree& tree, const std::vector<Ray>& rays, bool stackless = false)
+{
+    double bestTime = std::numeric_limits<double>::max();
+    for (int i = 0; i < 3; ++i)
+    {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for (const Ray& ray : rays)
+        {
+            uint32_t triangle;
+            float distance;
+            if (stackless)
+                tree.IntersectStackless(ray, &triangle, &distance);
+            else
+                tree.Intersect(ray, &triangle, &distance);
+        }
+        std::chrono::duration<double> traceTime = std::chrono::steady_clock::now() - start;
+        bestTime = std::min(bestTime, traceTime.count());
+    }
+    return rays.size() / bestTime;
+}
+
+//closest hit of every ray, HIT_BATCH_MISS for the ones that miss
+static std::vector<KDTreeHit> TraceHits(const KDTree& tree, const std::vector<Ray>& rays)
+{
+    std::vector<KDTreeHit> hits(rays.size());
+    for (size_t i = 0; i < rays.size(); ++i)
+    {
+        if (!tree.Intersect(rays[i], &hits[i].triangle, &hits[i].t))
+            hits[i].triangle = HIT_BATCH_MISS;
+    }
+    return hits;
+}
+
+//how the hits of a tree differ from the reference tree's hits of the same rays
+struct HitDifferences
+{
+    //rays that hit another triangle, miss or hit something where the reference misses
+    size_t triangles = 0;
+    //rays that miss where the reference hits
+    size_t lost = 0;
+    //largest distance difference of the rays that hit in both
+    float distance = 0.0f;
+
+    void Add(const std::vector<KDTreeHit>& hits, const std::vector<KDTreeHit>& reference)
+    {
+        for (size_t i = 0; i < hits.size(); ++i)
+        {
+            triangles += hits[i].triangle != reference[i].triangle;
+            lost += hits[i].triangle == HIT_BATCH_MISS && reference[i].triangle != HIT_BATCH_MISS;
+            if (hits[i].triangle != HIT_BATCH_MISS && reference[i].triangle != HIT_BATCH_MISS)
+                distance = std::max(distance, fabsf(hits[i].t - reference[i].t));
+        }
+    }
+};
+
+//trace the same frame with every leaf format and compare rays per second, memory and the image. The primary and
+//reflection rays are also traced one by one on a single thread, which times the leaf kernels without packets,
+//and their hits are compared with the ones of the indices tree, which are also the ones of the full precision edges
+static void RunLeafFormatComparison(PLY_Model* model, KDTreeBuildParams params, uint16_t width, uint16_t height)
+{
+    std::vector<Color> reference;
+    std::vector<Ray> primaryRays;
+    std::vector<Ray> reflectionRays;
+    std::vector<KDTreeHit> primaryHits;
+    std::vector<KDTreeHit> reflectionHits;
+    for (int format = kLeafFormatIndices; format <= kLeafFormatQuantized; ++format)
+    {
+        Raytracer raytracer;
+        SetupDefaultCamera(raytracer, model, width, height);
+        params.leafFormat = (KDTreeLeafFormat)format;
+        raytracer.SetBuildParams(params);
+        raytracer.Setup();
+        std::vector<Color> image = raytracer.Trace();
+        double bestTime = std::numeric_limits<double>::max();
+        for (int i = 0; i < 3; ++i)
+        {
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            raytracer.Trace();
+            std::chrono::duration<double> traceTime = std::chrono::steady_clock::now() - start;
+            bestTime = std::min(bestTime, traceTime.count());
+        }
+        const KDTree* tree = raytracer.GetKDTree();
+        if (reference.empty())
+        {
+            reference = image;
+            for (uint16_t y = 0; y < height; ++y)
+            {
+                for (uint16_t x = 0; x < width; ++x)
+                {
+                    primaryRays.push_back(raytracer.GetCameraRay(x, y));
+                }
+            }
+            reflectionRays = CreateReflectionRays(*tree, model->mesh, primaryRays);
+            primaryHits = TraceHits(*tree, primaryRays);
+            reflectionHits = TraceHits(*tree, reflectionRays);
+        }
+        HitDifferences primaryDifferences;
+        HitDifferences reflectionDifferences;
+        primaryDifferences.Add(TraceHits(*tree, primaryRays), primaryHits);
+        reflectionDifferences.Add(TraceHits(*tree, reflectionRays), reflectionHits);
+        size_t differentPixels = 0;
+        for (size_t i = 0; i < image.size(); ++i)
+        {
+            differentPixels += image[i].r != reference[i].r || image[i].g != reference[i].g || image[i].b != reference[i].b;
+        }
+        //every format keeps the index array and the mesh, the leaf records come on top of them. The edges are the full
+        //precision copy of the vertices in the leaves, which the quantized vertices replace
+        size_t referenceCount = tree->GetTriangleIndexCount();
+        double leafBytes = (double)(referenceCount * sizeof(uint32_t) + tree->GetLeafTriangleBytes());
+        double edgeLeafBytes = (double)(referenceCount * (sizeof(uint32_t) + sizeof(EdgeTriangle)));
+        printf("%-9s %.2f Mrays/s, single rays on one thread %.2f primary and %.2f reflection Mrays/s, %.1f leaf bytes per triangle reference, "
+            "%.1f per triangle, %.1fx the leaf memory of indices and %.2fx of edges, %zu pixels differ from indices, %zu primary and "
+            "%zu reflection rays hit another triangle, %zu and %zu lose their hit, distances differ by up to %g and %g\n",
+            s_LeafFormatNames[format], width * height / bestTime * 1e-6, MeasureRaysPerSecond(*tree, primaryRays) * 1e-6,
+            MeasureRaysPerSecond(*tree, reflectionRays) * 1e-6, leafBytes / referenceCount, leafBytes / model->mesh.GetTriangleCount(),
+            leafBytes / (referenceCount * sizeof(uint32_t)), leafBytes / edgeLeafBytes, differentPixels, primaryDifferences.triangles,
+            reflectionDifferences.triangles, primaryDifferences.lost, reflectionDifferences.lost, primaryDifferences.distance,
+            reflectionDifferences.distance);
+    }
+}
+
+//trace the primary and reflection rays of a frame on one thread with and without mailboxes, for the leaf formats that
+//test one triangle at a time, and compare the triangle tests per ray, how many of them repeat a test, and the speed
+static void RunMailboxComparison(PLY_Model* model, KDTreeBuildParams params, uint16_t width, uint16_t height)
+{
+    std::vector<Ray> primaryRays;
+    std::vector<Ray> reflectionRays;
+    for (int format = kLeafFormatIndices; format <= kLeafFormatWald; ++format)
+    {
+        params.leafFormat = (KDTreeLeafFormat)format;
+        std::vector<uint32_t> triangles[2];
+        for (int mailboxes = 0; mailboxes < 2; ++mailboxes)
+        {
+            Raytracer raytracer;
+            SetupDefaultCamera(raytracer, model, width, height);
+            params.mailboxes = mailboxes != 0;
+            raytracer.SetBuildParams(params);
+            raytracer.Setup();
+            const KDTree* tree = raytracer.GetKDTree();
+            if (primaryRays.empty())
+            {
+                for (uint16_t y = 0; y < height; ++y)
+                {
+                    for (uint16_t x = 0; x < width; ++x)
+                    {
+                        primaryRays.push_back(raytracer.GetCameraRay(x, y));
+                    }
+                }
+                reflectionRays = CreateReflectionRays(*tree, model->mesh, primaryRays);
+            }
+            for (const std::vector<Ray>* rays : { &primaryRays, &reflectionRays })
+            {
+                KDTraversalStats stats;
+                for (const Ray& ray : *rays)
+                {
+                    uint32_t triangle = ~0u;
+                    float distance;
+                    tree->Intersect(ray, &triangle, &distance, &stats);
+                    triangles[mailboxes].push_back(triangle);
+                }
+                printf("%-8s %-10s %-12s %.2f Mrays/s, per ray %.1f triangle tests of which %.1f skipped (%.1f%%)\n", s_LeafFormatNames[format],
+                    rays == &primaryRays ? "primary" : "reflection", mailboxes ? "mailboxes" : "no mailboxes", MeasureRaysPerSecond(*tree, *rays) * 1e-6,
+                    (double)stats.triangleTests / rays->size(), (double)stats.mailboxSkips / rays->size(), 100.0 * stats.mailboxSkips / stats.triangleTests);
+            }
+        }
+        size_t differentHits = 0;
+        for (size_t i = 0; i < triangles[0].size(); ++i)
+        {
+            differentHits += triangles[0][i] != triangles[1][i];
+        }
+        printf("%-8s %zu rays hit a different triangle with mailboxes\n", s_LeafFormatNames[format], differentHits);
+    }
+}
+
+//trace every primary ray of a frame on one thread with the recursive and the front to back traversal, and compare
+//their speed and the nodes and triangles each ray visits
+static void RunTraversalComparison(PLY_Model* model, const KDTreeBuildParams& params, uint16_t width, uint16_t height)
+{
+    Raytracer raytracer;
+    SetupDefaultCamera(raytracer, model, width, height);
+    raytracer.SetBuildParams(params);
+    raytracer.Setup();
+    const KDTree* tree = raytracer.GetKDTree();
+    std::vector<Ray> rays;
+    for (uint16_t y = 0; y < height; ++y)
+    {
+        for (uint16_t x = 0; x < width; ++x)
+        {
+            rays.push_back(raytracer.GetCameraRay(x, y));
+        }
+    }
+    std::vector<float> distances[2];
+    for (int frontToBack = 0; frontToBack < 2; ++frontToBack)
+    {
+        KDTraversalStats stats;
+        size_t hits = 0;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for (const Ray& ray : rays)
+        {
+            uint32_t triangle;
+            float distance;
+            bool hit = frontToBack ? tree->Intersect(ray, &triangle, &distance, &stats) : tree->IntersectRecursive(ray, &triangle, &distance, &stats);
+            distances[frontToBack].push_back(hit ? distance : -1.0f);
+            hits += hit;
+        }
+        std::chrono::duration<double> traceTime = std::chrono::steady_clock::now() - start;
+        printf("%-13s %.2f Mrays/s, per ray %.1f inner nodes, %.1f leaves, %.1f triangle tests, %zu hits\n", frontToBack ? "front to back" : "recursive",
+            rays.size() / traceTime.count() * 1e-6, (double)stats.innerNodes / rays.size(), (double)stats.leaves / rays.size(),
+            (double)stats.triangleTests / rays.size(), hits);
+    }
+    size_t differentHits = 0;
+    for (size_t i = 0; i < rays.size(); ++i)
+    {
+        differentHits += distances[0][i] != distances[1][i];
+    }
+    printf("%zu rays with a different nearest hit distance\n", differentHits);
+}
+
+//rings of small triangles around the middle of the default view, each ring half the size of the one outside it.
+//The builder cuts every ring out of the empty space around it, which makes a tree much deeper than a scanned model
+static std::unique_ptr<PLY_Model> CreateDeepModel(unsigned int ringCount, unsigned int trianglesPerRing)
+{
+    std::unique_ptr<PLY_Model> model(new PLY_Model());
+    std::vector<Triangle> triangles;
+    Vector3 center(0.0f, 0.15f, 0.0f);
+    for (unsigned int ring = 0; ring < ringCount; ++ring)
+    {
+        float radius = 0.1f * powf(0.5f, (float)ring);
+        float size = radius * 0.1f;
+        for (unsigned int i = 0; i < trianglesPerRing; ++i)
+        {
+            float angle = 2.0f * (float)M_PI * (i + 0.5f * ring) / trianglesPerRing;
+            Vector3 p = center + Vector3(cosf(angle), sinf(angle), 0.0f) * radius;
+            triangles.push_back(Triangle(p, p + Vector3(size, 0.0f, 0.0f), p + Vector3(0.0f, size, size * 0.5f)));
+        }
+    }
+    model->mesh = TriangleMesh::FromTriangles(triangles);
+    model->aabb.min = model->aabb.max = center;
+    for (const Triangle& triangle : triangles)
+    {
+        model->triangleNormals.push_back(triangle.GetNormal());
+        for (uint8_t k = kAxisX; k < kAxesCount; ++k)
+        {
+            model->aabb.min[k] = std::min(model->aabb.min[k], triangle.GetAxisMin((Axis)k));
+            model->aabb.max[k] = std::max(model->aabb.max[k], triangle.GetAxisMax((Axis)k));
+        }
+    }
+    return model;
+}
+
+//trace the primary and reflection rays of a frame of the model and of a deep synthetic scene on one thread, with the
+//stack and the stackless rope traversal, and compare their speed, the nodes each ray visits, the hits and the memory
+static void RunRopeComparison(PLY_Model* model, KDTreeBuildParams params, uint16_t width, uint16_t height)
+{
+    std::unique_ptr<PLY_Model> deepModel = CreateDeepModel(20, 2000);
+    params.ropes = true;
+    for (PLY_Model* scene : { model, deepModel.get() })
+    {
+        Raytracer raytracer;
+        SetupDefaultCamera(raytracer, scene, width, height);
+        raytracer.SetBuildParams(params);
+        raytracer.Setup();
+        const KDTree* tree = raytracer.GetKDTree();
+        KDTreeStats treeStats = tree->ComputeStats(params.costModel);
+        printf("%s: %zu triangles, %zu nodes, depth max %u, average %.2f, ropes %.1f KB, %.1f bytes per node on top of %zu\n",
+            scene == model ? "model" : "deep scene", scene->mesh.GetTriangleCount(), treeStats.nodeCount, treeStats.maxDepth,
+            treeStats.averageLeafDepth, treeStats.ropeBytes / 1024.0, (double)treeStats.ropeBytes / treeStats.nodeCount, sizeof(KDTreeNode));
+        std::vector<Ray> primaryRays;
+        for (uint16_t y = 0; y < height; ++y)
+        {
+            for (uint16_t x = 0; x < width; ++x)
+            {
+                primaryRays.push_back(raytracer.GetCameraRay(x, y));
+            }
+        }
+        std::vector<Ray> reflectionRays = CreateReflectionRays(*tree, scene->mesh, primaryRays);
+        for (const std::vector<Ray>* rays : { &primaryRays, &reflectionRays })
+        {
+            const char* rayName = rays == &primaryRays ? "primary" : "reflection";
+            std::vector<float> distances[2];
+            for (int stackless = 0; stackless < 2; ++stackless)
+            {
+                KDTraversalStats stats;
+                for (const Ray& ray : *rays)
+                {
+                    uint32_t triangle;
+                    float distance;
+                    bool hit = stackless ? tree->IntersectStackless(ray, &triangle, &distance, &stats) : tree->Intersect(ray, &triangle, &distance, &stats);
+                    distances[stackless].push_back(hit ? distance : -1.0f);
+                }
+                printf("  %-10s %-9s %.2f Mrays/s, per ray %.1f inner nodes, %.1f leaves\n", rayName, stackless ? "ropes" : "stack",
+                    MeasureRaysPerSecond(*tree, *rays, stackless) * 1e-6, (double)stats.innerNodes / rays->size(), (double)stats.leaves / rays->size());
+            }
+            size_t differentHits = 0;
+            for (size_t i = 0; i < rays->size(); ++i)
+            {
+                differentHits += distances[0][i] != distances[1][i];
+            }
+            printf("  %-10s %zu of %zu rays with a different nearest hit distance\n", rayName, differentHits, rays->size());
+        }
+    }
+}
+
+//time nearest hit, single occlusion and batched occlusion queries on the same rays on one thread, and count the rays
+//where the occlusion answer differs from a nearest hit closer than tMax
+static void CompareOcclusionQueries(const char* name, const KDTree& tree, const std::vector<Ray>& rays, const std::vector<float>& tMax)
+{
+    std::vector<uint8_t> nearestOccluded(rays.size());
+    std::vector<uint8_t> singleOccluded(rays.size());
+    std::unique_ptr<bool[]> batchOccluded(new bool[rays.size()]);
+    double seconds[3];
+    for (int query = 0; query < 3; ++query)
+    {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        if (query == 2)
+        {
+            tree.Occluded(rays.data(), tMax.data(), rays.size(), batchOccluded.get());
+        }
+        for (size_t i = 0; query < 2 && i < rays.size(); ++i)
+        {
+            uint32_t triangle;
+            float distance;
+            if (query == 0)
+                nearestOccluded[i] = tree.Intersect(rays[i], &triangle, &distance) && distance < tMax[i];
+            else
+                singleOccluded[i] = tree.Occluded(rays[i], tMax[i]);
+        }
+        std::chrono::duration<double> queryTime = std::chrono::steady_clock::now() - start;
+        seconds[query] = queryTime.count();
+    }
+    size_t occluded = 0, different = 0;
+    for (size_t i = 0; i < rays.size(); ++i)
+    {
+        occluded += nearestOccluded[i];
+        different += nearestOccluded[i] != singleOccluded[i] || nearestOccluded[i] != batchOccluded[i];
+    }
+    printf("%-17s %zu rays, %.1f%% occluded: nearest hit %.2f Mrays/s, occluded %.2f Mrays/s (%.2fx), batched %.2f Mrays/s (%.2fx), %zu differ\n",
+        name, rays.size(), 100.0 * occluded / rays.size(), rays.size() / seconds[0] * 1e-6, rays.size() / seconds[1] * 1e-6, seconds[0] / seconds[1],
+        rays.size() / seconds[2] * 1e-6, seconds[0] / seconds[2], different);
+}
+
+//shadow rays from the hits of the primary rays to a point light, and short ambient occlusion rays around the hit normals
+static void RunOcclusionComparison(PLY_Model* model, const KDTreeBuildParams& params, uint16_t width, uint16_t height)
+{
+    static const int kAmbientRays = 4;
+    Raytracer raytracer;
+    SetupDefaultCamera(raytracer, model, width, height);
+    raytracer.SetBuildParams(params);
+    raytracer.Setup();
+    const KDTree* tree = raytracer.GetKDTree();
+    Vector3 light(-0.3f, 0.5f, 0.4f);
+    std::vector<Ray> shadowRays, ambientRays;
+    std::vector<float> shadowTMax, ambientTMax;
+    srand(1);
+    for (uint16_t y = 0; y < height; ++y)
+    {
+        for (uint16_t x = 0; x < width; ++x)
+        {
+            Ray ray = raytracer.GetCameraRay(x, y);
+            uint32_t triangle;
+            float distance;
+            if (!tree->Intersect(ray, &triangle, &distance))
+                continue;
+            //leave the surface on the side the camera sees
+            Vector3 n = model->mesh.GetTriangle(triangle).GetNormal();
+            if (Vector3::Dot(ray.direction, n) > 0.0f)
+                n = n * -1.0f;
+            Vector3 origin = ray.origin + ray.direction * distance + n * 1e-4f;
+            //the direction reaches the light at t = 1
+            shadowRays.push_back(Ray(origin, light - origin));
+            shadowTMax.push_back(1.0f);
+            for (int i = 0; i < kAmbientRays; ++i)
+            {
+                Vector3 direction(rand() / (float)RAND_MAX * 2.0f - 1.0f, rand() / (float)RAND_MAX * 2.0f - 1.0f, rand() / (float)RAND_MAX * 2.0f - 1.0f);
+                if (Vector3::Dot(direction, n) < 0.0f)
+                    direction = direction * -1.0f;
+                ambientRays.push_back(Ray(origin, direction.Normalized()));
+                ambientTMax.push_back(0.01f);
+            }
+        }
+    }
+    CompareOcclusionQueries("shadow", *tree, shadowRays, shadowTMax);
+    CompareOcclusionQueries("ambient occlusion", *tree, ambientRays, ambientTMax);
+}
+
+//trace a set of rays one by one and as batches, unsorted and sorted on one thread and sorted on all threads, and
+//compare the rays per second. Counts the rays whose batch result differs from the single ray one
+static void CompareRayBatches(const char* name, const KDTree& tree, const RayBatch& rays)
+{
+    std::vector<uint32_t> singleTriangles(rays.GetCount(), HIT_BATCH_MISS);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < rays.GetCount(); ++i)
+    {
+        float distance;
+        tree.Intersect(rays.GetRay(i), &singleTriangles[i], &distance);
+    }
+    std::chrono::duration<double> singleTime = std::chrono::steady_clock::now() - start;
+    printf("%-8s %zu rays, single rays on one thread %.2f Mrays/s\n", name, rays.GetCount(), rays.GetCount() / singleTime.count() * 1e-6);
+    unsigned int hardwareThreads = TaskScheduler::GetHardwareThreadCount();
+    for (int run = 0; run < 3; ++run)
+    {
+        KDTreeBatchParams batchParams;
+        batchParams.sortRays = run > 0;
+        batchParams.threadCount = run == 2 ? hardwareThreads : 1;
+        HitBatch hits;
+        start = std::chrono::steady_clock::now();
+        size_t hitCount = tree.Intersect(rays, &hits, batchParams);
+        std::chrono::duration<double> batchTime = std::chrono::steady_clock::now() - start;
+        size_t differentHits = 0;
+        for (size_t i = 0; i < rays.GetCount(); ++i)
+        {
+            differentHits += hits.triangles[i] != singleTriangles[i];
+        }
+        printf("  batch %-8s on %2u threads %.2f Mrays/s, %zu hits, %zu differ from single rays\n", batchParams.sortRays ? "sorted" : "unsorted",
+            batchParams.threadCount, rays.GetCount() / batchTime.count() * 1e-6, hitCount, differentHits);
+    }
+}
+
+//batch queries on the primary rays of a frame at twice the resolution, in scanline order, and on as many rays with
+//random origins inside the model's bounds and random directions
+static void RunBatchComparison(PLY_Model* model, const KDTreeBuildParams& params, uint16_t width, uint16_t height)
+{
+    Raytracer raytracer;
+    SetupDefaultCamera(raytracer, model, width * 2, height * 2);
+    raytracer.SetBuildParams(params);
+    raytracer.Setup();
+    RayBatch coherentRays, randomRays;
+    for (uint16_t y = 0; y < height * 2; ++y)
+    {
+        for (uint16_t x = 0; x < width * 2; ++x)
+        {
+            coherentRays.Add(raytracer.GetCameraRay(x, y));
+        }
+    }
+    srand(1);
+    Vector3 size = model->aabb.max - model->aabb.min;
+    for (size_t i = 0; i < coherentRays.GetCount(); ++i)
+    {
+        Vector3 origin = model->aabb.min + Vector3(size.x * rand() / RAND_MAX, size.y * rand() / RAND_MAX, size.z * rand() / RAND_MAX);
+        Vector3 direction(rand() / (float)RAND_MAX * 2.0f - 1.0f, rand() / (float)RAND_MAX * 2.0f - 1.0f, rand() / (float)RAND_MAX * 2.0f - 1.0f);
+        randomRays.Add(Ray(origin, direction.Normalized()));
+    }
+    CompareRayBatches("coherent", *raytracer.GetKDTree(), coherentRays);
+    CompareRayBatches("random", *raytracer.GetKDTree(), randomRays);
+}
+
+//closest point queries for a set of points on one thread, as a batch on all threads, and by testing every triangle of the mesh
+//for the first few points. Counts the points whose closest distance differs from the brute force one
+static void CompareClosestPoints(const char* name, const KDTree& tree, const TriangleMesh& mesh, const std::vector<Vector3>& points)
+{
+    static const size_t kBruteForcePoints = 1000;
+    float maxDist = std::numeric_limits<float>::infinity();
+    std::vector<KDTreeClosestPoint> results(points.size());
+    KDTraversalStats stats;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < points.size(); ++i)
+    {
+        tree.ClosestPoint(points[i], maxDist, &results[i], &stats);
+    }
+    std::chrono::duration<double> singleTime = std::chrono::steady_clock::now() - start;
+    unsigned int hardwareThreads = TaskScheduler::GetHardwareThreadCount();
+    std::vector<KDTreeClosestPoint> batchResults(points.size());
+    start = std::chrono::steady_clock::now();
+    tree.ClosestPoints(points.data(), points.size(), maxDist, batchResults.data(), hardwareThreads);
+    std::chrono::duration<double> batchTime = std::chrono::steady_clock::now() - start;
+    size_t bruteForceCount = std::min(points.size(), kBruteForcePoints);
+    size_t different = 0;
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < bruteForceCount; ++i)
+    {
+        float closest = std::numeric_limits<float>::infinity();
+        for (uint32_t triangle = 0; triangle < mesh.GetTriangleCount(); ++triangle)
+        {
+            float u, v;
+            Vector3 point = ClosestPointOnTriangle(mesh.GetTriangle(triangle), points[i], &u, &v);
+            closest = std::min(closest, (point - points[i]).SqrMagnitude());
+        }
+        different += std::sqrt(closest) != results[i].distance;
+    }
+    std::chrono::duration<double> bruteForceTime = std::chrono::steady_clock::now() - start;
+    for (size_t i = 0; i < points.size(); ++i)
+    {
+        different += batchResults[i].distance != results[i].distance;
+    }
+    double bruteForceRate = bruteForceCount / bruteForceTime.count();
+    printf("%-8s %zu points, %.1f nodes and %.1f triangles per query\n", name, points.size(),
+        (double)(stats.innerNodes + stats.leaves) / points.size(), (double)stats.triangleTests / points.size());
+    printf("  brute force on one thread %.0f points/s, kd-Tree on one thread %.0f points/s (%.0fx), batch on %u threads %.0f points/s (%.0fx), %zu differ\n",
+        bruteForceRate, points.size() / singleTime.count(), points.size() / singleTime.count() / bruteForceRate, hardwareThreads,
+        points.size() / batchTime.count(), points.size() / batchTime.count() / bruteForceRate, different);
+}
+
+//the triangle tests of the range queries
+static bool OverlapsRegion(const AABB& box, const Triangle& triangle)
+{
+    return TriangleOverlapsBox(triangle, box);
+}
+
+static bool OverlapsRegion(const Frustum& frustum, const Triangle& triangle)
+{
+    return frustum.Overlaps(triangle);
+}
+
+//answer range queries with the tree and by testing every triangle of the mesh for the first few of them, print the queries per
+//second, the work per query and the queries whose triangle count differs. Region is an AABB or a Frustum
+template<typename Region>
+static void CompareRangeQueries(const char* name, const KDTree& tree, const TriangleMesh& mesh, const std::vector<Region>& regions)
+{
+    static const size_t kBruteForceQueries = 20;
+    std::vector<uint32_t> triangles(mesh.GetTriangleCount());
+    std::vector<size_t> counts(regions.size());
+    KDTraversalStats stats;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < regions.size(); ++i)
+    {
+        counts[i] = tree.FindTriangles(regions[i], triangles.data(), triangles.size(), &stats);
+    }
+    std::chrono::duration<double> treeTime = std::chrono::steady_clock::now() - start;
+    size_t bruteForceCount = std::min(regions.size(), kBruteForceQueries);
+    size_t different = 0, found = 0;
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < bruteForceCount; ++i)
+    {
+        size_t count = 0;
+        for (uint32_t triangle = 0; triangle < mesh.GetTriangleCount(); ++triangle)
+        {
+            count += OverlapsRegion(regions[i], mesh.GetTriangle(triangle));
+        }
+        different += count != counts[i];
+    }
+    std::chrono::duration<double> bruteForceTime = std::chrono::steady_clock::now() - start;
+    for (size_t count : counts)
+    {
+        found += count;
+    }
+    double bruteForceRate = bruteForceCount / bruteForceTime.count();
+    double treeRate = regions.size() / treeTime.count();
+    printf("%-7s %zu queries, %.1f triangles found, %.1f nodes, %.1f triangles tested and %.1f duplicates skipped per query\n", name, regions.size(),
+        (double)found / regions.size(), (double)(stats.innerNodes + stats.leaves) / regions.size(), (double)stats.triangleTests / regions.size(),
+        (double)stats.mailboxSkips / regions.size());
+    printf("  brute force %.0f queries/s, kd-Tree %.0f queries/s (%.0fx), %zu differ\n", bruteForceRate, treeRate, treeRate / bruteForceRate, different);
+}
+
+//box queries of three sizes around random vertices of the model, like the cells of a streaming or collision grid, and frustum
+//queries of cameras that look at random points of it with a narrow and a wide field of view
+static void RunRangeQueryComparison(PLY_Model* model, const KDTreeBuildParams& params, uint16_t width, uint16_t height)
+{
+    static const size_t kQueryCount = 2000;
+    AABB aabb;
+    aabb.min = Vector3(-10, -10, -10);
+    aabb.max = Vector3(10, 10, 10);
+    KDTree tree(model->mesh, aabb, params);
+    Vector3 size = model->aabb.max - model->aabb.min;
+    float modelSize = std::max(std::max(size.x, size.y), size.z);
+    srand(1);
+    const float boxSizes[] = { 0.01f, 0.05f, 0.2f };
+    for (float boxSize : boxSizes)
+    {
+        std::vector<AABB> boxes;
+        for (size_t i = 0; i < kQueryCount; ++i)
+        {
+            Vector3 center = model->mesh.GetVertex((uint32_t)(rand() % model->mesh.GetVertexCount()));
+            Vector3 half(0.5f, 0.5f, 0.5f);
+            AABB box;
+            box.min = center - half * (boxSize * modelSize);
+            box.max = center + half * (boxSize * modelSize);
+            boxes.push_back(box);
+        }
+        char name[32];
+        snprintf(name, sizeof(name), "box %g", boxSize);
+        CompareRangeQueries(name, tree, model->mesh, boxes);
+    }
+    const float fovs[] = { (float)M_PI / 48.0f, (float)M_PI / 6.0f };
+    for (float fov : fovs)
+    {
+        std::vector<Frustum> frustums;
+        Raytracer raytracer;
+        SetupDefaultCamera(raytracer, model, width, height);
+        raytracer.SetFOV(fov);
+        for (size_t i = 0; i < kQueryCount; ++i)
+        {
+            Vector3 target = model->mesh.GetVertex((uint32_t)(rand() % model->mesh.GetVertexCount()));
+            raytracer.SetForward(target - Vector3(0.0f, 0.15f, 0.5f));
+            frustums.push_back(raytracer.GetFrustum(0.01f, 10.0f));
+        }
+        char name[32];
+        snprintf(name, sizeof(name), "fov %.1f", fov * 180.0f / (float)M_PI);
+        CompareRangeQueries(name, tree, model->mesh, frustums);
+    }
+}
+
+//closest points on the model to its vertices moved by up to 1% of its size, like the points of a scan that is registered
+//against it, and to random points in its bounds
+static void RunClosestPointComparison(PLY_Model* model, const KDTreeBuildParams& params)
+{
+    static const size_t kPointCount = 200000;
+    AABB aabb;
+    aabb.min = Vector3(-10, -10, -10);
+    aabb.max = Vector3(10, 10, 10);
+    KDTree tree(model->mesh, aabb, params);
+    std::vector<Vector3> scanPoints, randomPoints;
+    srand(1);
+    Vector3 size = model->aabb.max - model->aabb.min;
+    float jitter = std::max(std::max(size.x, size.y), size.z) * 0.01f;
+    for (size_t i = 0; i < kPointCount; ++i)
+    {
+        Vector3 offset(rand() / (float)RAND_MAX * 2.0f - 1.0f, rand() / (float)RAND_MAX * 2.0f - 1.0f, rand() / (float)RAND_MAX * 2.0f - 1.0f);
+        scanPoints.push_back(model->mesh.GetVertex((uint32_t)(rand() % model->mesh.GetVertexCount())) + offset * jitter);
+        randomPoints.push_back(model->aabb.min + Vector3(size.x * rand() / RAND_MAX, size.y * rand() / RAND_MAX, size.z * rand() / RAND_MAX));
+    }
+    CompareClosestPoints("scan", tree, model->mesh, scanPoints);
+    CompareClosestPoints("random", tree, model->mesh, randomPoints);
+}
+
+//trace the primary rays of frames at 1, 2 and 3 times the resolution on one thread, ray by ray and as packets of
+//the tiles Trace uses, and compare the speed, the nodes fetched per ray and the hits
+static void RunPacketComparison(PLY_Model* model, const KDTreeBuildParams& params, uint16_t baseWidth, uint16_t baseHeight)
+{
+    Raytracer raytracer;
+    SetupDefaultCamera(raytracer, model, baseWidth, baseHeight);
+    raytracer.SetBuildParams(params);
+    raytracer.Setup();
+    const KDTree* tree = raytracer.GetKDTree();
+    printf("%d rays per packet, %dx%d pixel tiles\n", SIMD_WIDTH, RAY_PACKET_WIDTH, RAY_PACKET_HEIGHT);
+    for (int scale = 1; scale <= 3; ++scale)
+    {
+        uint16_t width = baseWidth * scale;
+        uint16_t height = baseHeight * scale;
+        raytracer.SetResolution(width, height);
+        std::vector<RayPacket> packets;
+        for (uint16_t y = 0; y < height; y += RAY_PACKET_HEIGHT)
+        {
+            for (uint16_t x = 0; x < width; x += RAY_PACKET_WIDTH)
+            {
+                RayPacket packet;
+                for (uint16_t j = 0; j < RAY_PACKET_HEIGHT && y + j < height; ++j)
+                {
+                    for (uint16_t i = 0; i < RAY_PACKET_WIDTH && x + i < width; ++i)
+                    {
+                        packet.SetRay(j * RAY_PACKET_WIDTH + i, raytracer.GetCameraRay(x + i, y + j));
+                    }
+                }
+                packets.push_back(packet);
+            }
+        }
+        size_t rayCount = (size_t)width * height;
+        std::vector<uint32_t> triangles[2];
+        std::vector<float> distances[2];
+        double seconds[2];
+        KDTraversalStats stats[2];
+        for (int usePackets = 0; usePackets < 2; ++usePackets)
+        {
+            triangles[usePackets].assign(packets.size() * SIMD_WIDTH, ~0u);
+            distances[usePackets].assign(packets.size() * SIMD_WIDTH, -1.0f);
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            for (size_t p = 0; p < packets.size(); ++p)
+            {
+                uint32_t* packetTriangles = &triangles[usePackets][p * SIMD_WIDTH];
+                float* packetDistances = &distances[usePackets][p * SIMD_WIDTH];
+                uint32_t hits = 0;
+                if (usePackets)
+                {
+                    hits = tree->IntersectPacket(packets[p], packetTriangles, packetDistances, &stats[usePackets]);
+                }
+                else
+                {
+                    for (int lane = 0; lane < SIMD_WIDTH; ++lane)
+                    {
+                        if ((packets[p].activeMask >> lane) & 1 &&
+                            tree->Intersect(packets[p].GetRay(lane), &packetTriangles[lane], &packetDistances[lane], &stats[usePackets]))
+                            hits |= 1u << lane;
+                    }
+                }
+                for (int lane = 0; lane < SIMD_WIDTH; ++lane)
+                {
+                    if (!((hits >> lane) & 1))
+                        packetTriangles[lane] = ~0u;
+                }
+            }
+            std::chrono::duration<double> traceTime = std::chrono::steady_clock::now() - start;
+            seconds[usePackets] = traceTime.count();
+        }
+        size_t differentHits = 0;
+        for (size_t i = 0; i < triangles[0].size(); ++i)
+        {
+            differentHits += triangles[0][i] != triangles[1][i] || (triangles[0][i] != ~0u && distances[0][i] != distances[1][i]);
+        }
+        printf("%ux%u: single rays %.2f Mrays/s, packets %.2f Mrays/s (%.2fx), inner nodes fetched per ray %.1f and %.1f, %zu different hits\n",
+            width, height, rayCount / seconds[0] * 1e-6, rayCount / seconds[1] * 1e-6, seconds[0] / seconds[1],
+            (double)stats[0].innerNodes / rayCount, (double)stats[1].innerNodes / rayCount, differentHits);
+    }
+}
+
+//busy time of every trace thread, and how evenly the frame was spread over them
+static void PrintTraceStats(const TraceStats& stats)
+{
+    double busySeconds = 0.0;
+    double maxBusySeconds = 0.0;
+    for (size_t i = 0; i < stats.threads.size(); ++i)
+    {
+        const TraceThreadStats& thread = stats.threads[i];
+        printf("  trace thread %zu busy %f seconds (%.0f%%), %zu tiles\n", i, thread.busySeconds,
+            stats.seconds > 0.0 ? thread.busySeconds / stats.seconds * 100.0 : 0.0, thread.tileCount);
+        busySeconds += thread.busySeconds;
+        maxBusySeconds = std::max(maxBusySeconds, thread.busySeconds);
+    }
+    //1 when every thread was busy for the same time
+    if (maxBusySeconds > 0.0)
+        printf("  traced in %f seconds on %zu threads, load balance %.2f\n", stats.seconds, stats.threads.size(),
+            busySeconds / (maxBusySeconds * stats.threads.size()));
+}
+
+//count copies of the model in rows behind each other, each turned a little further, all sharing one kd-tree.
+//Moves the camera back so the front row is in view
+static void BuildInstanceGrid(Scene& scene, Raytracer& raytracer, const PLY_Model& model, const KDTreeBuildParams& params, unsigned int count)
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    uint32_t mesh = scene.AddMesh(model.mesh, params, model.triangleNormals.data());
+    std::chrono::steady_clock::time_point built = std::chrono::steady_clock::now();
+    unsigned int columns = (unsigned int)ceil(sqrt((double)count));
+    for (unsigned int i = 0; i < count; ++i)
+    {
+        Vector3 position(((float)(i % columns) - (columns - 1) * 0.5f) * 0.25f, 0.0f, -0.3f * (float)(i / columns));
+        scene.AddInstance(mesh, Transform::Translation(position) * Transform::RotationY(0.7f * i));
+    }
+    scene.Commit();
+    std::chrono::duration<double> meshTime = built - start;
+    std::chrono::duration<double> topLevelTime = std::chrono::steady_clock::now() - built;
+    KDTreeStats stats = scene.GetMeshTree(mesh).ComputeStats(params.costModel);
+    printf("Scene: %u instances of 1 mesh, kd-Tree %.1f MB built in %f seconds, top level %.1f KB built in %f seconds.\n", count,
+        stats.GetTotalBytes() / (1024.0 * 1024.0), meshTime.count(), scene.GetTopLevelBytes() / 1024.0, topLevelTime.count());
+    raytracer.SetScene(&scene);
+    raytracer.SetCameraPosition(Vector3(0.0f, 0.15f, 0.5f + 0.5f * columns));
+}
+
+static void PrintHistogram(const char* title, const std::vector<size_t>& histogram)
+{
+    size_t maxCount = *std::max_element(histogram.begin(), histogram.end());
+    printf("  %s:\n", title);
+    for (size_t i = 0; i < histogram.size(); ++i)
+    {
+        if (histogram[i])
+            printf("    %4zu %8zu %s\n", i, histogram[i], std::string(histogram[i] * 50 / maxCount, '#').c_str());
+    }
+}
+
+//print a summary of the tree and write all stats as JSON to jsonPath, "-" writes them to stdout
+static bool WriteTreeStats(const KDTree& tree, const SAHCostModel& costModel, const char* jsonPath)
+{
+    KDTreeStats stats = tree.ComputeStats(costModel);
+    printf("kd-Tree stats:\n");
+    printf("  %zu nodes, %zu inner, %zu leaves, %zu empty leaves\n", stats.nodeCount, stats.innerNodeCount, stats.leafCount, stats.emptyLeafCount);
+    printf("  depth max %u, average %.2f\n", stats.maxDepth, stats.averageLeafDepth);
+    printf("  leaf size max %u, average %.2f\n", stats.maxLeafSize, stats.averageLeafSize);
+    printf("  %zu triangles, %zu references, %.2f per triangle\n", stats.triangleCount, stats.triangleReferenceCount, stats.duplicationFactor);
+    printf("  per ray %.2f inner nodes, %.2f triangle tests, SAH cost %.2f\n", stats.expectedInnerNodeVisits, stats.expectedTriangleTests, stats.sahCost);
+    printf("  %.1f KB nodes, %.1f KB triangle indices, %.1f KB leaf triangles, %.1f KB ropes\n", stats.nodeBytes / 1024.0,
+        stats.triangleIndexBytes / 1024.0, stats.leafTriangleBytes / 1024.0, stats.ropeBytes / 1024.0);
+    PrintHistogram("leaf sizes", stats.leafSizeHistogram);
+    PrintHistogram("leaf depths", stats.depthHistogram);
+    if (!strcmp(jsonPath, "-"))
+        return stats.WriteJSON(stdout);
+    FILE* file = fopen(jsonPath, "w");
+    if (!file)
+        return false;
+    bool ok = stats.WriteJSON(file);
+    return fclose(file) == 0 && ok;
+}
+
 #define WINDOW_WIDTH 640
 #define WINDOW_HEIGHT 480
 
@@ -37,9 +927,61 @@ int main(int argc, char** argv)
 {
     bool useKDTree = true;
     bool interactive = false;
+    bool buildScaling = false;
+    bool compareBuilds = false;
+    bool lazyBuild = false;
+    bool compareLazy = false;
+    bool compareLeafFormats = false;
+    bool compareTraversal = false;
+    bool usePackets = true;
+    bool smoothNormals = false;
+    bool comparePackets = false;
+    bool compareOcclusion = false;
+    bool compareRopes = false;
+    bool compareBatches = false;
+    bool compareMailboxes = false;
+    bool compareClosestPoints = false;
+    bool compareRangeQueries = false;
+    const char* cachePath = nullptr;
+    const char* profilePath = nullptr;
+    const char* calibrationPath = nullptr;
+    const char* statsPath = nullptr;
+    unsigned int instanceCount = 0;
+    unsigned int traceThreads = 0;
+    KDTreeBuildParams buildParams;
     if (argc < 2)
     {
-        printf("Usage kd_tree_raytracer <ply_model_path>\n\tOptional Parameters:\n\t\t--no-kdtree Raytrace without kd-Tree\n\t\t--interactive Interactive windowed mode\n");
+        printf("Usage kd_tree_raytracer <ply_model_path>\n\tOptional Parameters:\n"
+            "\t\t--no-kdtree Raytrace without kd-Tree\n"
+            "\t\t--interactive Interactive windowed mode\n"
+            "\t\t--threads <n> Threads used to trace the image (default: all hardware threads)\n"
+            "\t\t--build-threads <n> Threads used to build the kd-Tree (default: all hardware threads)\n"
+            "\t\t--build-scaling Print kd-Tree build times for 1 to all hardware threads\n"
+            "\t\t--binned <bins> Build the kd-Tree with binned SAH instead of the exact sweep\n"
+            "\t\t--exact-below <n> Binned build switches to the exact sweep below n triangles\n"
+            "\t\t--perfect-splits Clip triangles against the nodes they cross instead of clamping their bounds\n"
+            "\t\t--compare-builds Compare build and trace time of the exact and the binned kd-Tree\n"
+            "\t\t--lazy-build Build kd-Tree nodes the first time a ray reaches them instead of before tracing\n"
+            "\t\t--leaf-format <indices|edges|wald|blocks|quantized> Precompute per triangle reference intersection data in the kd-Tree leaves\n"
+            "\t\t--compare-leaf-formats Compare trace speed and memory of the leaf formats\n"
+            "\t\t--mailboxes Test every triangle at most once per ray, even if the ray passes several leaves that reference it\n"
+            "\t\t--compare-mailboxes Compare speed and triangle tests of the traversal with and without mailboxes\n"
+            "\t\t--smooth-normals Shade with vertex normals interpolated at the hit, computed from the faces if the model has none\n"
+            "\t\t--no-packets Trace every primary ray on its own instead of in packets of neighbouring pixels\n"
+            "\t\t--compare-packets Compare primary ray speed of single rays and packets at several resolutions\n"
+            "\t\t--compare-batches Compare speed of single rays and sorted and unsorted ray batches on coherent and random rays\n"
+            "\t\t--compare-occlusion Compare speed of nearest hit and occlusion queries on shadow and ambient occlusion rays\n"
+            "\t\t--compare-closest-points Compare speed of kd-Tree and brute force closest point queries on scan and random points\n"
+            "\t\t--compare-range-queries Compare speed of kd-Tree and brute force box and frustum range queries\n"
+            "\t\t--ropes Link the kd-Tree leaves to their neighbours and trace the rays that are not in packets without a stack\n"
+            "\t\t--compare-ropes Compare speed and memory of the stack and the stackless rope traversal on the model and a deep scene\n"
+            "\t\t--compare-traversal Compare speed and visited nodes of the recursive and the front to back kd-Tree traversal\n"
+            "\t\t--compare-lazy Compare time to the first image and build work of the eager and the lazy kd-Tree\n"
+            "\t\t--sah-profile <path> Build the kd-Tree with the SAH cost model of this profile\n"
+            "\t\t--calibrate-sah <path> Measure the SAH cost model on this machine and write it to a profile\n"
+            "\t\t--kdtree-cache <path> Map the kd-Tree from this file, or build and write it if it is missing or out of date\n"
+            "\t\t--instances <n> Render n instances of the model that share one kd-Tree\n"
+            "\t\t--tree-stats <path> Print kd-Tree statistics and write them as JSON to path (- for stdout) instead of rendering\n");
         return 1;
     }
     for (int i = 0; i < argc; ++i)
@@ -48,25 +990,191 @@ int main(int argc, char** argv)
             useKDTree = false;
         else if (!strcmp(argv[i], "--interactive"))
             interactive = true;
+        else if (!strcmp(argv[i], "--threads") && i + 1 < argc)
+            traceThreads = (unsigned int)atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--build-threads") && i + 1 < argc)
+            buildParams.threadCount = (unsigned int)atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--build-scaling"))
+            buildScaling = true;
+        else if (!strcmp(argv[i], "--binned") && i + 1 < argc)
+        {
+            buildParams.mode = kBuildModeBinned;
+            buildParams.binCount = (unsigned int)atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--exact-below") && i + 1 < argc)
+            buildParams.exactThreshold = (unsigned int)atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--perfect-splits"))
+            buildParams.perfectSplits = true;
+        else if (!strcmp(argv[i], "--compare-builds"))
+            compareBuilds = true;
+        else if (!strcmp(argv[i], "--lazy-build"))
+            lazyBuild = true;
+        else if (!strcmp(argv[i], "--compare-lazy"))
+            compareLazy = true;
+        else if (!strcmp(argv[i], "--leaf-format") && i + 1 < argc)
+        {
+            ++i;
+            for (int format = kLeafFormatIndices; format <= kLeafFormatQuantized; ++format)
+            {
+                if (!strcmp(argv[i], s_LeafFormatNames[format]))
+                    buildParams.leafFormat = (KDTreeLeafFormat)format;
+            }
+        }
+        else if (!strcmp(argv[i], "--compare-leaf-formats"))
+            compareLeafFormats = true;
+        else if (!strcmp(argv[i], "--mailboxes"))
+            buildParams.mailboxes = true;
+        else if (!strcmp(argv[i], "--compare-mailboxes"))
+            compareMailboxes = true;
+        else if (!strcmp(argv[i], "--smooth-normals"))
+            smoothNormals = true;
+        else if (!strcmp(argv[i], "--no-packets"))
+            usePackets = false;
+        else if (!strcmp(argv[i], "--compare-packets"))
+            comparePackets = true;
+        else if (!strcmp(argv[i], "--compare-batches"))
+            compareBatches = true;
+        else if (!strcmp(argv[i], "--compare-occlusion"))
+            compareOcclusion = true;
+        else if (!strcmp(argv[i], "--compare-closest-points"))
+            compareClosestPoints = true;
+        else if (!strcmp(argv[i], "--compare-range-queries"))
+            compareRangeQueries = true;
+        else if (!strcmp(argv[i], "--ropes"))
+            buildParams.ropes = true;
+        else if (!strcmp(argv[i], "--compare-ropes"))
+            compareRopes = true;
+        else if (!strcmp(argv[i], "--compare-traversal"))
+            compareTraversal = true;
+        else if (!strcmp(argv[i], "--kdtree-cache") && i + 1 < argc)
+            cachePath = argv[++i];
+        else if (!strcmp(argv[i], "--sah-profile") && i + 1 < argc)
+            profilePath = argv[++i];
+        else if (!strcmp(argv[i], "--calibrate-sah") && i + 1 < argc)
+            calibrationPath = argv[++i];
+        else if (!strcmp(argv[i], "--instances") && i + 1 < argc)
+            instanceCount = (unsigned int)atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--tree-stats") && i + 1 < argc)
+            statsPath = argv[++i];
+    }
+
+    if (calibrationPath)
+    {
+        SAHCostModel costModel = Raytracer::CalibrateCostModel();
+        printf("SAH cost model: traversal %g, intersection %g, lambda bias %g\n", costModel.traversal, costModel.intersection, costModel.lambdaBias);
+        if (!SaveSAHProfile(calibrationPath, costModel))
+        {
+            printf("Could not write SAH profile %s.\n", calibrationPath);
+            return 1;
+        }
+        return 0;
+    }
+    if (profilePath && !LoadSAHProfile(profilePath, &buildParams.costModel))
+    {
+        printf("Could not read SAH profile %s.\n", profilePath);
+        return 1;
     }
 
     uint16_t width = WINDOW_WIDTH, height = WINDOW_HEIGHT;
     std::unique_ptr<PLY_Model> model = Read_PLY_Model(argv[1]);
+    if (buildScaling)
+    {
+        RunBuildScaling(*model, buildParams);
+        return 0;
+    }
+    if (compareBuilds)
+    {
+        buildParams.mode = kBuildModeBinned;
+        RunBuildComparison(model.get(), buildParams, width, height);
+        return 0;
+    }
+    if (compareLeafFormats)
+    {
+        RunLeafFormatComparison(model.get(), buildParams, width, height);
+        return 0;
+    }
+    if (compareMailboxes)
+    {
+        RunMailboxComparison(model.get(), buildParams, width, height);
+        return 0;
+    }
+    if (comparePackets)
+    {
+        RunPacketComparison(model.get(), buildParams, width, height);
+        return 0;
+    }
+    if (compareBatches)
+    {
+        RunBatchComparison(model.get(), buildParams, width, height);
+        return 0;
+    }
+    if (compareOcclusion)
+    {
+        RunOcclusionComparison(model.get(), buildParams, width, height);
+        return 0;
+    }
+    if (compareClosestPoints)
+    {
+        RunClosestPointComparison(model.get(), buildParams);
+        return 0;
+    }
+    if (compareRangeQueries)
+    {
+        RunRangeQueryComparison(model.get(), buildParams, width, height);
+        return 0;
+    }
+    if (compareRopes)
+    {
+        RunRopeComparison(model.get(), buildParams, width, height);
+        return 0;
+    }
+    if (compareTraversal)
+    {
+        RunTraversalComparison(model.get(), buildParams, width, height);
+        return 0;
+    }
+    if (compareLazy)
+    {
+        RunLazyComparison(model.get(), buildParams, width, height);
+        return 0;
+    }
+    Scene scene;
     Raytracer raytracer;
-    raytracer.SetModel(model.get());
-    raytracer.SetResolution(width, height);
-    raytracer.SetFOV((float)M_PI / 6.0f);
-    raytracer.SetCameraPosition(Vector3(0.0f, 0.15f, 0.5f));
-    raytracer.Setup();
+    SetupDefaultCamera(raytracer, model.get(), width, height);
+    raytracer.SetBuildParams(buildParams);
+    raytracer.SetCachePath(cachePath);
+    //the stats need the complete tree
+    raytracer.SetLazyBuild(lazyBuild && !statsPath);
+    if (instanceCount)
+        BuildInstanceGrid(scene, raytracer, *model, buildParams, instanceCount);
+    else
+        raytracer.Setup();
+    if (statsPath)
+    {
+        const KDTree& tree = instanceCount ? scene.GetMeshTree(0) : *raytracer.GetKDTree();
+        if (!WriteTreeStats(tree, buildParams.costModel, statsPath))
+        {
+            printf("Could not write kd-Tree stats %s.\n", statsPath);
+            return 1;
+        }
+        return 0;
+    }
     raytracer.SetUseKDTree(useKDTree);
+    raytracer.SetUsePackets(usePackets);
+    if (smoothNormals && model->vertexNormals.empty())
+        Compute_Vertex_Normals(model.get());
+    raytracer.SetSmoothShading(smoothNormals);
+    raytracer.SetThreadCount(traceThreads);
 
     if (!interactive)
     {
-        std::chrono::time_point<std::chrono::steady_clock> start = std::chrono::high_resolution_clock::now();
-        Write_Tga("image.tga", width, height, raytracer.Trace().data());
-        std::chrono::time_point<std::chrono::steady_clock> end = std::chrono::high_resolution_clock::now();
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        TraceStats traceStats;
+        Write_Tga("image.tga", width, height, raytracer.Trace(&traceStats).data());
+        std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
         std::chrono::duration<double> buildTime = end - start;
         std::cout <<  "Done. Took " << buildTime.count() << " seconds." << std::endl;
+        PrintTraceStats(traceStats);
     }
     else
     {
@@ -1,7 +1,10 @@
 #include "kdnode.h"
 #include <algorithm>
+#include <cstdint>
+#include <cstring>
 #include <limits>
 #include "kdtree.h"
+#include "task_scheduler.h"
 
 KDNode::KDNode() {}
 
@@ -12,20 +15,19 @@ enum SplitSide : uint8_t
     kSplitSideBoth
 };
 
-//These values are estimations of traversal and intersection cost, λ bias is to reward non-flat empty nodes
-#define LAMBDA_BIAS 0.8f
-#define K_TRAVERSAL 1.0f
-#define K_INTERSECTION 0.1f
+//nodes with at least this many triangles split their per-node work (sweep, classification, event splitting) into tasks
+#define PARALLEL_NODE_THRESHOLD 65536
+//nodes with at least this many triangles build their two subtrees as separate tasks
+#define PARALLEL_SUBTREE_THRESHOLD 1024
 
-inline float CalculateSurfaceArea(const AABB& aabb)
-{
-    float width = aabb.max[kAxisX] - aabb.min[kAxisX];
-    float height = aabb.max[kAxisY] - aabb.min[kAxisY];
-    float depth = aabb.max[kAxisZ] - aabb.min[kAxisZ];
-    return (width * height + depth * height + depth * width) * 2;
-}
+//event list radix sort: 3 passes of 12 bits cover the 34 bit key (32 bits position, 2 bits type)
+#define RADIX_BITS 12
+#define RADIX_SIZE (1 << RADIX_BITS)
+#define RADIX_PASSES 3
+//shorter lists use a stable comparison sort, which gives the same order
+#define RADIX_SORT_THRESHOLD 2048
 
-inline void SplitBox(const AABB& aabb, float pos, uint8_t axis, __restrict AABB* left, __restrict AABB* right)
+inline void SplitBox(const AABB& aabb, float pos, uint8_t axis, AABB* __restrict left, AABB* __restrict right)
 {
     *left = aabb;
     *right = aabb;
@@ -33,27 +35,27 @@ inline void SplitBox(const AABB& aabb, float pos, uint8_t axis, __restrict AABB*
     right->min[axis] = pos;
 }
 
-inline float UnitCost(float surfaceRatioL, float surfaceRatioR, float leftTriangles, float righTriangles, bool isEdge)
+inline float UnitCost(const SAHCostModel& costModel, float surfaceRatioL, float surfaceRatioR, float leftTriangles, float righTriangles, bool isEdge)
 {
-    float cost = K_TRAVERSAL + K_INTERSECTION * (surfaceRatioL * leftTriangles + surfaceRatioR * righTriangles);
+    float cost = costModel.traversal + costModel.intersection * (surfaceRatioL * leftTriangles + surfaceRatioR * righTriangles);
     if ((leftTriangles == 0 || righTriangles == 0) && !isEdge)
     {
-        cost *= LAMBDA_BIAS;
+        cost *= costModel.lambdaBias;
     }
     return cost;
 }
 
-inline float SurfaceAreaHeuristics(const AABB& parentVoxel, float rcpParentSurface, float pos, uint8_t axis, size_t leftTriangles, size_t rightTriangles, float planarTriangles, SplitSide* side)
+inline float SurfaceAreaHeuristics(const SAHCostModel& costModel, const AABB& parentVoxel, float rcpParentSurface, float pos, uint8_t axis, size_t leftTriangles, size_t rightTriangles, float planarTriangles, SplitSide* side)
 {
     bool isEdge = (pos == parentVoxel.min[axis] || pos == parentVoxel.max[axis]);
     if (isEdge)
         return std::numeric_limits<float>::infinity();
     AABB left, right;
     SplitBox(parentVoxel, pos, axis, &left, &right);
-    float pLeft = CalculateSurfaceArea(left) * rcpParentSurface;
-    float pRight = CalculateSurfaceArea(right) * rcpParentSurface;
-    float leftCost = UnitCost(pLeft, pRight, leftTriangles + planarTriangles, rightTriangles, isEdge);
-    float rightCost = UnitCost(pLeft, pRight, leftTriangles, rightTriangles + planarTriangles, isEdge);
+    float pLeft = left.GetSurfaceArea() * rcpParentSurface;
+    float pRight = right.GetSurfaceArea() * rcpParentSurface;
+    float leftCost = UnitCost(costModel, pLeft, pRight, leftTriangles + planarTriangles, rightTriangles, isEdge);
+    float rightCost = UnitCost(costModel, pLeft, pRight, leftTriangles, rightTriangles + planarTriangles, isEdge);
     //also decide where the planar triangles should go
     if (leftCost > rightCost)
     {
@@ -67,61 +69,92 @@ inline float SurfaceAreaHeuristics(const AABB& parentVoxel, float rcpParentSurfa
     }
 }
 
-//find the best splitting plane
-static float findPlane(const std::vector<Triangle>& triangles, const AABB& aabb, const std::vector<SAHEvent>* eventList, Axis* bestAxis, SplitSide* bestSide, float* bestCost)
+//find the best splitting plane along one axis
+static float FindAxisPlane(const SAHCostModel& costModel, size_t triangleCount, const AABB& aabb, float rcpParentSurface, const ArenaArray<SAHEvent>& events, Axis k, SplitSide* bestSide, float* bestCost)
+{
+    *bestCost = std::numeric_limits<float>::infinity();
+    float bestSplit = 0.0f;
+    int eventsLength = (int)events.size;
+    int nr = (int)triangleCount, np = 0, nl = 0;
+    for (int i = 0; i < eventsLength;)
+    {
+        const SAHEvent& event = events[i];
+        int p_minus = 0, p_planar = 0, p_plus = 0;
+        float pos = event.planePosition;
+        //count how many events ended, lied in the plane and started
+        while (i < eventsLength && events[i].planePosition == pos && events[i].type == kEventEnd)
+        {
+            i++;
+            p_minus++;
+        }
+        while (i < eventsLength && events[i].planePosition == pos && events[i].type == kEventPlanar)
+        {
+            i++;
+            p_planar++;
+        }
+        while (i < eventsLength && events[i].planePosition == pos && events[i].type == kEventStart)
+        {
+            i++;
+            p_plus++;
+        }
+        np = p_planar;
+        nr -= p_minus + p_planar;
+
+        SplitSide side;
+        float cost = SurfaceAreaHeuristics(costModel, aabb, rcpParentSurface, pos, k, nl, nr, np, &side);
+        if (cost < *bestCost)
+        {
+            *bestCost = cost;
+            *bestSide = side;
+            bestSplit = pos;
+        }
+        nl += p_plus + p_planar;
+    }
+    return bestSplit;
+}
+
+//find the best splitting plane, sweeping the three axes in parallel for big nodes
+static float findPlane(const KDBuildContext& context, size_t triangleCount, const AABB& aabb, const ArenaArray<SAHEvent>* eventList, Axis* bestAxis, SplitSide* bestSide, float* bestCost)
 {
+    float rcpParentSurface = 1.0f / aabb.GetSurfaceArea();
+    float splits[kAxesCount];
+    float costs[kAxesCount];
+    SplitSide sides[kAxesCount] = { kSplitSideBoth, kSplitSideBoth, kSplitSideBoth };
+    if (context.scheduler && triangleCount >= PARALLEL_NODE_THRESHOLD)
+    {
+        TaskGroup group;
+        for (uint8_t k = kAxisX; k < kAxesCount; ++k)
+        {
+            context.scheduler->Run(group, [&, k]() { splits[k] = FindAxisPlane(context.params->costModel, triangleCount, aabb, rcpParentSurface, eventList[k], (Axis)k, &sides[k], &costs[k]); });
+        }
+        context.scheduler->Wait(group);
+    }
+    else
+    {
+        for (uint8_t k = kAxisX; k < kAxesCount; ++k)
+        {
+            splits[k] = FindAxisPlane(context.params->costModel, triangleCount, aabb, rcpParentSurface, eventList[k], (Axis)k, &sides[k], &costs[k]);
+        }
+    }
+    //pick the first axis with the lowest cost, same as a single sweep over x, y, z would
     *bestCost = std::numeric_limits<float>::infinity();
-    float rcpParentSurface = 1.0f / CalculateSurfaceArea(aabb);
     float bestSplit = 0.0f;
     for (uint8_t k = kAxisX; k < kAxesCount; ++k)
     {
-        const std::vector<SAHEvent>& events = eventList[k];
-        int eventsLength = (int)events.size();
-        int nr = (int)triangles.size(), np = 0, nl = 0;
-        for (int i = 0; i < eventsLength;)
+        if (costs[k] < *bestCost)
         {
-            const SAHEvent& event = eventList[k][i];
-            int p_minus = 0, p_planar = 0, p_plus = 0;
-            float pos = event.planePosition;
-            //count how many events ended, lied in the plane and started
-            while (i < eventsLength && events[i].planePosition == pos && events[i].type == kEventEnd)
-            {
-                i++;
-                p_minus++;
-            }
-            while (i < eventsLength && events[i].planePosition == pos && events[i].type == kEventPlanar)
-            {
-                i++;
-                p_planar++;
-            }
-            while (i < eventsLength && events[i].planePosition == pos && events[i].type == kEventStart)
-            {
-                i++;
-                p_plus++;
-            }
-            np = p_planar;
-            nr -= p_minus + p_planar;
-            AABB left;
-            AABB right;
-
-            SplitSide side;
-            float cost = SurfaceAreaHeuristics(aabb, rcpParentSurface, pos, k, nl, nr, np, &side);
-            if (cost < *bestCost)
-            {
-                *bestCost = cost;
-                *bestSide = side;
-                *bestAxis = (Axis)k;
-                bestSplit = pos;
-            }
-            nl += p_plus + p_planar;
+            *bestCost = costs[k];
+            *bestSide = sides[k];
+            *bestAxis = (Axis)k;
+            bestSplit = splits[k];
         }
     }
     return bestSplit;
 }
 
-inline void ClassifyLeftRightBoth(const std::vector<SAHEvent>& axisEvents, float splitPos, int planarSide, std::vector<SplitSide>& sides)
+inline void ClassifyLeftRightBoth(const ArenaArray<SAHEvent>& axisEvents, size_t begin, size_t end, float splitPos, int planarSide, const ArenaArray<SplitSide>& sides)
 {
-    for (int i = 0; i < axisEvents.size(); ++i)
+    for (size_t i = begin; i < end; ++i)
     {
         const SAHEvent& event = axisEvents[i];
         //calculate how many events lie on each side of the split plane and save the side of the triangle for later sorting
@@ -147,185 +180,680 @@ inline void ClassifyLeftRightBoth(const std::vector<SAHEvent>& axisEvents, float
     }
 }
 
-inline void SplitTriangles(const std::vector<Triangle>& faces, const std::vector<SplitSide>& sides, std::vector<Triangle>& Tl, std::vector<Triangle>& Tr, std::vector<int>* triangleMap)
+static void ClassifyLeftRightBoth(const ArenaArray<SAHEvent>& axisEvents, float splitPos, int planarSide, const ArenaArray<SplitSide>& sides, TaskScheduler* scheduler)
+{
+    size_t count = axisEvents.size;
+    if (!scheduler || count < PARALLEL_NODE_THRESHOLD)
+    {
+        ClassifyLeftRightBoth(axisEvents, 0, count, splitPos, planarSide, sides);
+        return;
+    }
+    //a triangle whose start and end events share a position is written twice, and the later (start) event wins,
+    //so chunks only end where the plane position changes to keep both events in the same chunk
+    size_t chunkSize = count / scheduler->GetThreadCount() + 1;
+    TaskGroup group;
+    for (size_t begin = 0; begin < count;)
+    {
+        size_t end = std::min(begin + chunkSize, count);
+        while (end < count && axisEvents[end].planePosition == axisEvents[end - 1].planePosition)
+        {
+            end++;
+        }
+        scheduler->Run(group, [&, begin, end]() { ClassifyLeftRightBoth(axisEvents, begin, end, splitPos, planarSide, sides); });
+        begin = end;
+    }
+    scheduler->Wait(group);
+}
+
+//split the id list: left and right only triangles keep their order, the ones cut by the plane are appended to both sides.
+//triangleMap receives a triangle's new index, or its index in the stranded list for triangles on both sides
+static void SplitTriangles(StackArena& arena, const ArenaArray<uint32_t>& ids, const ArenaArray<SplitSide>& sides, const ArenaArray<uint32_t>& triangleMap,
+    ArenaArray<uint32_t>* idsL, ArenaArray<uint32_t>* idsR, ArenaArray<uint32_t>* stranded)
 {
-    Tl.reserve(faces.size());
-    Tr.reserve(faces.size());
-    for (int i = 0; i < faces.size(); ++i)
+    size_t counts[3] = { 0, 0, 0 };
+    for (size_t i = 0; i < ids.size; ++i)
+    {
+        counts[sides[i]]++;
+    }
+    *idsL = arena.AllocateArray<uint32_t>(counts[kSplitSideLeft] + counts[kSplitSideBoth]);
+    *idsR = arena.AllocateArray<uint32_t>(counts[kSplitSideRight] + counts[kSplitSideBoth]);
+    *stranded = arena.AllocateArray<uint32_t>(counts[kSplitSideBoth]);
+    ArenaArray<uint32_t>* outputs[3] = { idsL, idsR, stranded };
+    size_t sizes[3] = { 0, 0, 0 };
+    for (size_t i = 0; i < ids.size; ++i)
     {
         SplitSide side = sides[i];
-        //split the triangle list, while assigning the new id's to a list
+        triangleMap[i] = (uint32_t)sizes[side];
+        (*outputs[side])[sizes[side]++] = side == kSplitSideBoth ? (uint32_t)i : ids[i];
+    }
+    for (size_t s = 0; s < stranded->size; ++s)
+    {
+        uint32_t id = ids[(*stranded)[s]];
+        (*idsL)[counts[kSplitSideLeft] + s] = id;
+        (*idsR)[counts[kSplitSideRight] + s] = id;
+    }
+}
+
+inline void SplitEvents(const ArenaArray<SAHEvent>& axisEvents, const ArenaArray<SplitSide>& sides, const ArenaArray<uint32_t>& triangleMap, ArenaArray<SAHEvent>& leftEvents, ArenaArray<SAHEvent>& rightEvents)
+{
+    leftEvents.size = 0;
+    rightEvents.size = 0;
+    for (size_t i = 0; i < axisEvents.size; ++i)
+    {
+        SAHEvent event = axisEvents[i];
+        SplitSide side = sides[event.tri];
+        //if either left or right side, set the index to the corresponding array's space
         if (side == kSplitSideLeft)
         {
-            triangleMap[side][i] = (int)Tl.size();
-            Tl.push_back(faces[i]);
+            event.tri = triangleMap[event.tri];
+            leftEvents[leftEvents.size++] = event;
         }
-        if (side == kSplitSideRight)
+        else if (side == kSplitSideRight)
         {
-            triangleMap[side][i] = (int)Tr.size();
-            Tr.push_back(faces[i]);
+            event.tri = triangleMap[event.tri];
+            rightEvents[rightEvents.size++] = event;
         }
     }
 }
 
-inline void SplitEvents(const std::vector<SAHEvent>* events, const std::vector<SplitSide>& sides, std::vector<SAHEvent>* leftEvents, std::vector<SAHEvent>* rightEvents, const std::vector<int>* triangleMap)
+inline float ClampedAxisMin(const Triangle& tri, const AABB& aabb, Axis k)
 {
+    return std::min(std::max(tri.GetAxisMin(k), aabb.min[k]), aabb.max[k]);
+}
+
+inline float ClampedAxisMax(const Triangle& tri, const AABB& aabb, Axis k)
+{
+    return std::max(std::min(tri.GetAxisMax(k), aabb.max[k]), aabb.min[k]);
+}
+
+//Sutherland-Hodgman step, keeps the part of the polygon with sign * (p[k] - plane) <= 0
+static int ClipPolygon(const Vector3* polygon, int count, Axis k, float plane, float sign, Vector3* clipped)
+{
+    int clippedCount = 0;
+    for (int i = 0; i < count; ++i)
+    {
+        const Vector3& a = polygon[i];
+        const Vector3& b = polygon[(i + 1) % count];
+        float da = sign * (a[k] - plane);
+        float db = sign * (b[k] - plane);
+        if (da <= 0.0f)
+            clipped[clippedCount++] = a;
+        if ((da < 0.0f && db > 0.0f) || (da > 0.0f && db < 0.0f))
+        {
+            Vector3 p = a + (b - a) * (da / (da - db));
+            p[k] = plane;
+            clipped[clippedCount++] = p;
+        }
+    }
+    return clippedCount;
+}
+
+//bounds of the part of the triangle inside aabb. With perfect splits a triangle crossing the box is clipped
+//against it, otherwise its bounds are only clamped to the box
+static AABB TriangleBounds(const KDBuildContext& context, uint32_t id, const AABB& aabb)
+{
+    Triangle tri = context.mesh->GetTriangle(id);
+    AABB bounds;
+    bool inside = true;
+    for (uint8_t k = kAxisX; k < kAxesCount; ++k)
+    {
+        bounds.min[k] = ClampedAxisMin(tri, aabb, (Axis)k);
+        bounds.max[k] = ClampedAxisMax(tri, aabb, (Axis)k);
+        inside = inside && tri.GetAxisMin((Axis)k) >= aabb.min[k] && tri.GetAxisMax((Axis)k) <= aabb.max[k];
+    }
+    if (inside || !context.params->perfectSplits)
+        return bounds;
+    //every plane adds at most one vertex to the triangle
+    Vector3 polygon[9];
+    Vector3 clipped[9];
+    int count = 3;
+    std::copy(tri.vertices, tri.vertices + 3, polygon);
+    for (uint8_t k = kAxisX; k < kAxesCount && count; ++k)
+    {
+        count = ClipPolygon(polygon, count, (Axis)k, aabb.min[k], -1.0f, clipped);
+        count = ClipPolygon(clipped, count, (Axis)k, aabb.max[k], 1.0f, polygon);
+    }
+    //a triangle that only touches the box keeps the clamped bounds
+    if (!count)
+        return bounds;
+    //the clipped bounds are intersected with the clamped ones so rounding can never make them grow
+    for (uint8_t k = kAxisX; k < kAxesCount; ++k)
+    {
+        float lo = polygon[0][k];
+        float hi = polygon[0][k];
+        for (int i = 1; i < count; ++i)
+        {
+            lo = std::min(lo, polygon[i][k]);
+            hi = std::max(hi, polygon[i][k]);
+        }
+        bounds.min[k] = std::min(std::max(bounds.min[k], lo), bounds.max[k]);
+        bounds.max[k] = std::max(std::min(bounds.max[k], hi), bounds.min[k]);
+    }
+    return bounds;
+}
+
+//create two new events each time an event is cut in half by the split plane.
+//stranded triangle s sits at index firstLeft + s in the left and firstRight + s in the right id list, and
+//leftBounds[s], rightBounds[s] are its bounds inside the two children
+inline void CreateStrandedEvents(const KDBuildContext& context, const ArenaArray<uint32_t>& ids, const ArenaArray<uint32_t>& stranded, int firstLeft, int firstRight, Axis k,
+    const ArenaArray<AABB>& leftBounds, const ArenaArray<AABB>& rightBounds, ArenaArray<SAHEvent>& leftSplitEvents, ArenaArray<SAHEvent>& rightSplitEvents)
+{
+    leftSplitEvents.size = 0;
+    rightSplitEvents.size = 0;
+    for (size_t s = 0; s < stranded.size; ++s)
+    {
+        uint32_t id = ids[stranded[s]];
+        Triangle tri = context.mesh->GetTriangle(id);
+        int idL = firstLeft + (int)s;
+        int idR = firstRight + (int)s;
+        //if triangle is perpendicular to the axis (=lies inside the split plane), create two planar events
+        if (context.planarAxes[id] & (1 << k))
+        {
+            SAHEvent ev;
+            ev.planePosition = tri.GetAxisMin(k);
+            ev.type = kEventPlanar;
+
+            ev.tri = idL;
+            leftSplitEvents[leftSplitEvents.size++] = ev;
+
+            ev.tri = idR;
+            rightSplitEvents[rightSplitEvents.size++] = ev;
+        //otherwise, two starts/ends, two for each side
+        }
+        else
+        {
+            SAHEvent ev0, ev1;
+            ev0.type = kEventStart;
+            ev1.type = kEventEnd;
+
+            ev0.tri = ev1.tri = idL;
+            ev0.planePosition = leftBounds[s].min[k];
+            ev1.planePosition = leftBounds[s].max[k];
+            leftSplitEvents[leftSplitEvents.size++] = ev0;
+            leftSplitEvents[leftSplitEvents.size++] = ev1;
+
+            ev0.tri = ev1.tri = idR;
+            ev0.planePosition = rightBounds[s].min[k];
+            ev1.planePosition = rightBounds[s].max[k];
+            rightSplitEvents[rightSplitEvents.size++] = ev0;
+            rightSplitEvents[rightSplitEvents.size++] = ev1;
+        }
+    }
+}
+
+//events has room for the split events behind its own ones, so merge from the back without a temporary list
+inline void SortAndInsertSplitEvents(ArenaArray<SAHEvent>& events, ArenaArray<SAHEvent>& splitEvents)
+{
+    //We sort these, but they are usually really small and it is mostly sorted already
+    std::sort(splitEvents.begin(), splitEvents.end(), EventSortPredicate);
+    size_t i = events.size;
+    size_t j = splitEvents.size;
+    size_t out = i + j;
+    while (j > 0)
+    {
+        //on equal keys the existing event stays in front, like std::merge would keep it
+        if (i > 0 && EventSortPredicate(splitEvents[j - 1], events[i - 1]))
+            events[--out] = events[--i];
+        else
+            events[--out] = splitEvents[--j];
+    }
+    events.size += splitEvents.size;
+}
+
+//builds the event lists of both children, one task per axis and side for big nodes
+static void SplitNodeEvents(const KDBuildContext& context, StackArena& arena, const ArenaArray<uint32_t>& ids, const ArenaArray<SAHEvent>* events, const ArenaArray<SplitSide>& sides,
+    const ArenaArray<uint32_t>& triangleMap, const ArenaArray<uint32_t>& stranded, size_t leftCount, size_t rightCount,
+    const AABB& leftAABB, const AABB& rightAABB, ArenaArray<SAHEvent>* leftEvents, ArenaArray<SAHEvent>* rightEvents)
+{
+    //every triangle has at most two events per axis, so these bounds hold the merged lists too
+    ArenaArray<SAHEvent> leftSplitEvents[kAxesCount];
+    ArenaArray<SAHEvent> rightSplitEvents[kAxesCount];
     for (int k = 0; k < kAxesCount; ++k)
     {
-        leftEvents[k].reserve(events[k].size());
-        rightEvents[k].reserve(events[k].size());
-        const std::vector<SAHEvent>& axisEvents = events[k];
-        for (int i = 0; i < axisEvents.size(); ++i)
+        leftEvents[k] = arena.AllocateArray<SAHEvent>(2 * (leftCount + stranded.size));
+        rightEvents[k] = arena.AllocateArray<SAHEvent>(2 * (rightCount + stranded.size));
+        leftSplitEvents[k] = arena.AllocateArray<SAHEvent>(2 * stranded.size);
+        rightSplitEvents[k] = arena.AllocateArray<SAHEvent>(2 * stranded.size);
+    }
+    //the bounds are shared by the three axes, so clip each stranded triangle only once per side
+    ArenaArray<AABB> leftBounds = arena.AllocateArray<AABB>(stranded.size);
+    ArenaArray<AABB> rightBounds = arena.AllocateArray<AABB>(stranded.size);
+    for (size_t s = 0; s < stranded.size; ++s)
+    {
+        leftBounds[s] = TriangleBounds(context, ids[stranded[s]], leftAABB);
+        rightBounds[s] = TriangleBounds(context, ids[stranded[s]], rightAABB);
+    }
+    auto splitAxis = [&](int k)
+    {
+        SplitEvents(events[k], sides, triangleMap, leftEvents[k], rightEvents[k]);
+        CreateStrandedEvents(context, ids, stranded, (int)leftCount, (int)rightCount, (Axis)k, leftBounds, rightBounds, leftSplitEvents[k], rightSplitEvents[k]);
+    };
+    if (context.scheduler && ids.size >= PARALLEL_NODE_THRESHOLD)
+    {
+        TaskGroup group;
+        for (int k = 0; k < kAxesCount; ++k)
+        {
+            context.scheduler->Run(group, [&, k]() { splitAxis(k); });
+        }
+        context.scheduler->Wait(group);
+        for (int k = 0; k < kAxesCount; ++k)
+        {
+            context.scheduler->Run(group, [&, k]() { SortAndInsertSplitEvents(leftEvents[k], leftSplitEvents[k]); });
+            context.scheduler->Run(group, [&, k]() { SortAndInsertSplitEvents(rightEvents[k], rightSplitEvents[k]); });
+        }
+        context.scheduler->Wait(group);
+    }
+    else
+    {
+        for (int k = 0; k < kAxesCount; ++k)
+        {
+            splitAxis(k);
+            SortAndInsertSplitEvents(leftEvents[k], leftSplitEvents[k]);
+            SortAndInsertSplitEvents(rightEvents[k], rightSplitEvents[k]);
+        }
+    }
+}
+
+//which axes a triangle is perpendicular to only has to be computed once, not at every node it reaches
+std::vector<uint8_t> KDNode::CreatePlanarAxes(const TriangleMesh& mesh)
+{
+    std::vector<uint8_t> planarAxes(mesh.GetTriangleCount());
+    for (size_t i = 0; i < planarAxes.size(); ++i)
+    {
+        Vector3 normal = mesh.GetTriangle((uint32_t)i).GetNormal();
+        for (int k = 0; k < kAxesCount; ++k)
         {
-            SAHEvent event = axisEvents[i];
-            SplitSide side = sides[event.tri];
-            //if either left or right side, set the index to the corresponding array's space
-            if (side < kSplitSideBoth)
+            if (fabsf(normal[k]) == 1.0)
+                planarAxes[i] |= 1 << k;
+        }
+    }
+    return planarAxes;
+}
+
+StackArena& KDBuildContext::GetArena() const
+{
+    return arenas[scheduler ? scheduler->GetCurrentThreadIndex() : 0];
+}
+
+//the event list sort key: float bits flipped so that unsigned order is numeric order, with the type below them to break ties
+inline uint64_t EventSortKey(const SAHEvent& event)
+{
+    //-0 and +0 compare equal, so they have to get the same key
+    float pos = event.planePosition + 0.0f;
+    uint32_t bits;
+    memcpy(&bits, &pos, sizeof(bits));
+    bits = (bits & 0x80000000u) ? ~bits : bits | 0x80000000u;
+    return ((uint64_t)bits << 2) | (uint64_t)event.type;
+}
+
+//run function(chunk) for every chunk, as tasks if there is more than one
+template<typename Function>
+static void ForEachChunk(TaskScheduler* scheduler, size_t chunkCount, const Function& function)
+{
+    if (!scheduler || chunkCount <= 1)
+    {
+        for (size_t c = 0; c < chunkCount; ++c)
+        {
+            function(c);
+        }
+        return;
+    }
+    TaskGroup group;
+    for (size_t c = 0; c < chunkCount; ++c)
+    {
+        scheduler->Run(group, [&function, c]() { function(c); });
+    }
+    scheduler->Wait(group);
+}
+
+inline size_t ChunkBegin(size_t count, size_t chunkCount, size_t chunk)
+{
+    return count * chunk / chunkCount;
+}
+
+//stable LSD radix sort on EventSortKey, which gives the same order as EventSortPredicate. Every pass counts digits per chunk,
+//turns the counts into write offsets and scatters the chunks in parallel. histograms needs chunkCount * RADIX_SIZE entries,
+//and the sorted events end up in either events or temp, events is pointed at the right one
+static void RadixSortEvents(TaskScheduler* scheduler, size_t chunkCount, ArenaArray<SAHEvent>& events, const ArenaArray<SAHEvent>& temp, const ArenaArray<uint32_t>& histograms)
+{
+    if (events.size < RADIX_SORT_THRESHOLD)
+    {
+        std::stable_sort(events.begin(), events.end(), EventSortPredicate);
+        return;
+    }
+    size_t count = events.size;
+    SAHEvent* source = events.data;
+    SAHEvent* target = temp.data;
+    for (int pass = 0; pass < RADIX_PASSES; ++pass)
+    {
+        int shift = pass * RADIX_BITS;
+        ForEachChunk(scheduler, chunkCount, [&](size_t c)
+        {
+            uint32_t* histogram = &histograms[c * RADIX_SIZE];
+            std::fill(histogram, histogram + RADIX_SIZE, 0);
+            for (size_t i = ChunkBegin(count, chunkCount, c); i < ChunkBegin(count, chunkCount, c + 1); ++i)
             {
-                event.tri = triangleMap[side][event.tri];
+                histogram[(EventSortKey(source[i]) >> shift) & (RADIX_SIZE - 1)]++;
             }
-            if (side == kSplitSideLeft)
+        });
+        //digit by digit, and within a digit chunk by chunk, so equal keys keep their order
+        uint32_t offset = 0;
+        for (size_t digit = 0; digit < RADIX_SIZE; ++digit)
+        {
+            for (size_t c = 0; c < chunkCount; ++c)
             {
-                leftEvents[k].push_back(event);
+                uint32_t digitCount = histograms[c * RADIX_SIZE + digit];
+                histograms[c * RADIX_SIZE + digit] = offset;
+                offset += digitCount;
             }
-            else if (side == kSplitSideRight)
+        }
+        ForEachChunk(scheduler, chunkCount, [&](size_t c)
+        {
+            uint32_t* offsets = &histograms[c * RADIX_SIZE];
+            for (size_t i = ChunkBegin(count, chunkCount, c); i < ChunkBegin(count, chunkCount, c + 1); ++i)
             {
-                rightEvents[k].push_back(event);
+                target[offsets[(EventSortKey(source[i]) >> shift) & (RADIX_SIZE - 1)]++] = source[i];
             }
-        }
+        });
+        std::swap(source, target);
     }
+    events.data = source;
 }
 
-//create two new events each time an event is cut in half by the split plane
-inline void CreateStrandedEvents(const std::vector<Triangle>& faces, const std::vector<SplitSide>& sides, const AABB& leftAABB, const AABB& rightAABB, std::vector<Triangle>& Tl, std::vector<Triangle>& Tr, std::vector<SAHEvent>* leftSplitEvents, std::vector<SAHEvent>* rightSplitEvents)
+void KDNode::CreateEventList(const KDBuildContext& context, const ArenaArray<uint32_t>& ids, const AABB& aabb, ArenaArray<SAHEvent>* events)
 {
-    for (int i = 0; i < faces.size(); ++i)
+    StackArena& arena = context.GetArena();
+    TaskScheduler* scheduler = context.scheduler;
+    size_t chunkCount = scheduler && ids.size >= PARALLEL_NODE_THRESHOLD ? scheduler->GetThreadCount() : 1;
+    //every chunk of triangles writes its events to its own range, so first count how many each chunk creates per axis
+    ArenaArray<uint32_t> chunkOffsets = arena.AllocateArray<uint32_t>((chunkCount + 1) * kAxesCount);
+    ForEachChunk(scheduler, chunkCount, [&](size_t c)
     {
-        if (sides[i] == kSplitSideBoth)
+        uint32_t counts[kAxesCount] = { 0, 0, 0 };
+        for (size_t i = ChunkBegin(ids.size, chunkCount, c); i < ChunkBegin(ids.size, chunkCount, c + 1); ++i)
         {
-            const Triangle& tri = faces[i];
-            int idL = (int)Tl.size();
-            int idR = (int)Tr.size();
-            Tl.push_back(tri);
-            Tr.push_back(tri);
+            uint8_t planarAxes = context.planarAxes[ids[i]];
             for (int k = 0; k < kAxesCount; ++k)
             {
-                //if triangle is perpendicular to the axis (=lies inside the split plane), create two planar events
-                if (fabsf(tri.GetNormal()[k]) == 1.0)
-                {
-                    SAHEvent ev;
-                    ev.planePosition = tri.GetAxisMin((Axis)k);
-                    ev.type = kEventPlanar;
-
-                    ev.tri = idL;
-                    leftSplitEvents[k].push_back(ev);
-
-                    ev.tri = idR;
-                    rightSplitEvents[k].push_back(ev);
-                //otherwise, two starts/ends, two for each side
-                }
-                else
-                {
-                    SAHEvent ev0, ev1;
-                    ev0.type = kEventStart;
-                    ev1.type = kEventEnd;
-
-                    ev0.tri = ev1.tri = idL;
-                    ev0.planePosition = std::min(std::max(tri.GetAxisMin((Axis)k), leftAABB.min[k]), leftAABB.max[k]);
-                    ev1.planePosition = std::max(std::min(tri.GetAxisMax((Axis)k), leftAABB.max[k]), leftAABB.min[k]);
-                    leftSplitEvents[k].push_back(ev0);
-                    leftSplitEvents[k].push_back(ev1);
-
-                    ev0.tri = ev1.tri = idR;
-                    ev0.planePosition = std::min(std::max(tri.GetAxisMin((Axis)k), rightAABB.min[k]), rightAABB.max[k]);
-                    ev1.planePosition = std::max(std::min(tri.GetAxisMax((Axis)k), rightAABB.max[k]), rightAABB.min[k]);
-                    rightSplitEvents[k].push_back(ev0);
-                    rightSplitEvents[k].push_back(ev1);
-                }
+                counts[k] += (planarAxes >> k) & 1 ? 1 : 2;
             }
         }
-    }
-}
-
-inline void SortAndInsertSplitEvents(std::vector<SAHEvent>* leftEvents, std::vector<SAHEvent>* rightEvents, std::vector<SAHEvent>* leftSplitEvents, std::vector<SAHEvent>* rightSplitEvents)
-{
+        for (int k = 0; k < kAxesCount; ++k)
+        {
+            chunkOffsets[k * (chunkCount + 1) + c + 1] = counts[k];
+        }
+    });
+    ArenaArray<SAHEvent> temp[kAxesCount];
+    ArenaArray<uint32_t> histograms[kAxesCount];
     for (int k = 0; k < kAxesCount; ++k)
     {
-
-        //We sort these two, but they are usually really small and it is mostly sorted already
-        if (leftSplitEvents[k].size())
+        uint32_t* offsets = &chunkOffsets[k * (chunkCount + 1)];
+        offsets[0] = 0;
+        for (size_t c = 0; c < chunkCount; ++c)
         {
-            std::sort(leftSplitEvents[k].begin(), leftSplitEvents[k].end(), EventSortPredicate);
-            std::vector<SAHEvent> tmp(leftEvents[k].size() + leftSplitEvents[k].size());
-            std::merge(leftEvents[k].begin(), leftEvents[k].end(), leftSplitEvents[k].begin(), leftSplitEvents[k].end(), tmp.begin(), EventSortPredicate);
-            leftEvents[k] = tmp;
+            offsets[c + 1] += offsets[c];
         }
-
-        if (rightSplitEvents[k].size())
+        events[k] = arena.AllocateArray<SAHEvent>(offsets[chunkCount]);
+        if (events[k].size >= RADIX_SORT_THRESHOLD)
         {
-            std::sort(rightSplitEvents[k].begin(), rightSplitEvents[k].end(), EventSortPredicate);
-            std::vector<SAHEvent> tmp(rightEvents[k].size() + rightSplitEvents[k].size());
-            std::merge(rightEvents[k].begin(), rightEvents[k].end(), rightSplitEvents[k].begin(), rightSplitEvents[k].end(), tmp.begin(), EventSortPredicate);
-            rightEvents[k] = tmp;
+            temp[k] = arena.AllocateArray<SAHEvent>(events[k].size);
+            histograms[k] = arena.AllocateArray<uint32_t>(chunkCount * RADIX_SIZE);
         }
     }
+
+    //create "events" for SAH in each dimension and sort them to effectively sweep when finding splits
+    ForEachChunk(scheduler, chunkCount * kAxesCount, [&](size_t task)
+    {
+        uint8_t k = (uint8_t)(task / chunkCount);
+        size_t c = task % chunkCount;
+        uint32_t count = chunkOffsets[k * (chunkCount + 1) + c];
+        for (size_t i = ChunkBegin(ids.size, chunkCount, c); i < ChunkBegin(ids.size, chunkCount, c + 1); ++i)
+        {
+            Triangle tri = context.mesh->GetTriangle(ids[i]);
+            if (context.planarAxes[ids[i]] & (1 << k))
+            {
+                SAHEvent ev0;
+                ev0.tri = (int)i;
+                ev0.planePosition = tri.GetAxisMin((Axis)k);
+                ev0.type = kEventPlanar;
+                events[k][count++] = ev0;
+            }
+            else
+            {
+                AABB bounds = TriangleBounds(context, ids[i], aabb);
+                SAHEvent ev0, ev1;
+                ev0.tri = (int)i;
+                ev0.planePosition = bounds.min[k];
+                ev1.planePosition = bounds.max[k];
+                ev1.tri = (int)i;
+                ev0.type = kEventStart;
+                ev1.type = kEventEnd;
+                events[k][count++] = ev0;
+                events[k][count++] = ev1;
+            }
+        }
+    });
+    //the axes are sorted concurrently, and every sort is split into chunks again
+    ForEachChunk(chunkCount > 1 ? scheduler : nullptr, kAxesCount, [&](size_t k)
+    {
+        RadixSortEvents(scheduler, chunkCount, events[k], temp[k], histograms[k]);
+    });
 }
 
-KDNode* KDNode::CreateNode(const std::vector<Triangle>& faces, const AABB& aabb, const std::vector<SAHEvent>* events, int depth)
+KDNode* KDNode::CreateLeaf(const AABB& aabb, const ArenaArray<uint32_t>& ids)
+{
+    KDNode* node = new KDNode();
+    node->m_AABB = aabb;
+    node->m_Axis = kAxesCount;
+    node->m_SplitPosition = 0.0f;
+    node->m_TriangleIds.assign(ids.begin(), ids.end());
+    return node;
+}
+
+bool KDNode::SplitNode(const KDBuildContext& context, const ArenaArray<uint32_t>& ids, const AABB& aabb, const ArenaArray<SAHEvent>* events, KDSplit* split)
 {
-    Axis axis = kAxesCount;
     SplitSide planarSide = kSplitSideBoth;
     float splitCost;
-    float splitPos = findPlane(faces, aabb, events, &axis, &planarSide, &splitCost);
+    split->axis = kAxesCount;
+    split->position = findPlane(context, ids.size, aabb, events, &split->axis, &planarSide, &splitCost);
 
     //C < Kt x |T| is the SAH termination criterion
-    if (splitCost < K_INTERSECTION * faces.size())
+    if (!(splitCost < context.params->costModel.intersection * ids.size))
+        return false;
+    SplitBox(aabb, split->position, split->axis, &split->aabbs[0], &split->aabbs[1]);
+    StackArena& arena = context.GetArena();
+    ArenaArray<SplitSide> sides = arena.AllocateArray<SplitSide>(ids.size);
+    std::fill(sides.begin(), sides.end(), kSplitSideBoth);
+    ClassifyLeftRightBoth(events[split->axis], split->position, planarSide, sides, context.scheduler);
+    ArenaArray<uint32_t> triangleMap = arena.AllocateArray<uint32_t>(ids.size);
+    ArenaArray<uint32_t> stranded;
+    SplitTriangles(arena, ids, sides, triangleMap, &split->ids[0], &split->ids[1], &stranded);
+    SplitNodeEvents(context, arena, ids, events, sides, triangleMap, stranded, split->ids[0].size - stranded.size, split->ids[1].size - stranded.size,
+        split->aabbs[0], split->aabbs[1], split->events[0], split->events[1]);
+    return true;
+}
+
+KDNode* KDNode::CreateNode(const KDBuildContext& context, const ArenaArray<uint32_t>& ids, const AABB& aabb, const ArenaArray<SAHEvent>* events, int depth)
+{
+    //everything the children need lives in this thread's arena until both subtrees are built
+    StackArena& arena = context.GetArena();
+    StackArena::Marker marker = arena.GetMarker();
+    KDSplit split;
+    if (depth < KDTREE_MAX_DEPTH && SplitNode(context, ids, aabb, events, &split))
     {
-        KDNode* node = new KDNode();
+        std::unique_ptr<KDNode> node(new KDNode());
         node->m_AABB = aabb;
-        AABB leftAABB = aabb;
-        AABB rightAABB = aabb;
-        leftAABB.max[axis] = splitPos;
-        rightAABB.min[axis] = splitPos;
-        std::vector<Triangle> Tl;
-        std::vector<Triangle> Tr;
-
-        std::vector<SAHEvent> leftEvents[kAxesCount];
-        std::vector<SAHEvent> rightEvents[kAxesCount];
+        node->m_Axis = split.axis;
+        node->m_SplitPosition = split.position;
+        //both subtrees only read their own lists, so they can be built concurrently without changing the result
+        if (context.scheduler && ids.size >= PARALLEL_SUBTREE_THRESHOLD)
+        {
+            TaskGroup group;
+            context.scheduler->Run(group, [&]() { node->m_Left.reset(CreateNode(context, split.ids[0], split.aabbs[0], split.events[0], depth + 1)); });
+            node->m_Right.reset(CreateNode(context, split.ids[1], split.aabbs[1], split.events[1], depth + 1));
+            context.scheduler->Wait(group);
+        }
+        else
         {
-            std::vector<SplitSide> sides(faces.size(), kSplitSideBoth);
+            node->m_Left.reset(CreateNode(context, split.ids[0], split.aabbs[0], split.events[0], depth + 1));
+            node->m_Right.reset(CreateNode(context, split.ids[1], split.aabbs[1], split.events[1], depth + 1));
+        }
+        arena.Release(marker);
+        if (node->m_Left || node->m_Right)
+            return node.release();
+    }
+    else if (ids.size)
+    {
+        //we found a leaf node
+        return CreateLeaf(aabb, ids);
+    }
+    return nullptr;
+}
 
-            ClassifyLeftRightBoth(events[axis], splitPos, planarSide, sides);
-            std::vector<int> triangleMap[2];
-            triangleMap[0].resize(faces.size());
-            triangleMap[1].resize(faces.size());
-            SplitTriangles(faces, sides, Tl, Tr, triangleMap);
-            std::vector<SAHEvent> leftSplitEvents[kAxesCount];
-            std::vector<SAHEvent> rightSplitEvents[kAxesCount];
-            SplitEvents(events, sides, leftEvents, rightEvents, triangleMap);
+//evaluate the SAH at the boundaries of binCount equally sized bins. Triangles are counted in the bins of their
+//bounds clipped to the node, so the counts at a boundary are conservative and no sorting is needed
+static float FindBinnedAxisPlane(const SAHCostModel& costModel, const ArenaArray<AABB>& bounds, const AABB& aabb, float rcpParentSurface, const ArenaArray<uint32_t>& starts, const ArenaArray<uint32_t>& ends, Axis k, float* bestCost)
+{
+    *bestCost = std::numeric_limits<float>::infinity();
+    float bestSplit = 0.0f;
+    float extent = aabb.max[k] - aabb.min[k];
+    if (!(extent > 0.0f))
+        return bestSplit;
+    int binCount = (int)starts.size;
+    float binScale = binCount / extent;
+    std::fill(starts.begin(), starts.end(), 0);
+    std::fill(ends.begin(), ends.end(), 0);
+    for (const AABB& triBounds : bounds)
+    {
+        int startBin = (int)((triBounds.min[k] - aabb.min[k]) * binScale);
+        int endBin = (int)((triBounds.max[k] - aabb.min[k]) * binScale);
+        starts[std::min(std::max(startBin, 0), binCount - 1)]++;
+        ends[std::min(std::max(endBin, 0), binCount - 1)]++;
+    }
+    //a triangle is left of boundary j if it starts in a bin before it, and right of it unless it ends in one
+    size_t nl = 0, nr = bounds.size;
+    for (int j = 1; j < binCount; ++j)
+    {
+        nl += starts[j - 1];
+        nr -= ends[j - 1];
+        float pos = aabb.min[k] + extent * j / binCount;
+        SplitSide side;
+        float cost = SurfaceAreaHeuristics(costModel, aabb, rcpParentSurface, pos, k, nl, nr, 0, &side);
+        if (cost < *bestCost)
+        {
+            *bestCost = cost;
+            bestSplit = pos;
+        }
+    }
+    return bestSplit;
+}
 
-            CreateStrandedEvents(faces, sides, leftAABB, rightAABB, Tl, Tr, leftSplitEvents, rightSplitEvents);
+KDNode* KDNode::CreateBinnedNode(const KDBuildContext& context, const ArenaArray<uint32_t>& ids, const AABB& aabb, int depth)
+{
+    const KDTreeBuildParams& params = *context.params;
+    StackArena& arena = context.GetArena();
+    StackArena::Marker marker = arena.GetMarker();
+    if (ids.size < params.exactThreshold)
+    {
+        ArenaArray<SAHEvent> events[kAxesCount];
+        CreateEventList(context, ids, aabb, events);
+        KDNode* node = CreateNode(context, ids, aabb, events, depth);
+        arena.Release(marker);
+        return node;
+    }
 
-            SortAndInsertSplitEvents(leftEvents, rightEvents, leftSplitEvents, rightSplitEvents);
+    unsigned int binCount = std::max(params.binCount, 2u);
+    ArenaArray<AABB> bounds = arena.AllocateArray<AABB>(ids.size);
+    for (size_t i = 0; i < ids.size; ++i)
+    {
+        bounds[i] = TriangleBounds(context, ids[i], aabb);
+    }
+    float rcpParentSurface = 1.0f / aabb.GetSurfaceArea();
+    float splits[kAxesCount];
+    float costs[kAxesCount];
+    ArenaArray<uint32_t> starts[kAxesCount];
+    ArenaArray<uint32_t> ends[kAxesCount];
+    for (uint8_t k = kAxisX; k < kAxesCount; ++k)
+    {
+        starts[k] = arena.AllocateArray<uint32_t>(binCount);
+        ends[k] = arena.AllocateArray<uint32_t>(binCount);
+    }
+    if (context.scheduler && ids.size >= PARALLEL_NODE_THRESHOLD)
+    {
+        TaskGroup group;
+        for (uint8_t k = kAxisX; k < kAxesCount; ++k)
+        {
+            context.scheduler->Run(group, [&, k]() { splits[k] = FindBinnedAxisPlane(params.costModel, bounds, aabb, rcpParentSurface, starts[k], ends[k], (Axis)k, &costs[k]); });
         }
-        node->m_Left.reset(CreateNode(Tl, leftAABB, leftEvents, depth + 1));
-        node->m_Right.reset(CreateNode(Tr, rightAABB, rightEvents, depth + 1));
-        if (node->m_Left || node->m_Right)
-            return node;
+        context.scheduler->Wait(group);
     }
-    else if (faces.size())
+    else
     {
-        //we found a leaf node
-        KDNode* node = new KDNode();
+        for (uint8_t k = kAxisX; k < kAxesCount; ++k)
+        {
+            splits[k] = FindBinnedAxisPlane(params.costModel, bounds, aabb, rcpParentSurface, starts[k], ends[k], (Axis)k, &costs[k]);
+        }
+    }
+    Axis axis = kAxesCount;
+    float splitCost = std::numeric_limits<float>::infinity();
+    float splitPos = 0.0f;
+    for (uint8_t k = kAxisX; k < kAxesCount; ++k)
+    {
+        if (costs[k] < splitCost)
+        {
+            splitCost = costs[k];
+            splitPos = splits[k];
+            axis = (Axis)k;
+        }
+    }
+
+    KDNode* result = nullptr;
+    //C < Kt x |T| is the SAH termination criterion
+    if (depth < KDTREE_MAX_DEPTH && splitCost < params.costModel.intersection * ids.size)
+    {
+        std::unique_ptr<KDNode> node(new KDNode());
         node->m_AABB = aabb;
-        node->m_Left = nullptr;
-        node->m_Right = nullptr;
-        for (int i = 0; i < faces.size(); ++i)
+        node->m_Axis = axis;
+        node->m_SplitPosition = splitPos;
+        AABB leftAABB, rightAABB;
+        SplitBox(aabb, splitPos, axis, &leftAABB, &rightAABB);
+        ArenaArray<uint32_t> idsL = arena.AllocateArray<uint32_t>(ids.size);
+        ArenaArray<uint32_t> idsR = arena.AllocateArray<uint32_t>(ids.size);
+        idsL.size = 0;
+        idsR.size = 0;
+        for (size_t i = 0; i < ids.size; ++i)
         {
-            const Triangle& tri = faces[i];
-            node->triangles.push_back(tri);
+            //same rules as the exact sweep: touching the plane from one side keeps a triangle on that side
+            float lo = bounds[i].min[axis];
+            float hi = bounds[i].max[axis];
+            if (lo < splitPos || hi <= splitPos)
+            {
+                idsL[idsL.size++] = ids[i];
+            }
+            if (hi > splitPos)
+            {
+                idsR[idsR.size++] = ids[i];
+            }
         }
-        return node;
+        if (context.scheduler && ids.size >= PARALLEL_SUBTREE_THRESHOLD)
+        {
+            TaskGroup group;
+            context.scheduler->Run(group, [&]() { node->m_Left.reset(CreateBinnedNode(context, idsL, leftAABB, depth + 1)); });
+            node->m_Right.reset(CreateBinnedNode(context, idsR, rightAABB, depth + 1));
+            context.scheduler->Wait(group);
+        }
+        else
+        {
+            node->m_Left.reset(CreateBinnedNode(context, idsL, leftAABB, depth + 1));
+            node->m_Right.reset(CreateBinnedNode(context, idsR, rightAABB, depth + 1));
+        }
+        if (node->m_Left || node->m_Right)
+            result = node.release();
     }
-    return nullptr;
+    else if (ids.size)
+    {
+        result = CreateLeaf(aabb, ids);
+    }
+    arena.Release(marker);
+    return result;
 }
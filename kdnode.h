@@ -1,8 +1,17 @@
 #pragma once
-#include "triangle.h"
+#include "triangle_mesh.h"
 #include "aabb.h"
+#include "arena.h"
+#include <cstdint>
+#include <memory>
 #include <vector>
 
+//nodes this deep always become leaves, which bounds the traversal stack
+#define KDTREE_MAX_DEPTH 64
+
+class TaskScheduler;
+struct KDTreeBuildParams;
+
 enum SAHEventType : char
 {
     kEventEnd,
@@ -12,23 +21,79 @@ enum SAHEventType : char
 
 struct SAHEvent
 {
+    //index into the node's triangle id array
     int tri;
     float planePosition;
     SAHEventType type;
 };
 
+//constants of the SAH cost function, trees built with different ones differ.
+//Only the ratio of intersection to traversal cost matters, the defaults were tuned on a 2018 laptop
+struct SAHCostModel
+{
+    //cost of descending into a node
+    float traversal = 1.0f;
+    //cost of one ray triangle test
+    float intersection = 0.1f;
+    //scales the cost of splits that cut off empty space, to reward non-flat empty nodes
+    float lambdaBias = 0.8f;
+};
+
+//state shared by every node of one build
+struct KDBuildContext
+{
+    const TriangleMesh* mesh;
+    //bit k is set when the triangle lies in a plane perpendicular to axis k
+    const uint8_t* planarAxes;
+    const KDTreeBuildParams* params;
+    //may be null for a single threaded build, the resulting tree is the same either way
+    TaskScheduler* scheduler;
+    //scratch memory, one arena per scheduler thread
+    StackArena* arenas;
+
+    StackArena& GetArena() const;
+};
+
+//a node's split plane and the id and event lists of its two children, index 0 is below the plane
+struct KDSplit
+{
+    Axis axis;
+    float position;
+    AABB aabbs[2];
+    ArenaArray<uint32_t> ids[2];
+    ArenaArray<SAHEvent> events[2][kAxesCount];
+};
+
+ //node of the tree while it is being built, KDTree flattens these into KDTreeNodes afterwards
  class KDNode
  {
     std::unique_ptr<KDNode> m_Left;
     std::unique_ptr<KDNode> m_Right;
     AABB m_AABB;
-    std::vector<Triangle> triangles;
+    Axis m_Axis;
+    float m_SplitPosition;
+    //global ids of the triangles in a leaf
+    std::vector<uint32_t> m_TriangleIds;
     KDNode();
+    static KDNode* CreateLeaf(const AABB& aabb, const ArenaArray<uint32_t>& ids);
 
 public:
-    static KDNode* CreateNode(const std::vector<Triangle>& faces, const AABB& aabb, const std::vector<SAHEvent>* events, int depth);
+    //bit k of a triangle's entry is set when it lies in a plane perpendicular to axis k, see KDBuildContext::planarAxes
+    static std::vector<uint8_t> CreatePlanarAxes(const TriangleMesh& mesh);
+    //sorted SAH events of the triangles' bounds clipped to aabb, one list per axis, allocated from the calling thread's arena
+    static void CreateEventList(const KDBuildContext& context, const ArenaArray<uint32_t>& ids, const AABB& aabb, ArenaArray<SAHEvent>* events);
+    //finds the best split plane, and if splitting beats a leaf fills split with the children's lists, allocated from
+    //the calling thread's arena. Returns false if the node should be a leaf
+    static bool SplitNode(const KDBuildContext& context, const ArenaArray<uint32_t>& ids, const AABB& aabb, const ArenaArray<SAHEvent>* events, KDSplit* split);
+    //ids are global triangle ids, all scratch memory of the subtree is taken from the context's arenas and released on return
+    static KDNode* CreateNode(const KDBuildContext& context, const ArenaArray<uint32_t>& ids, const AABB& aabb, const ArenaArray<SAHEvent>* events, int depth);
+    //binned SAH build, switches to CreateNode for nodes below params.exactThreshold
+    static KDNode* CreateBinnedNode(const KDBuildContext& context, const ArenaArray<uint32_t>& ids, const AABB& aabb, int depth);
     const KDNode* GetLeft() const { return m_Left.get(); }
     const KDNode* GetRight() const { return m_Right.get(); }
+    bool IsLeaf() const { return !m_Left && !m_Right; }
     const AABB& GetAABB() const { return m_AABB; }
-    const std::vector<Triangle>& GetTriangles() const { return triangles; }
+    Axis GetAxis() const { return m_Axis; }
+    float GetSplitPosition() const { return m_SplitPosition; }
+    const std::vector<uint32_t>& GetTriangleIds() const { return m_TriangleIds; }
 };
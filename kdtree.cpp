@@ -1,45 +1,240 @@
 #include "kdtree.h"
+#include "task_scheduler.h"
+#include <algorithm>
+#include <cfloat>
 #include <chrono>
+#include <cmath>
 
-static void CreateEventList(const std::vector<Triangle>& triangles, std::vector<SAHEvent>* events)
+//write the subtree depth first, so every below child directly follows its parent
+static void FlattenNode(const KDNode* node, std::vector<KDTreeNode>& nodes, std::vector<uint32_t>& triangleIndices)
 {
-    //create "events" for SAH in each dimension and sort them to effectively sweep when finding splits
-    for (uint8_t k = 0; k < kAxesCount; ++k)
+    size_t index = nodes.size();
+    //missing children of the builder are empty leaves
+    if (!node || node->IsLeaf())
     {
-        events[k].reserve(triangles.size() * 2);
-        for (int i = 0; i < triangles.size(); ++i)
+        uint32_t count = node ? (uint32_t)node->GetTriangleIds().size() : 0;
+        nodes.push_back(KDTreeNode::Leaf((uint32_t)triangleIndices.size(), count));
+        if (node)
+            triangleIndices.insert(triangleIndices.end(), node->GetTriangleIds().begin(), node->GetTriangleIds().end());
+        return;
+    }
+    nodes.emplace_back();
+    FlattenNode(node->GetLeft(), nodes, triangleIndices);
+    nodes[index] = KDTreeNode::Inner(node->GetAxis(), node->GetSplitPosition(), (uint32_t)nodes.size());
+    FlattenNode(node->GetRight(), nodes, triangleIndices);
+}
+
+KDTree::KDTree(const TriangleMesh& mesh, const AABB& aabb, const KDTreeBuildParams& params)
+{
+    std::vector<uint8_t> planarAxes = KDNode::CreatePlanarAxes(mesh);
+    std::unique_ptr<KDNode> root;
+    TaskScheduler scheduler(params.threadCount);
+    std::unique_ptr<StackArena[]> arenas(new StackArena[scheduler.GetThreadCount()]);
+    {
+        KDBuildContext context = { &mesh, planarAxes.data(), &params, &scheduler, arenas.get() };
+        StackArena& arena = context.GetArena();
+        ArenaArray<uint32_t> ids = arena.AllocateArray<uint32_t>(mesh.GetTriangleCount());
+        for (size_t i = 0; i < ids.size; ++i)
+        {
+            ids[i] = (uint32_t)i;
+        }
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        m_EventListSeconds = 0.0;
+        if (params.mode == kBuildModeBinned)
+        {
+            root.reset(KDNode::CreateBinnedNode(context, ids, aabb, 0));
+        }
+        else
+        {
+            ArenaArray<SAHEvent> events[kAxesCount];
+            KDNode::CreateEventList(context, ids, aabb, events);
+            std::chrono::duration<double> eventListTime = std::chrono::steady_clock::now() - start;
+            m_EventListSeconds = eventListTime.count();
+            root.reset(KDNode::CreateNode(context, ids, aabb, events, 0));
+        }
+        std::chrono::duration<double> buildTime = std::chrono::steady_clock::now() - start;
+        m_NodeBuildSeconds = buildTime.count() - m_EventListSeconds;
+    }
+    m_BuildScratchBytes = 0;
+    for (unsigned int i = 0; i < scheduler.GetThreadCount(); ++i)
+    {
+        m_BuildScratchBytes += arenas[i].GetPeakBytes();
+    }
+    FlattenNode(root.get(), m_Nodes, m_TriangleIndices);
+    m_View = { m_Nodes.data(), m_Nodes.size(), m_TriangleIndices.data(), m_TriangleIndices.size(), &mesh, aabb };
+    m_View.mailboxes = params.mailboxes;
+    CreateLeafTriangles(params.leafFormat);
+    if (params.ropes)
+        CreateRopes();
+}
+
+void KDTree::CreateLeafTriangles(KDTreeLeafFormat format)
+{
+    const TriangleMesh& mesh = *m_View.mesh;
+    if (format == kLeafFormatEdges)
+    {
+        m_EdgeTriangles.reserve(m_View.triangleIndexCount);
+        for (size_t i = 0; i < m_View.triangleIndexCount; ++i)
+        {
+            m_EdgeTriangles.emplace_back(mesh.GetTriangle(m_View.triangleIndices[i]));
+        }
+        m_View.edgeTriangles = m_EdgeTriangles.data();
+    }
+    else if (format == kLeafFormatWald)
+    {
+        m_WaldTriangles.reserve(m_View.triangleIndexCount);
+        for (size_t i = 0; i < m_View.triangleIndexCount; ++i)
+        {
+            m_WaldTriangles.emplace_back(mesh.GetTriangle(m_View.triangleIndices[i]));
+        }
+        m_View.waldTriangles = m_WaldTriangles.data();
+    }
+    else if (format == kLeafFormatBlocks)
+    {
+        //the lanes after the last reference are zero, leaves never reach them
+        m_TriangleBlocks.assign((m_View.triangleIndexCount + SIMD_WIDTH - 1) / SIMD_WIDTH, TriangleBlock());
+        for (size_t i = 0; i < m_View.triangleIndexCount; ++i)
+        {
+            m_TriangleBlocks[i / SIMD_WIDTH].SetTriangle(i % SIMD_WIDTH, EdgeTriangle(mesh.GetTriangle(m_View.triangleIndices[i])));
+        }
+        m_View.triangleBlocks = m_TriangleBlocks.data();
+    }
+    else if (format == kLeafFormatQuantized)
+    {
+        CreateQuantizedTriangles();
+        m_View.quantizedTriangles = m_QuantizedTriangles.data();
+        m_View.quantizationFrames = m_QuantizationFrames.data();
+    }
+}
+
+//rounds the vertices of every leaf's references to a grid of 65536 steps over the bounds of the leaf's triangles, which
+//also covers the vertices of triangles crossing the leaf's box
+void KDTree::CreateQuantizedTriangles()
+{
+    m_QuantizedTriangles.resize(m_View.triangleIndexCount);
+    m_QuantizationFrames.clear();
+    for (size_t index = 0; index < m_View.nodeCount; ++index)
+    {
+        const KDTreeNode& node = m_View.nodes[index];
+        if (!node.IsLeaf() || !node.GetTriangleCount())
+            continue;
+        AABB bounds;
+        bounds.min = Vector3(FLT_MAX, FLT_MAX, FLT_MAX);
+        bounds.max = Vector3(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+        for (uint32_t i = 0; i < node.GetTriangleCount(); ++i)
         {
-            const Triangle& tri = triangles[i];
-            if (fabsf(tri.GetNormal()[k]) == 1.0)
+            Triangle triangle = m_View.GetTriangle(node, i);
+            for (uint8_t k = kAxisX; k < kAxesCount; ++k)
             {
-                SAHEvent ev0;
-                ev0.tri = i;
-                ev0.planePosition = tri.GetAxisMin((Axis)k);
-                ev0.type = kEventPlanar;
-                events[k].push_back(ev0);
+                bounds.min[k] = std::min(bounds.min[k], triangle.GetAxisMin((Axis)k));
+                bounds.max[k] = std::max(bounds.max[k], triangle.GetAxisMax((Axis)k));
             }
-            else
+        }
+        QuantizationFrame grid;
+        grid.origin = bounds.min;
+        float scale[3];
+        for (int k = 0; k < 3; ++k)
+        {
+            float size = bounds.max[k] - bounds.min[k];
+            grid.step[k] = size / 65535.0f;
+            scale[k] = size > 0.0f ? 65535.0f / size : 0.0f;
+        }
+        //the largest distance of a dequantized vertex from the exact one, plus a margin for the float rounding of the tests
+        float error = 0.0f;
+        uint32_t begin = node.GetTriangleOffset();
+        uint32_t end = begin + node.GetTriangleCount();
+        for (uint32_t i = begin; i < end; ++i)
+        {
+            Triangle triangle = m_View.GetTriangle(node, i - begin);
+            QuantizedTriangle& quantized = m_QuantizedTriangles[i];
+            quantized.frame = (uint32_t)m_QuantizationFrames.size();
+            for (int j = 0; j < 3; ++j)
             {
-                SAHEvent ev0, ev1;
-                ev0.tri = i;
-                ev0.planePosition = tri.GetAxisMin((Axis)k);
-                ev1.planePosition = tri.GetAxisMax((Axis)k);
-                ev1.tri = i;
-                ev0.type = kEventStart;
-                ev1.type = kEventEnd;
-                events[k].push_back(ev0);
-                events[k].push_back(ev1);
+                for (int k = 0; k < 3; ++k)
+                {
+                    float q = std::round((triangle.vertices[j][k] - grid.origin[k]) * scale[k]);
+                    quantized.vertices[j][k] = (uint16_t)std::min(std::max(q, 0.0f), 65535.0f);
+                }
+                Vector3 offset = grid.Dequantize(quantized.vertices[j]) - triangle.vertices[j];
+                error = std::max(error, Vector3::Dot(offset, offset));
             }
         }
-        std::sort(events[k].begin(), events[k].end(), EventSortPredicate);
+        float extent = 0.0f;
+        for (int k = 0; k < 3; ++k)
+        {
+            extent = std::max(extent, std::max(std::fabs(bounds.min[k]), std::fabs(bounds.max[k])));
+        }
+        float distance = std::sqrt(error) + 8.0f * FLT_EPSILON * extent;
+        //a point of the exact triangle is at most distance from the point of the dequantized one with the same barycentric
+        //coordinates, which moves a coordinate by at most distance * |edge| / |normal|, rounded up
+        for (uint32_t i = begin; i < end; ++i)
+        {
+            QuantizedTriangle& quantized = m_QuantizedTriangles[i];
+            Vector3 vertex = grid.Dequantize(quantized.vertices[0]);
+            Vector3 edge1 = grid.Dequantize(quantized.vertices[1]) - vertex;
+            Vector3 edge2 = grid.Dequantize(quantized.vertices[2]) - vertex;
+            Vector3 edge3 = edge2 - edge1;
+            Vector3 normal = Vector3::Cross(edge1, edge2);
+            float longest = std::max(std::max(Vector3::Dot(edge1, edge1), Vector3::Dot(edge2, edge2)), Vector3::Dot(edge3, edge3));
+            float tolerance = std::ceil(distance * std::sqrt(longest / Vector3::Dot(normal, normal)) * 65535.0f);
+            //a degenerate triangle's NaN gives the largest tolerance
+            quantized.tolerance = (uint16_t)(tolerance < 65535.0f ? tolerance : 65535.0f);
+        }
+        m_QuantizationFrames.push_back(grid);
     }
 }
 
-KDTree::KDTree(const std::vector<Triangle>& faces, const AABB& aabb)
+void KDTree::CreateRopes()
 {
-    std::vector<SAHEvent> events[kAxesCount];
-    CreateEventList(faces, events);
-    KDNode* node = KDNode::CreateNode(faces, aabb, events, 0);
-    if (node != nullptr)
-        m_RootNode.reset(node);
+    m_LeafRopeIndices.assign(m_View.nodeCount, KDTREE_NO_ROPE);
+    m_LeafRopes.clear();
+    uint32_t ropes[6] = { KDTREE_NO_ROPE, KDTREE_NO_ROPE, KDTREE_NO_ROPE, KDTREE_NO_ROPE, KDTREE_NO_ROPE, KDTREE_NO_ROPE };
+    CreateLeafRopes(0, m_View.aabb, ropes);
+    m_View.leafRopeIndices = m_LeafRopeIndices.data();
+    m_View.leafRopes = m_LeafRopes.data();
+}
+
+//ropes holds the neighbours of the node's faces, the children inherit them and point at each other across the split plane
+void KDTree::CreateLeafRopes(uint32_t index, const AABB& aabb, uint32_t* ropes)
+{
+    //move every rope down to the smallest node that still covers the whole face, so the traversal descends less
+    for (int face = 0; face < 6; ++face)
+    {
+        uint32_t& rope = ropes[face];
+        while (rope != KDTREE_NO_ROPE && !m_View.nodes[rope].IsLeaf())
+        {
+            const KDTreeNode& neighbour = m_View.nodes[rope];
+            Axis axis = neighbour.GetAxis();
+            if (axis == face / 2)
+                rope = (face & 1) ? rope + 1 : neighbour.GetAboveChild();
+            else if (neighbour.GetSplitPosition() <= aabb.min[axis])
+                rope = neighbour.GetAboveChild();
+            else if (neighbour.GetSplitPosition() >= aabb.max[axis])
+                rope = rope + 1;
+            else
+                break;
+        }
+    }
+    const KDTreeNode& node = m_View.nodes[index];
+    if (node.IsLeaf())
+    {
+        m_LeafRopeIndices[index] = (uint32_t)m_LeafRopes.size();
+        KDTreeLeafRopes leaf;
+        leaf.aabb = aabb;
+        std::copy(ropes, ropes + 6, leaf.ropes);
+        m_LeafRopes.push_back(leaf);
+        return;
+    }
+    Axis axis = node.GetAxis();
+    uint32_t belowRopes[6], aboveRopes[6];
+    std::copy(ropes, ropes + 6, belowRopes);
+    std::copy(ropes, ropes + 6, aboveRopes);
+    belowRopes[2 * axis + 1] = node.GetAboveChild();
+    aboveRopes[2 * axis] = index + 1;
+    AABB belowAABB = aabb;
+    AABB aboveAABB = aabb;
+    belowAABB.max[axis] = node.GetSplitPosition();
+    aboveAABB.min[axis] = node.GetSplitPosition();
+    CreateLeafRopes(index + 1, belowAABB, belowRopes);
+    CreateLeafRopes(node.GetAboveChild(), aboveAABB, aboveRopes);
 }
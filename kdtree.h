@@ -1,19 +1,321 @@
 #pragma once
 
-#include "triangle.h"
+#include "triangle_mesh.h"
 #include "kdnode.h"
 #include "aabb.h"
+#include "mapped_file.h"
+#include "intersection.h"
+#include "ray_packet.h"
+#include "ray_batch.h"
+#include "frustum.h"
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <memory>
 #include <vector>
 
+enum KDTreeBuildMode : char
+{
+    kBuildModeExact,
+    kBuildModeBinned
+};
+
+//what the leaves store per triangle reference besides the triangle's index
+enum KDTreeLeafFormat : char
+{
+    //nothing, the vertices are gathered from the mesh for every test
+    kLeafFormatIndices,
+    //EdgeTriangle, same results as kLeafFormatIndices
+    kLeafFormatEdges,
+    //WaldTriangle, the fewest operations per test
+    kLeafFormatWald,
+    //TriangleBlock, a ray is tested against SIMD_WIDTH references at once, same results as kLeafFormatIndices
+    kLeafFormatBlocks,
+    //QuantizedTriangle, the vertices in 16 bits per coordinate on a grid over the leaf's triangles, tested with widened edges
+    //and without reading the mesh. About 0.7x the memory of kLeafFormatEdges, the hits can differ a little from kLeafFormatIndices
+    kLeafFormatQuantized
+};
+
+struct KDTreeBuildParams
+{
+    //threads used to build the tree, 0 means one per hardware thread
+    unsigned int threadCount = 0;
+    //exact sweeps every sorted event, binned only evaluates the bin boundaries and never sorts
+    KDTreeBuildMode mode = kBuildModeExact;
+    //planes per axis of the binned mode are the boundaries of this many equally sized bins
+    unsigned int binCount = 64;
+    //binned nodes with fewer triangles than this switch to the exact sweep, 0 never switches
+    unsigned int exactThreshold = 0;
+    //clip triangles that cross a node's boundary against the node instead of clamping their bounds,
+    //so they are only referenced by the leaves they really overlap
+    bool perfectSplits = false;
+    SAHCostModel costModel;
+    //the leaf records are derived from the finished tree, so trees in other formats share one cache file
+    KDTreeLeafFormat leafFormat = kLeafFormatIndices;
+    //link every leaf to its neighbours for KDTree::IntersectStackless. Also derived from the finished tree, not cached
+    bool ropes = false;
+    //single ray traversals test a triangle referenced by several leaves only once per ray, see KDTREE_MAILBOX_BITS.
+    //Only changes how the tree is traversed. kLeafFormatBlocks tests whole blocks and ignores it
+    bool mailboxes = false;
+};
+
+struct KDTreeBatchParams
+{
+    //threads that trace the batch, 0 means one per hardware thread
+    unsigned int threadCount = 0;
+    //trace the rays ordered by their direction signs and the Morton codes of their origins and directions, so
+    //neighbours in the order can go through the tree as packets. The results are in the batch's order either way.
+    //Batches that are coherent already, like the pixels of an image in order, are faster without
+    bool sortRays = true;
+};
+
+//an SAH profile is a text file with one "name value" line per cost model constant, see Raytracer::CalibrateCostModel.
+//Constants the file does not mention keep their value, on failure costModel is not changed
+bool LoadSAHProfile(const char* path, SAHCostModel* costModel);
+bool SaveSAHProfile(const char* path, const SAHCostModel& costModel);
+
+//8 byte node of the flattened tree. The below child of an inner node is stored right after it,
+//the above child by index. Leaves hold a range of the tree's triangle index array.
+struct KDTreeNode
+{
+    union
+    {
+        float splitPosition;
+        uint32_t triangleOffset;
+    };
+    //the lowest two bits hold the split axis (kAxesCount for leaves), the rest the above child index or the leaf's triangle count
+    uint32_t flags;
+
+    static KDTreeNode Inner(Axis axis, float splitPosition, uint32_t aboveChild)
+    {
+        KDTreeNode node;
+        node.splitPosition = splitPosition;
+        node.flags = (aboveChild << 2) | axis;
+        return node;
+    }
+
+    static KDTreeNode Leaf(uint32_t triangleOffset, uint32_t triangleCount)
+    {
+        KDTreeNode node;
+        node.triangleOffset = triangleOffset;
+        node.flags = (triangleCount << 2) | kAxesCount;
+        return node;
+    }
+
+    bool IsLeaf() const { return (flags & 3) == kAxesCount; }
+    Axis GetAxis() const { return (Axis)(flags & 3); }
+    float GetSplitPosition() const { return splitPosition; }
+    uint32_t GetAboveChild() const { return flags >> 2; }
+    uint32_t GetTriangleOffset() const { return triangleOffset; }
+    uint32_t GetTriangleCount() const { return flags >> 2; }
+};
+static_assert(sizeof(KDTreeNode) == 8, "KDTreeNode should stay 8 bytes");
+
+#define KDTREE_NO_ROPE 0xFFFFFFFFu
+//each thread remembers the last 1 << KDTREE_MAILBOX_BITS triangles it tested, see KDTreeBuildParams::mailboxes
+#define KDTREE_MAILBOX_BITS 6
+
+//box of a leaf and its ropes [Popov et al., Stackless KD-Tree Traversal for High Performance GPU Ray Tracing, 2007].
+//ropes[2 * axis] is the node on the other side of the min face of that axis, ropes[2 * axis + 1] the one of the max face.
+//It is the smallest node that covers the whole face, or KDTREE_NO_ROPE where the face lies on the tree's box
+struct KDTreeLeafRopes
+{
+    AABB aabb;
+    uint32_t ropes[6];
+};
+
+//read-only view of a built tree, node 0 is the root
+struct KDTreeView
+{
+    const KDTreeNode* nodes;
+    size_t nodeCount;
+    const uint32_t* triangleIndices;
+    size_t triangleIndexCount;
+    const TriangleMesh* mesh;
+    AABB aabb;
+    //precomputed records parallel to triangleIndices, so every leaf's records are contiguous. At most one is set.
+    //Reference i is lane i % SIMD_WIDTH of triangleBlocks[i / SIMD_WIDTH], a leaf's references can start and end inside a block
+    const EdgeTriangle* edgeTriangles = nullptr;
+    const WaldTriangle* waldTriangles = nullptr;
+    const TriangleBlock* triangleBlocks = nullptr;
+    //quantizedTriangles[i].frame indexes quantizationFrames, there is one frame per non-empty leaf
+    const QuantizedTriangle* quantizedTriangles = nullptr;
+    const QuantizationFrame* quantizationFrames = nullptr;
+    //set if the tree was built with ropes, leafRopes[leafRopeIndices[i]] belongs to leaf node i
+    const uint32_t* leafRopeIndices = nullptr;
+    const KDTreeLeafRopes* leafRopes = nullptr;
+    bool mailboxes = false;
+
+    const KDTreeNode& GetRoot() const { return nodes[0]; }
+    const KDTreeNode& GetBelowChild(const KDTreeNode& node) const { return (&node)[1]; }
+    const KDTreeNode& GetAboveChild(const KDTreeNode& node) const { return nodes[node.GetAboveChild()]; }
+    uint32_t GetTriangleId(const KDTreeNode& leaf, uint32_t i) const { return triangleIndices[leaf.GetTriangleOffset() + i]; }
+    Triangle GetTriangle(const KDTreeNode& leaf, uint32_t i) const { return mesh->GetTriangle(GetTriangleId(leaf, i)); }
+};
+
+//shape and size of a built tree, see KDTree::ComputeStats
+struct KDTreeStats
+{
+    size_t nodeCount;
+    size_t innerNodeCount;
+    size_t leafCount;
+    size_t emptyLeafCount;
+    uint32_t maxDepth;
+    //averaged over all leaves, empty ones included
+    double averageLeafDepth;
+    uint32_t maxLeafSize;
+    //averaged over the non-empty leaves
+    double averageLeafSize;
+    //distinct triangles referenced by the leaves, and how often they are referenced on average
+    size_t triangleCount;
+    size_t triangleReferenceCount;
+    double duplicationFactor;
+    //SAH estimates for a random ray hitting the bounds of the triangles: inner nodes it descends into,
+    //triangles it tests, and the cost of both weighted by the cost model
+    double expectedInnerNodeVisits;
+    double expectedTriangleTests;
+    double sahCost;
+    size_t nodeBytes;
+    size_t triangleIndexBytes;
+    size_t leafTriangleBytes;
+    size_t ropeBytes;
+    //leafSizeHistogram[n] counts the leaves with n triangles, depthHistogram[d] the leaves at depth d
+    std::vector<size_t> leafSizeHistogram;
+    std::vector<size_t> depthHistogram;
+
+    size_t GetTotalBytes() const { return nodeBytes + triangleIndexBytes + leafTriangleBytes + ropeBytes; }
+    bool WriteJSON(FILE* file) const;
+};
+
+//closest hit of a ray: the triangle's index in the mesh, the distance in units of the ray's direction, and the
+//barycentric coordinates of the hit point, see GetBarycentrics
+struct KDTreeHit
+{
+    uint32_t triangle;
+    float t;
+    float u;
+    float v;
+};
+
+//point of the mesh closest to a query point: the triangle's index in the mesh, the point, its distance to the query point,
+//and its barycentric coordinates, see ClosestPointOnTriangle
+struct KDTreeClosestPoint
+{
+    uint32_t triangle;
+    Vector3 point;
+    float distance;
+    float u;
+    float v;
+};
+
+//work of traversals, the traversal functions add to it so it can be summed over many rays
+struct KDTraversalStats
+{
+    size_t innerNodes = 0;
+    size_t leaves = 0;
+    size_t triangleTests = 0;
+    //of the triangleTests, the ones skipped because the ray had already been tested against the triangle
+    size_t mailboxSkips = 0;
+};
+
+//the mesh is referenced by the tree, not copied, and has to outlive it. Triangles are identified by their index in it.
+//The nodes either live in the tree's own vectors or directly in a memory mapped cache file.
 class KDTree
 {
-    std::unique_ptr<KDNode> m_RootNode;
+    std::vector<KDTreeNode> m_Nodes;
+    std::vector<uint32_t> m_TriangleIndices;
+    std::vector<EdgeTriangle> m_EdgeTriangles;
+    std::vector<WaldTriangle> m_WaldTriangles;
+    std::vector<TriangleBlock> m_TriangleBlocks;
+    std::vector<QuantizedTriangle> m_QuantizedTriangles;
+    std::vector<QuantizationFrame> m_QuantizationFrames;
+    std::vector<uint32_t> m_LeafRopeIndices;
+    std::vector<KDTreeLeafRopes> m_LeafRopes;
+    MappedFile m_CacheFile;
+    KDTreeView m_View;
+    size_t m_BuildScratchBytes;
+    double m_EventListSeconds;
+    double m_NodeBuildSeconds;
+    KDTree() {}
+    void CreateLeafTriangles(KDTreeLeafFormat format);
+    void CreateQuantizedTriangles();
+    void CreateRopes();
+    void CreateLeafRopes(uint32_t index, const AABB& aabb, uint32_t* ropes);
 public:
-    KDTree(const std::vector<Triangle>& faces, const AABB& aabb);
-    const KDNode* GetRoot() const
+    KDTree(const TriangleMesh& mesh, const AABB& aabb, const KDTreeBuildParams& params = KDTreeBuildParams());
+    //maps a tree written by SaveCache, returns null if the file is missing, from another version,
+    //or was built from different triangles, bounds or build parameters
+    static std::unique_ptr<KDTree> LoadCache(const char* path, const TriangleMesh& mesh, const AABB& aabb, const KDTreeBuildParams& params);
+    //params have to be the ones the tree was built with
+    bool SaveCache(const char* path, const TriangleMesh& mesh, const KDTreeBuildParams& params) const;
+    const KDTreeView& GetView() const { return m_View; }
+    size_t GetNodeCount() const { return m_View.nodeCount; }
+    size_t GetTriangleIndexCount() const { return m_View.triangleIndexCount; }
+    //bytes of the precomputed leaf records, 0 for kLeafFormatIndices
+    size_t GetLeafTriangleBytes() const
     {
-        return m_RootNode.get();
+        return m_EdgeTriangles.size() * sizeof(EdgeTriangle) + m_WaldTriangles.size() * sizeof(WaldTriangle) + m_TriangleBlocks.size() * sizeof(TriangleBlock) +
+            m_QuantizedTriangles.size() * sizeof(QuantizedTriangle) + m_QuantizationFrames.size() * sizeof(QuantizationFrame);
     }
+    bool HasRopes() const { return m_View.leafRopes != nullptr; }
+    //bytes of the leaf ropes and boxes plus the index from the nodes to them, 0 without ropes
+    size_t GetRopeBytes() const { return m_LeafRopeIndices.size() * sizeof(uint32_t) + m_LeafRopes.size() * sizeof(KDTreeLeafRopes); }
+    bool IsMapped() const { return m_CacheFile.GetData() != nullptr; }
+    //high water mark of the builder's scratch arenas, summed over all build threads
+    size_t GetBuildScratchBytes() const { return m_BuildScratchBytes; }
+    //time spent creating and sorting the root event lists, and in the recursive node build after that
+    double GetEventListSeconds() const { return m_EventListSeconds; }
+    double GetNodeBuildSeconds() const { return m_NodeBuildSeconds; }
+    //finds the closest triangle hit by the ray at a distance of at least 0, visiting the nodes front to back and
+    //stopping at the first leaf that contains a hit. outDist is in units of the ray's direction, which need not be normalized
+    bool Intersect(const Ray& ray, uint32_t* outTriangle, float* outDist, KDTraversalStats* stats = nullptr) const;
+    //Intersect that also gives the barycentric coordinates of the hit. The leaf tests only keep the distance, so they
+    //are computed once for the closest triangle after the traversal
+    bool Intersect(const Ray& ray, KDTreeHit* outHit, KDTraversalStats* stats = nullptr) const;
+    //whether the ray hits any triangle at a distance in [0, tMax), in units of the ray's direction. Walks front to back like
+    //Intersect but only up to tMax, and stops at the first hit found instead of looking for the closest one
+    bool Occluded(const Ray& ray, float tMax, KDTraversalStats* stats = nullptr) const;
+    //Occluded for count rays, sets outOccluded for each and returns how many are. Runs of SIMD_WIDTH rays are traced
+    //as packets like IntersectPacket, so rays with close origins and directions should be next to each other
+    size_t Occluded(const Ray* rays, const float* tMax, size_t count, bool* outOccluded, KDTraversalStats* stats = nullptr) const;
+    //Intersect without a stack for a tree built with ropes, other trees use Intersect. Every step descends from the node behind the last
+    //leaf's exit face to the leaf the ray enters next, so nodes above it are not visited again. Same results as Intersect
+    bool IntersectStackless(const Ray& ray, uint32_t* outTriangle, float* outDist, KDTraversalStats* stats = nullptr) const;
+    //Intersect for every ray of the batch with barycentric coordinates, outHits is resized to match it. Runs of rays are traced as packets like
+    //IntersectPacket, split over a pool of threads that is started for the call. Returns how many rays hit
+    size_t Intersect(const RayBatch& rays, HitBatch* outHits, const KDTreeBatchParams& params = KDTreeBatchParams()) const;
+    //Intersect for all rays of a packet, which walk the tree together while their directions have the same signs.
+    //A packet whose rays point different ways, or a tree with kLeafFormatWald or kLeafFormatQuantized leaves, is traced ray by ray.
+    //Fills the lanes that hit and returns their mask. A packet counts once per node it visits in the stats
+    uint32_t IntersectPacket(const RayPacket& packet, uint32_t* outTriangles, float* outDists, KDTraversalStats* stats = nullptr) const;
+    //the original traversal, kept as a reference: descends into both children of every node the ray's line passes,
+    //so it also finds triangles behind the origin
+    bool IntersectRecursive(const Ray& ray, uint32_t* outTriangle, float* outDist, KDTraversalStats* stats = nullptr) const;
+    //point of the mesh closest to p at a distance of at most maxDist, returns false if no triangle is that close. Visits the nodes
+    //best first, in the order of their boxes' distance to p, and stops when the next box is farther than the closest point found.
+    //The stats count the nodes visited and the point-triangle distances computed
+    bool ClosestPoint(const Vector3& p, float maxDist, KDTreeClosestPoint* outResult, KDTraversalStats* stats = nullptr) const;
+    //ClosestPoint for count points, split over a pool of threads that is started for the call. The entries of points with no
+    //triangle within maxDist get the triangle HIT_BATCH_MISS and an infinite distance. Returns how many points have one
+    size_t ClosestPoints(const Vector3* points, size_t count, float maxDist, KDTreeClosestPoint* outResults, unsigned int threadCount = 0) const;
+
+    //range queries, the triangles that overlap a box or a frustum. Subtrees whose boxes lie outside it are skipped and every triangle
+    //is reported once, even if several leaves reference it. The triangles are tested with TriangleOverlapsBox and Frustum::Overlaps,
+    //so the box query is exact and the frustum one conservative. Each thread marks the triangles a query has seen in a buffer
+    //of one entry per mesh triangle, which is only allocated when the thread queries a larger mesh than before. Queries started
+    //by a visitor of another query use a buffer of their own, one per nesting level
+
+    //writes the first capacity triangles found to outTriangles and returns how many there are in total, which may be more than capacity.
+    //The stats count the references skipped because their triangle was seen before as mailboxSkips
+    size_t FindTriangles(const AABB& box, uint32_t* outTriangles, size_t capacity, KDTraversalStats* stats = nullptr) const;
+    size_t FindTriangles(const Frustum& frustum, uint32_t* outTriangles, size_t capacity, KDTraversalStats* stats = nullptr) const;
+    //calls visit for every triangle found until it returns false, and returns how many it was called for. visit may start
+    //other range queries, on this tree or another one
+    size_t ForEachTriangle(const AABB& box, const std::function<bool(uint32_t triangle)>& visit, KDTraversalStats* stats = nullptr) const;
+    size_t ForEachTriangle(const Frustum& frustum, const std::function<bool(uint32_t triangle)>& visit, KDTraversalStats* stats = nullptr) const;
+
+    //walks the whole tree, costModel should be the one it was built with
+    KDTreeStats ComputeStats(const SAHCostModel& costModel = SAHCostModel()) const;
 };
 
 inline bool EventSortPredicate(const SAHEvent& ev0, const SAHEvent& ev1)
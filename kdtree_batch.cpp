@@ -0,0 +1,149 @@
+#include "kdtree.h"
+#include "task_scheduler.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <limits>
+
+//rays per task, a multiple of every SIMD_WIDTH
+#define RAY_BATCH_TASK_SIZE 4096
+//buckets per pass of the coherence sort
+#define RAY_BATCH_RADIX (1 << 10)
+
+//bit i of value moves to bit 3 * i, for values of up to 10 bits
+static inline uint32_t SpreadBits(uint32_t value)
+{
+    value = (value | value << 16) & 0x030000FF;
+    value = (value | value << 8) & 0x0300F00F;
+    value = (value | value << 4) & 0x030C30C3;
+    return (value | value << 2) & 0x09249249;
+}
+
+//value in [min, min + 1 / scale] to an integer in [0, maxValue]
+static inline uint32_t Quantize(float value, float min, float scale, uint32_t maxValue)
+{
+    float quantized = (value - min) * scale * maxValue;
+    return quantized > 0.0f ? std::min((uint32_t)quantized, maxValue) : 0;
+}
+
+//30 bit coherence key: the direction signs on top, a negative zero counts as negative like in IntersectPacket, so rays next to each other can be traced as a packet, then a
+//7 bit per axis Morton code of the origin inside the batch's origin bounds, then a 2 bit per axis one of the direction
+static uint32_t GetCoherenceKey(const RayBatch& rays, size_t i, const AABB& originBounds, const Vector3& originScale)
+{
+    float origin[3] = { rays.originX[i], rays.originY[i], rays.originZ[i] };
+    float direction[3] = { rays.directionX[i], rays.directionY[i], rays.directionZ[i] };
+    float length = fabsf(direction[0]) + fabsf(direction[1]) + fabsf(direction[2]);
+    float directionScale = length > 0.0f ? 1.0f / length : 0.0f;
+    uint32_t octant = 0, originCode = 0, directionCode = 0;
+    for (int k = 0; k < 3; ++k)
+    {
+        octant |= (uint32_t)std::signbit(direction[k]) << k;
+        originCode |= SpreadBits(Quantize(origin[k], originBounds.min[k], originScale[k], 127)) << k;
+        directionCode |= SpreadBits(Quantize(fabsf(direction[k]), 0.0f, directionScale, 3)) << k;
+    }
+    return octant << 27 | originCode << 6 | directionCode;
+}
+
+//indices of the rays in the order they are traced
+static std::vector<uint32_t> GetTraceOrder(const RayBatch& rays, bool sortRays)
+{
+    size_t count = rays.GetCount();
+    std::vector<uint32_t> order(count);
+    if (!sortRays || !count)
+    {
+        for (size_t i = 0; i < count; ++i)
+        {
+            order[i] = (uint32_t)i;
+        }
+        return order;
+    }
+    AABB originBounds;
+    originBounds.min = originBounds.max = Vector3(rays.originX[0], rays.originY[0], rays.originZ[0]);
+    for (size_t i = 1; i < count; ++i)
+    {
+        Vector3 origin(rays.originX[i], rays.originY[i], rays.originZ[i]);
+        for (int k = 0; k < 3; ++k)
+        {
+            originBounds.min[k] = std::min(originBounds.min[k], origin[k]);
+            originBounds.max[k] = std::max(originBounds.max[k], origin[k]);
+        }
+    }
+    Vector3 originScale;
+    for (int k = 0; k < 3; ++k)
+    {
+        float size = originBounds.max[k] - originBounds.min[k];
+        originScale[k] = size > 0.0f ? 1.0f / size : 0.0f;
+    }
+    std::vector<uint32_t> keys(count);
+    for (size_t i = 0; i < count; ++i)
+    {
+        keys[i] = GetCoherenceKey(rays, i, originBounds, originScale);
+        order[i] = (uint32_t)i;
+    }
+    //least significant digit radix sort, 10 bits per pass. It is stable, so rays with the same key keep the batch's order
+    std::vector<uint32_t> sortedKeys(count), sortedOrder(count);
+    for (int shift = 0; shift < 30; shift += 10)
+    {
+        uint32_t offsets[RAY_BATCH_RADIX + 1] = {};
+        for (size_t i = 0; i < count; ++i)
+        {
+            offsets[((keys[i] >> shift) & (RAY_BATCH_RADIX - 1)) + 1]++;
+        }
+        for (int digit = 0; digit < RAY_BATCH_RADIX; ++digit)
+        {
+            offsets[digit + 1] += offsets[digit];
+        }
+        for (size_t i = 0; i < count; ++i)
+        {
+            uint32_t position = offsets[(keys[i] >> shift) & (RAY_BATCH_RADIX - 1)]++;
+            sortedKeys[position] = keys[i];
+            sortedOrder[position] = order[i];
+        }
+        keys.swap(sortedKeys);
+        order.swap(sortedOrder);
+    }
+    return order;
+}
+
+size_t KDTree::Intersect(const RayBatch& rays, HitBatch* outHits, const KDTreeBatchParams& params) const
+{
+    size_t count = rays.GetCount();
+    outHits->triangles.assign(count, HIT_BATCH_MISS);
+    outHits->distances.assign(count, std::numeric_limits<float>::infinity());
+    outHits->u.assign(count, 0.0f);
+    outHits->v.assign(count, 0.0f);
+    std::vector<uint32_t> order = GetTraceOrder(rays, params.sortRays);
+    std::atomic<size_t> hitCount{0};
+    auto traceRays = [&](size_t begin, size_t end) {
+        size_t hits = 0;
+        for (size_t first = begin; first < end; first += SIMD_WIDTH)
+        {
+            RayPacket packet;
+            int lanes = (int)std::min<size_t>(SIMD_WIDTH, end - first);
+            for (int lane = 0; lane < lanes; ++lane)
+            {
+                packet.SetRay(lane, rays.GetRay(order[first + lane]));
+            }
+            uint32_t triangles[SIMD_WIDTH];
+            float distances[SIMD_WIDTH];
+            for (uint32_t lanesHit = IntersectPacket(packet, triangles, distances); lanesHit; lanesHit &= lanesHit - 1)
+            {
+                int lane = __builtin_ctz(lanesHit);
+                uint32_t ray = order[first + lane];
+                outHits->triangles[ray] = triangles[lane];
+                outHits->distances[ray] = distances[lane];
+                GetBarycentrics(m_View.mesh->GetTriangle(triangles[lane]), packet.GetRay(lane), &outHits->u[ray], &outHits->v[ray]);
+                hits++;
+            }
+        }
+        hitCount += hits;
+    };
+    TaskScheduler scheduler(params.threadCount);
+    TaskGroup group;
+    for (size_t begin = 0; begin < count; begin += RAY_BATCH_TASK_SIZE)
+    {
+        scheduler.Run(group, [&, begin]() { traceRays(begin, std::min(count, begin + RAY_BATCH_TASK_SIZE)); });
+    }
+    scheduler.Wait(group);
+    return hitCount;
+}
@@ -0,0 +1,171 @@
+#include "kdtree.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+//bump whenever the builder or the node layout changes the tree that a given input produces
+#define KDTREE_CACHE_VERSION 2
+#define KDTREE_CACHE_MAGIC 0x4354444Bu // "KDTC" read as a little endian uint32
+
+//the header is followed by the node array and the triangle index array, both 8 byte aligned,
+//so a mapped file can be traversed in place
+struct KDTreeCacheHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t triangleHash;
+    uint64_t buildHash;
+    uint64_t triangleCount;
+    uint64_t nodeCount;
+    uint64_t triangleIndexCount;
+    uint64_t nodesOffset;
+    uint64_t triangleIndicesOffset;
+    uint64_t fileSize;
+};
+
+//FNV-1a over 32 bit words, floats are hashed by their bits so any change to the input invalidates the cache
+static uint64_t HashWords(uint64_t hash, const void* data, size_t bytes)
+{
+    const uint8_t* words = static_cast<const uint8_t*>(data);
+    for (size_t i = 0; i + 4 <= bytes; i += 4)
+    {
+        uint32_t word;
+        memcpy(&word, words + i, 4);
+        hash = (hash ^ word) * 1099511628211ull;
+    }
+    return hash;
+}
+
+static uint64_t HashTriangles(const TriangleMesh& mesh)
+{
+    uint64_t hash = 1469598103934665603ull;
+    hash = HashWords(hash, mesh.vertexX.data(), mesh.vertexX.size() * sizeof(float));
+    hash = HashWords(hash, mesh.vertexY.data(), mesh.vertexY.size() * sizeof(float));
+    hash = HashWords(hash, mesh.vertexZ.data(), mesh.vertexZ.size() * sizeof(float));
+    hash = HashWords(hash, mesh.indices.data(), mesh.indices.size() * sizeof(uint32_t));
+    return hash;
+}
+
+//everything besides the triangles that decides what the builder produces, the thread count does not
+static uint64_t HashBuild(const AABB& aabb, const KDTreeBuildParams& params)
+{
+    uint32_t settings[] = { (uint32_t)params.mode, params.binCount, params.exactThreshold, (uint32_t)params.perfectSplits };
+    uint64_t hash = 1469598103934665603ull;
+    hash = HashWords(hash, &aabb.min, sizeof(Vector3));
+    hash = HashWords(hash, &aabb.max, sizeof(Vector3));
+    hash = HashWords(hash, &params.costModel, sizeof(params.costModel));
+    hash = HashWords(hash, settings, sizeof(settings));
+    return hash;
+}
+
+static uint64_t AlignOffset(uint64_t offset)
+{
+    return (offset + 7) & ~7ull;
+}
+
+//the hashes only say the file was written for this input, not that its contents survived. Every child and leaf range
+//has to lie inside its array, every triangle id inside the mesh, and no inner node may be deeper than the traversal stacks
+//allow. Children come after their parent in the depth first order, so one pass in node order sees every parent first
+static bool ValidateNodes(const KDTreeNode* nodes, size_t nodeCount, const uint32_t* triangleIndices, size_t triangleIndexCount, size_t triangleCount)
+{
+    std::vector<uint8_t> depths(nodeCount, 0);
+    for (size_t i = 0; i < nodeCount; ++i)
+    {
+        const KDTreeNode& node = nodes[i];
+        if (node.IsLeaf())
+        {
+            if ((uint64_t)node.GetTriangleOffset() + node.GetTriangleCount() > triangleIndexCount)
+                return false;
+            continue;
+        }
+        uint32_t above = node.GetAboveChild();
+        if (depths[i] >= KDTREE_MAX_DEPTH || i + 1 >= nodeCount || above <= i + 1 || above >= nodeCount)
+            return false;
+        depths[i + 1] = std::max(depths[i + 1], (uint8_t)(depths[i] + 1));
+        depths[above] = std::max(depths[above], (uint8_t)(depths[i] + 1));
+    }
+    for (size_t i = 0; i < triangleIndexCount; ++i)
+    {
+        if (triangleIndices[i] >= triangleCount)
+            return false;
+    }
+    return true;
+}
+
+std::unique_ptr<KDTree> KDTree::LoadCache(const char* path, const TriangleMesh& mesh, const AABB& aabb, const KDTreeBuildParams& params)
+{
+    std::unique_ptr<KDTree> tree(new KDTree());
+    if (!tree->m_CacheFile.Open(path))
+        return nullptr;
+    const uint8_t* data = static_cast<const uint8_t*>(tree->m_CacheFile.GetData());
+    size_t size = tree->m_CacheFile.GetSize();
+    if (size < sizeof(KDTreeCacheHeader))
+        return nullptr;
+    const KDTreeCacheHeader* header = reinterpret_cast<const KDTreeCacheHeader*>(data);
+    if (header->magic != KDTREE_CACHE_MAGIC || header->version != KDTREE_CACHE_VERSION || header->fileSize != size)
+        return nullptr;
+    if (header->triangleCount != mesh.GetTriangleCount() || header->buildHash != HashBuild(aabb, params) || header->triangleHash != HashTriangles(mesh))
+        return nullptr;
+    //the arrays have to lie inside the file, otherwise it was truncated or written by something else
+    if (header->nodeCount == 0 || header->nodesOffset % 8 || header->triangleIndicesOffset % 8 ||
+        header->nodesOffset > size || header->triangleIndicesOffset > size ||
+        header->nodeCount > size / sizeof(KDTreeNode) || header->triangleIndexCount > size / sizeof(uint32_t) ||
+        header->nodesOffset + header->nodeCount * sizeof(KDTreeNode) > size ||
+        header->triangleIndicesOffset + header->triangleIndexCount * sizeof(uint32_t) > size)
+        return nullptr;
+    const KDTreeNode* nodes = reinterpret_cast<const KDTreeNode*>(data + header->nodesOffset);
+    const uint32_t* triangleIndices = reinterpret_cast<const uint32_t*>(data + header->triangleIndicesOffset);
+    if (!ValidateNodes(nodes, header->nodeCount, triangleIndices, header->triangleIndexCount, mesh.GetTriangleCount()))
+        return nullptr;
+    tree->m_View.nodes = nodes;
+    tree->m_View.nodeCount = header->nodeCount;
+    tree->m_View.triangleIndices = triangleIndices;
+    tree->m_View.triangleIndexCount = header->triangleIndexCount;
+    tree->m_View.mesh = &mesh;
+    tree->m_View.aabb = aabb;
+    tree->m_View.mailboxes = params.mailboxes;
+    tree->m_BuildScratchBytes = 0;
+    tree->m_EventListSeconds = 0.0;
+    tree->m_NodeBuildSeconds = 0.0;
+    tree->CreateLeafTriangles(params.leafFormat);
+    if (params.ropes)
+        tree->CreateRopes();
+    return tree;
+}
+
+bool KDTree::SaveCache(const char* path, const TriangleMesh& mesh, const KDTreeBuildParams& params) const
+{
+    KDTreeCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = KDTREE_CACHE_MAGIC;
+    header.version = KDTREE_CACHE_VERSION;
+    header.triangleHash = HashTriangles(mesh);
+    header.buildHash = HashBuild(m_View.aabb, params);
+    header.triangleCount = mesh.GetTriangleCount();
+    header.nodeCount = m_View.nodeCount;
+    header.triangleIndexCount = m_View.triangleIndexCount;
+    header.nodesOffset = AlignOffset(sizeof(header));
+    header.triangleIndicesOffset = AlignOffset(header.nodesOffset + header.nodeCount * sizeof(KDTreeNode));
+    header.fileSize = header.triangleIndicesOffset + header.triangleIndexCount * sizeof(uint32_t);
+
+    //write next to the target and rename, so processes mapping the old file never see a partial one
+    std::string tmpPath = std::string(path) + ".tmp";
+    FILE* file = fopen(tmpPath.c_str(), "wb");
+    if (!file)
+        return false;
+    static const uint8_t padding[8] = {};
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+    ok = ok && fwrite(padding, 1, header.nodesOffset - sizeof(header), file) == header.nodesOffset - sizeof(header);
+    ok = ok && fwrite(m_View.nodes, sizeof(KDTreeNode), m_View.nodeCount, file) == m_View.nodeCount;
+    uint64_t nodesEnd = header.nodesOffset + header.nodeCount * sizeof(KDTreeNode);
+    ok = ok && fwrite(padding, 1, header.triangleIndicesOffset - nodesEnd, file) == header.triangleIndicesOffset - nodesEnd;
+    ok = ok && fwrite(m_View.triangleIndices, sizeof(uint32_t), m_View.triangleIndexCount, file) == m_View.triangleIndexCount;
+    ok = fclose(file) == 0 && ok;
+    if (!ok || rename(tmpPath.c_str(), path) != 0)
+    {
+        remove(tmpPath.c_str());
+        return false;
+    }
+    return true;
+}
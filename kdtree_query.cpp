@@ -0,0 +1,338 @@
+#include "kdtree.h"
+#include "task_scheduler.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <limits>
+#include <memory>
+
+//points per task of KDTree::ClosestPoints
+#define CLOSEST_POINT_TASK_SIZE 1024
+
+//node waiting in the best first traversal, with its box and the squared distance from the query point to it
+struct ClosestPointEntry
+{
+    float distanceSquared;
+    uint32_t node;
+    AABB aabb;
+
+    //the heap functions build a max heap, this makes it one with the closest node on top
+    bool operator<(const ClosestPointEntry& other) const { return distanceSquared > other.distanceSquared; }
+};
+
+static inline float GetDistanceSquared(const AABB& aabb, const Vector3& p)
+{
+    float distanceSquared = 0.0f;
+    for (int k = 0; k < 3; ++k)
+    {
+        float d = std::max(std::max(aabb.min[k] - p[k], p[k] - aabb.max[k]), 0.0f);
+        distanceSquared += d * d;
+    }
+    return distanceSquared;
+}
+
+//the traversal of KDTree::ClosestPoint, heap is scratch space that is kept between queries so a batch does not allocate for each
+static bool FindClosestPoint(const KDTreeView& tree, const Vector3& p, float maxDist, std::vector<ClosestPointEntry>& heap,
+    KDTreeClosestPoint* outResult, KDTraversalStats* stats)
+{
+    float bestSquared = maxDist * maxDist;
+    bool found = false;
+    heap.clear();
+    float rootSquared = GetDistanceSquared(tree.aabb, p);
+    if (rootSquared <= bestSquared)
+    {
+        heap.push_back({ rootSquared, 0, tree.aabb });
+    }
+    while (!heap.empty())
+    {
+        std::pop_heap(heap.begin(), heap.end());
+        ClosestPointEntry entry = heap.back();
+        heap.pop_back();
+        if (entry.distanceSquared > bestSquared)
+        {
+            break;
+        }
+        //go down the closer child right away and leave the other one for later
+        while (!tree.nodes[entry.node].IsLeaf())
+        {
+            const KDTreeNode& node = tree.nodes[entry.node];
+            if (stats)
+            {
+                stats->innerNodes++;
+            }
+            Axis axis = node.GetAxis();
+            ClosestPointEntry below = { 0.0f, entry.node + 1, entry.aabb };
+            ClosestPointEntry above = { 0.0f, node.GetAboveChild(), entry.aabb };
+            below.aabb.max[axis] = node.GetSplitPosition();
+            above.aabb.min[axis] = node.GetSplitPosition();
+            below.distanceSquared = GetDistanceSquared(below.aabb, p);
+            above.distanceSquared = GetDistanceSquared(above.aabb, p);
+            if (above.distanceSquared < below.distanceSquared)
+            {
+                std::swap(below, above);
+            }
+            if (above.distanceSquared <= bestSquared)
+            {
+                heap.push_back(above);
+                std::push_heap(heap.begin(), heap.end());
+            }
+            entry = below;
+        }
+        const KDTreeNode& leaf = tree.nodes[entry.node];
+        if (stats)
+        {
+            stats->leaves++;
+            stats->triangleTests += leaf.GetTriangleCount();
+        }
+        for (uint32_t i = 0; i < leaf.GetTriangleCount(); ++i)
+        {
+            float u, v;
+            Vector3 point = ClosestPointOnTriangle(tree.GetTriangle(leaf, i), p, &u, &v);
+            float distanceSquared = (point - p).SqrMagnitude();
+            if (distanceSquared < bestSquared || (!found && distanceSquared <= bestSquared))
+            {
+                bestSquared = distanceSquared;
+                found = true;
+                outResult->triangle = tree.GetTriangleId(leaf, i);
+                outResult->point = point;
+                outResult->u = u;
+                outResult->v = v;
+            }
+        }
+    }
+    if (found)
+    {
+        outResult->distance = std::sqrt(bestSquared);
+    }
+    return found;
+}
+
+bool KDTree::ClosestPoint(const Vector3& p, float maxDist, KDTreeClosestPoint* outResult, KDTraversalStats* stats) const
+{
+    std::vector<ClosestPointEntry> heap;
+    return FindClosestPoint(m_View, p, maxDist, heap, outResult, stats);
+}
+
+size_t KDTree::ClosestPoints(const Vector3* points, size_t count, float maxDist, KDTreeClosestPoint* outResults, unsigned int threadCount) const
+{
+    std::atomic<size_t> foundCount{0};
+    auto findPoints = [&](size_t begin, size_t end) {
+        std::vector<ClosestPointEntry> heap;
+        size_t found = 0;
+        for (size_t i = begin; i < end; ++i)
+        {
+            if (FindClosestPoint(m_View, points[i], maxDist, heap, &outResults[i], nullptr))
+            {
+                found++;
+            }
+            else
+            {
+                outResults[i].triangle = HIT_BATCH_MISS;
+                outResults[i].point = Vector3(0.0f, 0.0f, 0.0f);
+                outResults[i].distance = std::numeric_limits<float>::infinity();
+                outResults[i].u = 0.0f;
+                outResults[i].v = 0.0f;
+            }
+        }
+        foundCount += found;
+    };
+    TaskScheduler scheduler(threadCount);
+    TaskGroup group;
+    for (size_t begin = 0; begin < count; begin += CLOSEST_POINT_TASK_SIZE)
+    {
+        scheduler.Run(group, [&, begin]() { findPoints(begin, std::min(count, begin + CLOSEST_POINT_TASK_SIZE)); });
+    }
+    scheduler.Wait(group);
+    return foundCount;
+}
+
+//marks of the triangles the current range query of a thread has seen, stamps[triangle] == query if it has. Starting a query
+//only increments the id, the stamps are cleared when it wraps around
+struct RangeQueryMarks
+{
+    std::vector<uint32_t> stamps;
+    uint32_t query = 0;
+
+    void Begin(size_t triangleCount)
+    {
+        if (stamps.size() < triangleCount)
+            stamps.resize(triangleCount, 0);
+        if (++query == 0)
+        {
+            std::fill(stamps.begin(), stamps.end(), 0);
+            query = 1;
+        }
+    }
+
+    //false if the triangle was seen before in this query
+    bool Mark(uint32_t triangle)
+    {
+        if (stamps[triangle] == query)
+            return false;
+        stamps[triangle] = query;
+        return true;
+    }
+};
+
+//one set of marks per nesting level, a visitor that starts another range query gets the next level's
+struct RangeQueryMarkStack
+{
+    std::vector<std::unique_ptr<RangeQueryMarks>> levels;
+    size_t depth = 0;
+};
+
+static thread_local RangeQueryMarkStack s_RangeQueryMarks;
+
+//holds the marks of the next free level for the lifetime of a query
+struct RangeQueryScope
+{
+    RangeQueryMarkStack& stack;
+    RangeQueryMarks* marks;
+
+    RangeQueryScope(RangeQueryMarkStack& markStack) : stack(markStack)
+    {
+        if (stack.levels.size() == stack.depth)
+            stack.levels.emplace_back(new RangeQueryMarks());
+        marks = stack.levels[stack.depth++].get();
+    }
+
+    ~RangeQueryScope() { stack.depth--; }
+};
+
+//the box of a range query, nodes and triangles overlap it if they touch it
+struct BoxRegion
+{
+    const AABB& box;
+
+    bool Overlaps(const AABB& aabb, uint32_t*) const
+    {
+        for (int k = 0; k < 3; ++k)
+        {
+            if (aabb.min[k] > box.max[k] || aabb.max[k] < box.min[k])
+                return false;
+        }
+        return true;
+    }
+
+    bool Overlaps(const Triangle& triangle) const { return TriangleOverlapsBox(triangle, box); }
+};
+
+//the frustum of a range query, nodes inside some of its planes skip them, see Frustum::Overlaps
+struct FrustumRegion
+{
+    const Frustum& frustum;
+
+    bool Overlaps(const AABB& aabb, uint32_t* planes) const { return frustum.Overlaps(aabb, planes); }
+    bool Overlaps(const Triangle& triangle) const { return frustum.Overlaps(triangle); }
+};
+
+//calls visit for every triangle that overlaps the region until it returns false, returns how many it was called for.
+//Walks the tree depth first with the boxes of the nodes, below children first
+template<typename Region, typename Visit>
+static size_t VisitTriangles(const KDTreeView& tree, const Region& region, const Visit& visit, KDTraversalStats* stats)
+{
+    struct StackEntry
+    {
+        uint32_t node;
+        uint32_t planes;
+        AABB aabb;
+    };
+    uint32_t planes = FRUSTUM_ALL_PLANES;
+    if (!region.Overlaps(tree.aabb, &planes))
+        return 0;
+    RangeQueryScope scope(s_RangeQueryMarks);
+    RangeQueryMarks& marks = *scope.marks;
+    marks.Begin(tree.mesh->GetTriangleCount());
+    //one entry per level at most, and the builder never goes deeper than KDTREE_MAX_DEPTH
+    StackEntry stack[KDTREE_MAX_DEPTH];
+    int stackSize = 0;
+    StackEntry entry = { 0, planes, tree.aabb };
+    size_t count = 0;
+    while (true)
+    {
+        bool leaf = true;
+        while (!tree.nodes[entry.node].IsLeaf())
+        {
+            const KDTreeNode& node = tree.nodes[entry.node];
+            if (stats)
+                stats->innerNodes++;
+            Axis axis = node.GetAxis();
+            StackEntry below = { entry.node + 1, entry.planes, entry.aabb };
+            StackEntry above = { node.GetAboveChild(), entry.planes, entry.aabb };
+            below.aabb.max[axis] = node.GetSplitPosition();
+            above.aabb.min[axis] = node.GetSplitPosition();
+            bool belowOverlaps = region.Overlaps(below.aabb, &below.planes);
+            bool aboveOverlaps = region.Overlaps(above.aabb, &above.planes);
+            if (belowOverlaps && aboveOverlaps)
+                stack[stackSize++] = above;
+            if (!belowOverlaps && !aboveOverlaps)
+            {
+                leaf = false;
+                break;
+            }
+            entry = belowOverlaps ? below : above;
+        }
+        if (leaf)
+        {
+            const KDTreeNode& node = tree.nodes[entry.node];
+            if (stats)
+                stats->leaves++;
+            for (uint32_t i = 0; i < node.GetTriangleCount(); ++i)
+            {
+                uint32_t triangle = tree.GetTriangleId(node, i);
+                if (!marks.Mark(triangle))
+                {
+                    if (stats)
+                        stats->mailboxSkips++;
+                    continue;
+                }
+                if (stats)
+                    stats->triangleTests++;
+                if (region.Overlaps(tree.mesh->GetTriangle(triangle)))
+                {
+                    count++;
+                    if (!visit(triangle))
+                        return count;
+                }
+            }
+        }
+        if (!stackSize)
+            return count;
+        entry = stack[--stackSize];
+    }
+}
+
+//writes the first capacity triangles to outTriangles and counts the rest
+template<typename Region>
+static size_t FindRegionTriangles(const KDTreeView& tree, const Region& region, uint32_t* outTriangles, size_t capacity, KDTraversalStats* stats)
+{
+    size_t count = 0;
+    auto write = [&](uint32_t triangle) {
+        if (count < capacity)
+            outTriangles[count] = triangle;
+        count++;
+        return true;
+    };
+    VisitTriangles(tree, region, write, stats);
+    return count;
+}
+
+size_t KDTree::FindTriangles(const AABB& box, uint32_t* outTriangles, size_t capacity, KDTraversalStats* stats) const
+{
+    return FindRegionTriangles(m_View, BoxRegion{ box }, outTriangles, capacity, stats);
+}
+
+size_t KDTree::FindTriangles(const Frustum& frustum, uint32_t* outTriangles, size_t capacity, KDTraversalStats* stats) const
+{
+    return FindRegionTriangles(m_View, FrustumRegion{ frustum }, outTriangles, capacity, stats);
+}
+
+size_t KDTree::ForEachTriangle(const AABB& box, const std::function<bool(uint32_t triangle)>& visit, KDTraversalStats* stats) const
+{
+    return VisitTriangles(m_View, BoxRegion{ box }, visit, stats);
+}
+
+size_t KDTree::ForEachTriangle(const Frustum& frustum, const std::function<bool(uint32_t triangle)>& visit, KDTraversalStats* stats) const
+{
+    return VisitTriangles(m_View, FrustumRegion{ frustum }, visit, stats);
+}
@@ -0,0 +1,135 @@
+#include "kdtree.h"
+#include <algorithm>
+
+KDTreeStats KDTree::ComputeStats(const SAHCostModel& costModel) const
+{
+    KDTreeStats stats = {};
+    stats.nodeCount = m_View.nodeCount;
+    stats.triangleReferenceCount = m_View.triangleIndexCount;
+    stats.nodeBytes = m_View.nodeCount * sizeof(KDTreeNode);
+    stats.triangleIndexBytes = m_View.triangleIndexCount * sizeof(uint32_t);
+    stats.leafTriangleBytes = GetLeafTriangleBytes();
+    stats.ropeBytes = GetRopeBytes();
+
+    //the tree's box is usually much bigger than the model, so the ray probabilities are taken relative to the
+    //bounds of the referenced triangles instead
+    std::vector<bool> referenced;
+    AABB sceneBounds = m_View.aabb;
+    for (size_t i = 0; i < m_View.triangleIndexCount; ++i)
+    {
+        uint32_t index = m_View.triangleIndices[i];
+        if (referenced.size() <= index)
+            referenced.resize(index + 1);
+        if (referenced[index])
+            continue;
+        referenced[index] = true;
+        Triangle triangle = m_View.mesh->GetTriangle(index);
+        for (uint8_t k = kAxisX; k < kAxesCount; ++k)
+        {
+            float lo = triangle.GetAxisMin((Axis)k);
+            float hi = triangle.GetAxisMax((Axis)k);
+            sceneBounds.min[k] = stats.triangleCount ? std::min(sceneBounds.min[k], lo) : lo;
+            sceneBounds.max[k] = stats.triangleCount ? std::max(sceneBounds.max[k], hi) : hi;
+        }
+        stats.triangleCount++;
+    }
+
+    //child boxes are not stored, so walk the tree with an explicit stack and cut them from the parent's box
+    struct StackEntry
+    {
+        uint32_t node;
+        uint32_t depth;
+        AABB aabb;
+    };
+    std::vector<StackEntry> stack;
+    stack.push_back({ 0, 0, m_View.aabb });
+    double rcpSceneSurface = 1.0 / sceneBounds.GetSurfaceArea();
+    double depthSum = 0.0;
+    while (!stack.empty())
+    {
+        StackEntry entry = stack.back();
+        stack.pop_back();
+        const KDTreeNode& node = m_View.nodes[entry.node];
+        //probability that a ray through the scene bounds also passes through the part of this node's box inside them
+        AABB visible = entry.aabb;
+        bool empty = false;
+        for (uint8_t k = kAxisX; k < kAxesCount; ++k)
+        {
+            visible.min[k] = std::max(visible.min[k], sceneBounds.min[k]);
+            visible.max[k] = std::min(visible.max[k], sceneBounds.max[k]);
+            empty = empty || visible.min[k] > visible.max[k];
+        }
+        double probability = empty ? 0.0 : visible.GetSurfaceArea() * rcpSceneSurface;
+        if (!node.IsLeaf())
+        {
+            stats.innerNodeCount++;
+            stats.expectedInnerNodeVisits += probability;
+            AABB below = entry.aabb;
+            AABB above = entry.aabb;
+            below.max[node.GetAxis()] = node.GetSplitPosition();
+            above.min[node.GetAxis()] = node.GetSplitPosition();
+            stack.push_back({ node.GetAboveChild(), entry.depth + 1, above });
+            stack.push_back({ entry.node + 1, entry.depth + 1, below });
+            continue;
+        }
+        uint32_t size = node.GetTriangleCount();
+        stats.leafCount++;
+        stats.emptyLeafCount += size == 0;
+        stats.maxDepth = std::max(stats.maxDepth, entry.depth);
+        stats.maxLeafSize = std::max(stats.maxLeafSize, size);
+        stats.expectedTriangleTests += probability * size;
+        depthSum += entry.depth;
+        if (stats.leafSizeHistogram.size() <= size)
+            stats.leafSizeHistogram.resize(size + 1);
+        stats.leafSizeHistogram[size]++;
+        if (stats.depthHistogram.size() <= entry.depth)
+            stats.depthHistogram.resize(entry.depth + 1);
+        stats.depthHistogram[entry.depth]++;
+    }
+    stats.averageLeafDepth = stats.leafCount ? depthSum / stats.leafCount : 0.0;
+    size_t filledLeaves = stats.leafCount - stats.emptyLeafCount;
+    stats.averageLeafSize = filledLeaves ? (double)stats.triangleReferenceCount / filledLeaves : 0.0;
+    stats.sahCost = costModel.traversal * stats.expectedInnerNodeVisits + costModel.intersection * stats.expectedTriangleTests;
+    stats.duplicationFactor = stats.triangleCount ? (double)stats.triangleReferenceCount / stats.triangleCount : 0.0;
+    return stats;
+}
+
+static bool WriteJSONArray(FILE* file, const char* name, const std::vector<size_t>& values)
+{
+    bool ok = fprintf(file, "  \"%s\": [", name) > 0;
+    for (size_t i = 0; i < values.size(); ++i)
+    {
+        ok = ok && fprintf(file, i ? ", %zu" : "%zu", values[i]) > 0;
+    }
+    return ok && fprintf(file, "]") > 0;
+}
+
+bool KDTreeStats::WriteJSON(FILE* file) const
+{
+    bool ok = fprintf(file, "{\n"
+        "  \"nodeCount\": %zu,\n"
+        "  \"innerNodeCount\": %zu,\n"
+        "  \"leafCount\": %zu,\n"
+        "  \"emptyLeafCount\": %zu,\n"
+        "  \"maxDepth\": %u,\n"
+        "  \"averageLeafDepth\": %.6g,\n"
+        "  \"maxLeafSize\": %u,\n"
+        "  \"averageLeafSize\": %.6g,\n"
+        "  \"triangleCount\": %zu,\n"
+        "  \"triangleReferenceCount\": %zu,\n"
+        "  \"duplicationFactor\": %.6g,\n"
+        "  \"expectedInnerNodeVisits\": %.6g,\n"
+        "  \"expectedTriangleTests\": %.6g,\n"
+        "  \"sahCost\": %.6g,\n"
+        "  \"nodeBytes\": %zu,\n"
+        "  \"triangleIndexBytes\": %zu,\n"
+        "  \"leafTriangleBytes\": %zu,\n"
+        "  \"ropeBytes\": %zu,\n"
+        "  \"totalBytes\": %zu,\n",
+        nodeCount, innerNodeCount, leafCount, emptyLeafCount, maxDepth, averageLeafDepth, maxLeafSize, averageLeafSize,
+        triangleCount, triangleReferenceCount, duplicationFactor, expectedInnerNodeVisits, expectedTriangleTests, sahCost,
+        nodeBytes, triangleIndexBytes, leafTriangleBytes, ropeBytes, GetTotalBytes()) > 0;
+    ok = ok && WriteJSONArray(file, "leafSizeHistogram", leafSizeHistogram) && fprintf(file, ",\n") > 0;
+    ok = ok && WriteJSONArray(file, "depthHistogram", depthHistogram) && fprintf(file, "\n}\n") > 0;
+    return ok;
+}
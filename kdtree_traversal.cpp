@@ -0,0 +1,718 @@
+#include "kdtree.h"
+#include "intersection.h"
+#include <algorithm>
+#include <limits>
+
+//leaf triangle tests for every KDTreeLeafFormat, reference is an index into the tree's triangle index array
+struct IndexedLeafTest
+{
+    const KDTreeView& tree;
+    bool operator()(uint32_t reference, const Ray& ray, float* outT) const
+    {
+        return TestTriangle(tree.mesh->GetTriangle(tree.triangleIndices[reference]), ray, outT);
+    }
+};
+
+struct EdgeLeafTest
+{
+    const KDTreeView& tree;
+    bool operator()(uint32_t reference, const Ray& ray, float* outT) const
+    {
+        return tree.edgeTriangles[reference].Intersect(ray, outT);
+    }
+};
+
+struct WaldLeafTest
+{
+    const KDTreeView& tree;
+    bool operator()(uint32_t reference, const Ray& ray, float* outT) const
+    {
+        return tree.waldTriangles[reference].Intersect(ray, outT);
+    }
+};
+
+struct BlockLeafTest
+{
+    const KDTreeView& tree;
+    bool operator()(uint32_t reference, const Ray& ray, float* outT) const
+    {
+        return tree.triangleBlocks[reference / SIMD_WIDTH].GetTriangle(reference % SIMD_WIDTH).Intersect(ray, outT);
+    }
+};
+
+struct QuantizedLeafTest
+{
+    const KDTreeView& tree;
+    bool operator()(uint32_t reference, const Ray& ray, float* outT) const
+    {
+        const QuantizedTriangle& triangle = tree.quantizedTriangles[reference];
+        return triangle.Intersect(tree.quantizationFrames[triangle.frame], ray, outT);
+    }
+};
+
+//the last triangles a thread tested, each tagged with the ray it was tested for [Amanatides and Woo, 1987]. It is
+//per thread and hashed instead of a ray id per triangle, so the shared tree is never written to. A new ray id makes
+//all entries stale without clearing them, and two triangles in one slot only cost a test again
+struct Mailbox
+{
+    uint32_t ray = 0;
+    uint32_t rays[1 << KDTREE_MAILBOX_BITS] = {};
+    uint32_t triangles[1 << KDTREE_MAILBOX_BITS] = {};
+
+    uint32_t NextRay()
+    {
+        if (++ray == 0)
+        {
+            std::fill(rays, rays + (1 << KDTREE_MAILBOX_BITS), 0);
+            ray = 1;
+        }
+        return ray;
+    }
+};
+
+static thread_local Mailbox s_Mailbox;
+
+//a leaf test that skips the triangles the mailbox already holds for this ray. Skipping is safe: the traversals keep
+//the closest hit of every test in front of the origin, even one beyond the leaf, so a repeated test finds nothing new
+template<typename LeafTest>
+struct MailboxLeafTest
+{
+    const LeafTest& test;
+    const KDTreeView& tree;
+    Mailbox& mailbox;
+    uint32_t ray;
+    KDTraversalStats* stats;
+    bool operator()(uint32_t reference, const Ray& r, float* outT) const
+    {
+        uint32_t triangle = tree.triangleIndices[reference];
+        uint32_t slot = (triangle * 2654435761u) >> (32 - KDTREE_MAILBOX_BITS);
+        if (mailbox.rays[slot] == ray && mailbox.triangles[slot] == triangle)
+        {
+            if (stats)
+                stats->mailboxSkips++;
+            return false;
+        }
+        mailbox.rays[slot] = ray;
+        mailbox.triangles[slot] = triangle;
+        return test(reference, r, outT);
+    }
+};
+
+//calls function with the leaf test wrapped in a mailbox if the tree asks for one, once per traversed ray
+template<typename LeafTest, typename Function>
+static bool WithMailbox(const KDTreeView& tree, const LeafTest& test, KDTraversalStats* stats, const Function& function)
+{
+    if (!tree.mailboxes)
+        return function(test);
+    Mailbox& mailbox = s_Mailbox;
+    return function(MailboxLeafTest<LeafTest>{ test, tree, mailbox, mailbox.NextRay(), stats });
+}
+
+//blocks test SIMD_WIDTH references at once, skipping single lanes would not save any work
+template<typename Function>
+static bool WithMailbox(const KDTreeView&, const BlockLeafTest& test, KDTraversalStats*, const Function& function)
+{
+    return function(test);
+}
+
+//closest hit at a distance of at least 0 and below *outDist among the references [begin, end)
+template<typename LeafTest>
+static inline bool TestReferences(const KDTreeView& tree, const LeafTest& test, uint32_t begin, uint32_t end, const Ray& ray, uint32_t* outTriangle, float* outDist)
+{
+    bool hit = false;
+    for (uint32_t i = begin; i < end; ++i)
+    {
+        float t;
+        if (test(i, ray, &t) && t >= 0.0f && t < *outDist)
+        {
+            *outTriangle = tree.triangleIndices[i];
+            *outDist = t;
+            hit = true;
+        }
+    }
+    return hit;
+}
+
+//lanes of a block that hold references in [begin, end)
+static inline SimdMask GetBlockLanes(uint32_t block, uint32_t begin, uint32_t end)
+{
+    alignas(SIMD_WIDTH * 4) static const float kLaneIndices[16] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 };
+    uint32_t first = block * SIMD_WIDTH;
+    SimdFloat lane = SimdFloat::Load(kLaneIndices);
+    SimdFloat lanesBegin = SimdFloat::Broadcast(begin > first ? (float)(begin - first) : 0.0f);
+    SimdFloat lanesEnd = SimdFloat::Broadcast((float)(end - first));
+    return (lane >= lanesBegin) & (lane < lanesEnd);
+}
+
+//the blocks test a whole block per step. The closest of a block's hits is picked in lane order, so ties go to the
+//first reference like in the loop above
+static inline bool TestReferences(const KDTreeView& tree, const BlockLeafTest&, uint32_t begin, uint32_t end, const Ray& ray, uint32_t* outTriangle, float* outDist)
+{
+    SimdFloat origin[3], direction[3];
+    for (int k = 0; k < 3; ++k)
+    {
+        origin[k] = SimdFloat::Broadcast(ray.origin[k]);
+        direction[k] = SimdFloat::Broadcast(ray.direction[k]);
+    }
+    SimdFloat zero = SimdFloat::Broadcast(0.0f);
+    bool hit = false;
+    for (uint32_t block = begin / SIMD_WIDTH; block * SIMD_WIDTH < end; ++block)
+    {
+        SimdFloat t;
+        SimdMask found = tree.triangleBlocks[block].Intersect(origin, direction, GetBlockLanes(block, begin, end), &t);
+        found = found & (t >= zero) & (t < SimdFloat::Broadcast(*outDist));
+        uint32_t bits = found.GetBits();
+        if (!bits)
+            continue;
+        alignas(SIMD_WIDTH * 4) float distances[SIMD_WIDTH];
+        t.Store(distances);
+        for (; bits; bits &= bits - 1)
+        {
+            int i = __builtin_ctz(bits);
+            if (distances[i] < *outDist)
+            {
+                *outTriangle = tree.triangleIndices[block * SIMD_WIDTH + i];
+                *outDist = distances[i];
+                hit = true;
+            }
+        }
+    }
+    return hit;
+}
+
+//whether any reference in [begin, end) is hit at a distance in [0, tMax), stops at the first one
+template<typename LeafTest>
+static inline bool HitsAnyReference(const LeafTest& test, uint32_t begin, uint32_t end, const Ray& ray, float tMax)
+{
+    for (uint32_t i = begin; i < end; ++i)
+    {
+        float t;
+        if (test(i, ray, &t) && t >= 0.0f && t < tMax)
+            return true;
+    }
+    return false;
+}
+
+static inline bool HitsAnyReference(const BlockLeafTest& test, uint32_t begin, uint32_t end, const Ray& ray, float tMax)
+{
+    SimdFloat origin[3], direction[3];
+    for (int k = 0; k < 3; ++k)
+    {
+        origin[k] = SimdFloat::Broadcast(ray.origin[k]);
+        direction[k] = SimdFloat::Broadcast(ray.direction[k]);
+    }
+    for (uint32_t block = begin / SIMD_WIDTH; block * SIMD_WIDTH < end; ++block)
+    {
+        SimdFloat t;
+        SimdMask found = test.tree.triangleBlocks[block].Intersect(origin, direction, GetBlockLanes(block, begin, end), &t);
+        if ((found & (t >= SimdFloat::Broadcast(0.0f)) & (t < SimdFloat::Broadcast(tMax))).Any())
+            return true;
+    }
+    return false;
+}
+
+template<typename LeafTest>
+static inline bool TestLeaf(const KDTreeView& tree, const LeafTest& test, const KDTreeNode& leaf, const Ray& ray, uint32_t* outTriangle, float* outDist, KDTraversalStats* stats)
+{
+    *outDist = std::numeric_limits<float>::max();
+    bool hit = false;
+    if (stats)
+    {
+        stats->leaves++;
+        stats->triangleTests += leaf.GetTriangleCount();
+    }
+    for (uint32_t i = leaf.GetTriangleOffset(); i < leaf.GetTriangleOffset() + leaf.GetTriangleCount(); ++i)
+    {
+        float t;
+        if (test(i, ray, &t) && t < *outDist)
+        {
+            *outTriangle = tree.triangleIndices[i];
+            *outDist = t;
+            hit = true;
+        }
+    }
+    return hit;
+}
+
+//traverse through nodes in the KDTree, find the closest triangle
+template<typename LeafTest>
+static bool Travese(const Ray& ray, const KDTreeView& tree, const LeafTest& test, const KDTreeNode& node, const AABB& aabb, uint32_t* outTriangle, float* outDist, KDTraversalStats* stats)
+{
+    if (aabb.Intersects(ray))
+    {
+        if (!node.IsLeaf())
+        {
+            if (stats)
+                stats->innerNodes++;
+            //child boxes are not stored, they are the parent box cut at the split plane
+            AABB leftAABB = aabb;
+            AABB rightAABB = aabb;
+            leftAABB.max[node.GetAxis()] = node.GetSplitPosition();
+            rightAABB.min[node.GetAxis()] = node.GetSplitPosition();
+            uint32_t leftTri, rightTri;
+            float distL = std::numeric_limits<float>::infinity();
+            float distR = std::numeric_limits<float>::infinity();
+            bool leftHit = Travese(ray, tree, test, tree.GetBelowChild(node), leftAABB, &leftTri, &distL, stats);
+            bool rightHit = Travese(ray, tree, test, tree.GetAboveChild(node), rightAABB, &rightTri, &distR, stats);
+            if (leftHit && distL <= distR)
+            {
+                *outTriangle = leftTri;
+                *outDist = distL;
+                return true;
+            }
+            if (rightHit)
+            {
+                *outTriangle = rightTri;
+                *outDist = distR;
+                return true;
+            }
+        }
+        else
+        {
+            return TestLeaf(tree, test, node, ray, outTriangle, outDist, stats);
+        }
+    }
+    return false;
+}
+
+//front to back traversal [Havran, Heuristic Ray Shooting Algorithms, 2000]. The ray's parameter range is cut at the
+//split planes instead of testing every child box, the far child waits on the stack, and the walk ends at the first leaf
+//with a hit before the leaf's exit, since no triangle of a later node can be closer.
+//With kAnyHit the range ends at tMax and the walk ends at the first hit in it, outTriangle and outDist are not used
+template<bool kAnyHit, typename LeafTest>
+static bool TraverseFrontToBack(const Ray& ray, float tMax, const KDTreeView& tree, const LeafTest& test, uint32_t* outTriangle, float* outDist, KDTraversalStats* stats)
+{
+    struct StackEntry
+    {
+        uint32_t node;
+        float tmin;
+        float tmax;
+    };
+    float tmin, tmax;
+    if (!tree.aabb.ClipRay(ray, &tmin, &tmax))
+        return false;
+    if (kAnyHit)
+    {
+        tmax = std::min(tmax, tMax);
+        if (tmin > tmax)
+            return false;
+    }
+    //one entry per level at most, and the builder never goes deeper than KDTREE_MAX_DEPTH
+    StackEntry stack[KDTREE_MAX_DEPTH];
+    int stackSize = 0;
+    uint32_t index = 0;
+    bool hit = false;
+    if (!kAnyHit)
+        *outDist = std::numeric_limits<float>::max();
+    while (true)
+    {
+        const KDTreeNode* node = &tree.nodes[index];
+        while (!node->IsLeaf())
+        {
+            if (stats)
+                stats->innerNodes++;
+            Axis axis = node->GetAxis();
+            float split = node->GetSplitPosition();
+            float tPlane = (split - ray.origin[axis]) * ray.inverseDirection[axis];
+            //the child on the origin's side comes first, an origin on the plane goes with the direction
+            bool belowFirst = ray.origin[axis] < split || (ray.origin[axis] == split && ray.direction[axis] <= 0.0f);
+            uint32_t first = belowFirst ? index + 1 : node->GetAboveChild();
+            uint32_t second = belowFirst ? node->GetAboveChild() : index + 1;
+            //the plane is crossed after the range, behind the origin, or never (NaN for a ray in the plane)
+            if (!(tPlane <= tmax) || tPlane <= 0.0f)
+            {
+                index = first;
+            }
+            else if (tPlane < tmin)
+            {
+                index = second;
+            }
+            else
+            {
+                stack[stackSize++] = { second, tPlane, tmax };
+                index = first;
+                tmax = tPlane;
+            }
+            node = &tree.nodes[index];
+        }
+        if (stats)
+        {
+            stats->leaves++;
+            stats->triangleTests += node->GetTriangleCount();
+        }
+        uint32_t begin = node->GetTriangleOffset();
+        uint32_t end = begin + node->GetTriangleCount();
+        if (kAnyHit)
+        {
+            //any hit before tMax is an occluder, wherever it lies
+            if (HitsAnyReference(test, begin, end, ray, tMax))
+                return true;
+        }
+        else if (TestReferences(tree, test, begin, end, ray, outTriangle, outDist))
+        {
+            hit = true;
+        }
+        if ((hit && *outDist <= tmax) || !stackSize)
+            return hit;
+        stackSize--;
+        index = stack[stackSize].node;
+        tmin = stack[stackSize].tmin;
+        tmax = stack[stackSize].tmax;
+    }
+}
+
+//stackless traversal with ropes [Popov et al., Stackless KD-Tree Traversal for High Performance GPU Ray Tracing, 2007].
+//Instead of popping the far child, the ray leaves a leaf through the nearest face it points to and descends from the
+//node on the other side of it to the leaf it enters there. Node choices and exits are the front to back traversal's
+//plane distances, so both visit the same leaves and find the same hits
+template<typename LeafTest>
+static bool TraverseRopes(const Ray& ray, const KDTreeView& tree, const LeafTest& test, uint32_t* outTriangle, float* outDist, KDTraversalStats* stats)
+{
+    float tmin, tmax;
+    if (!tree.aabb.ClipRay(ray, &tmin, &tmax))
+        return false;
+    uint32_t index = 0;
+    bool hit = false;
+    *outDist = std::numeric_limits<float>::max();
+    while (true)
+    {
+        const KDTreeNode* node = &tree.nodes[index];
+        while (!node->IsLeaf())
+        {
+            if (stats)
+                stats->innerNodes++;
+            Axis axis = node->GetAxis();
+            float split = node->GetSplitPosition();
+            float tPlane = (split - ray.origin[axis]) * ray.inverseDirection[axis];
+            bool belowFirst = ray.origin[axis] < split || (ray.origin[axis] == split && ray.direction[axis] <= 0.0f);
+            //past tmin the ray is on the origin's side, unless it crossed the plane in front of the origin before that
+            bool crossed = tPlane > 0.0f && tPlane <= tmin;
+            index = belowFirst != crossed ? index + 1 : node->GetAboveChild();
+            node = &tree.nodes[index];
+        }
+        if (stats)
+        {
+            stats->leaves++;
+            stats->triangleTests += node->GetTriangleCount();
+        }
+        uint32_t begin = node->GetTriangleOffset();
+        if (TestReferences(tree, test, begin, begin + node->GetTriangleCount(), ray, outTriangle, outDist))
+            hit = true;
+        const KDTreeLeafRopes& leaf = tree.leafRopes[tree.leafRopeIndices[index]];
+        float exit = std::numeric_limits<float>::infinity();
+        int exitFace = 0;
+        for (int k = 0; k < 3; ++k)
+        {
+            //a face the ray runs in gives NaN and is skipped
+            bool negative = ray.inverseDirection[k] < 0.0f;
+            float t = ((negative ? leaf.aabb.min[k] : leaf.aabb.max[k]) - ray.origin[k]) * ray.inverseDirection[k];
+            if (t < exit)
+            {
+                exit = t;
+                exitFace = 2 * k + !negative;
+            }
+        }
+        if ((hit && *outDist <= exit) || leaf.ropes[exitFace] == KDTREE_NO_ROPE)
+            return hit;
+        index = leaf.ropes[exitFace];
+        tmin = exit;
+    }
+}
+
+//packet leaf tests give a reference's vertex and edges, which are then tested against all rays of the packet
+struct IndexedPacketTest
+{
+    const KDTreeView& tree;
+    EdgeTriangle operator()(uint32_t reference) const
+    {
+        return EdgeTriangle(tree.mesh->GetTriangle(tree.triangleIndices[reference]));
+    }
+};
+
+struct EdgePacketTest
+{
+    const KDTreeView& tree;
+    const EdgeTriangle& operator()(uint32_t reference) const
+    {
+        return tree.edgeTriangles[reference];
+    }
+};
+
+struct BlockPacketTest
+{
+    const KDTreeView& tree;
+    EdgeTriangle operator()(uint32_t reference) const
+    {
+        return tree.triangleBlocks[reference / SIMD_WIDTH].GetTriangle(reference % SIMD_WIDTH);
+    }
+};
+
+//[Wald, Realtime Ray Tracing and Interactive Global Illumination, 2004] front to back traversal of a packet whose rays
+//point the same way along every axis, so they agree on which child is in front. Every ray keeps its own parameter range,
+//the packet enters a child if any active ray's range reaches it, and a ray leaves the active mask where its range
+//misses a child and for good once it has a hit before the exit of the current leaf.
+//With kAnyHit each ray's range ends at its tMax, a ray is done at its first hit, and only the mask is returned
+template<bool kAnyHit, typename PacketTest>
+static uint32_t TraversePacket(const RayPacket& packet, const float* tMax, const KDTreeView& tree, const PacketTest& test, const bool* negative,
+    uint32_t* outTriangles, float* outDists, KDTraversalStats* stats)
+{
+    struct StackEntry
+    {
+        uint32_t node;
+        SimdMask active;
+        SimdFloat tmin;
+        SimdFloat tmax;
+    };
+    SimdFloat origin[3], direction[3], inverseDirection[3];
+    for (int k = 0; k < 3; ++k)
+    {
+        origin[k] = SimdFloat::Load(packet.origin[k]);
+        direction[k] = SimdFloat::Load(packet.direction[k]);
+        inverseDirection[k] = SimdFloat::Load(packet.inverseDirection[k]);
+    }
+    //AABB::ClipRay for every lane, the direction's sign says which slab plane is entered
+    SimdFloat tmin = SimdFloat::Broadcast(0.0f);
+    SimdFloat tmax = SimdFloat::Broadcast(std::numeric_limits<float>::infinity());
+    for (int k = 0; k < 3; ++k)
+    {
+        SimdFloat t0 = (SimdFloat::Broadcast(tree.aabb.min[k]) - origin[k]) * inverseDirection[k];
+        SimdFloat t1 = (SimdFloat::Broadcast(tree.aabb.max[k]) - origin[k]) * inverseDirection[k];
+        SimdFloat entry = negative[k] ? t1 : t0;
+        SimdFloat exit = negative[k] ? t0 : t1;
+        tmin = Select(entry > tmin, entry, tmin);
+        tmax = Select(exit < tmax, exit, tmax);
+    }
+    //hits have to be closer than this, the closest one so far or tMax
+    SimdFloat closest = SimdFloat::Broadcast(std::numeric_limits<float>::max());
+    if (kAnyHit)
+    {
+        closest = SimdFloat::Load(tMax);
+        tmax = Select(closest < tmax, closest, tmax);
+    }
+    SimdMask active = SimdMask::FromBits(packet.activeMask) & (tmin <= tmax);
+    if (!active.Any())
+        return 0;
+    SimdMask hit = SimdMask::FromBits(0);
+    SimdMask finished = hit;
+    SimdFloat zero = SimdFloat::Broadcast(0.0f);
+    StackEntry stack[KDTREE_MAX_DEPTH];
+    int stackSize = 0;
+    uint32_t index = 0;
+    while (true)
+    {
+        const KDTreeNode* node = &tree.nodes[index];
+        while (!node->IsLeaf())
+        {
+            if (stats)
+                stats->innerNodes++;
+            Axis axis = node->GetAxis();
+            SimdFloat tPlane = (SimdFloat::Broadcast(node->GetSplitPosition()) - origin[axis]) * inverseDirection[axis];
+            uint32_t front = negative[axis] ? node->GetAboveChild() : index + 1;
+            uint32_t back = negative[axis] ? index + 1 : node->GetAboveChild();
+            //a ray in the plane gives NaN and goes into both children
+            SimdMask toFront = AndNot(active, tmin > tPlane);
+            SimdMask toBack = AndNot(active, tPlane > tmax);
+            if (!toBack.Any())
+            {
+                index = front;
+            }
+            else if (!toFront.Any())
+            {
+                index = back;
+            }
+            else
+            {
+                stack[stackSize++] = { back, toBack, Select(tPlane > tmin, tPlane, tmin), tmax };
+                index = front;
+                active = toFront;
+                tmax = Select(tPlane < tmax, tPlane, tmax);
+            }
+            node = &tree.nodes[index];
+        }
+        if (stats)
+        {
+            stats->leaves++;
+            stats->triangleTests += node->GetTriangleCount();
+        }
+        for (uint32_t i = node->GetTriangleOffset(); i < node->GetTriangleOffset() + node->GetTriangleCount(); ++i)
+        {
+            SimdFloat t;
+            SimdMask found = TestTrianglePacket(test(i), origin, direction, active, &t);
+            found = found & (t >= zero) & (t < closest);
+            uint32_t bits = found.GetBits();
+            if (!bits)
+                continue;
+            if (kAnyHit)
+            {
+                hit = hit | found;
+                active = AndNot(active, found);
+                if (!active.Any())
+                    break;
+                continue;
+            }
+            closest = Select(found, t, closest);
+            hit = hit | found;
+            for (; bits; bits &= bits - 1)
+            {
+                outTriangles[__builtin_ctz(bits)] = tree.triangleIndices[i];
+            }
+        }
+        finished = kAnyHit ? hit : finished | (active & hit & (closest <= tmax));
+        //pop until a node that still has unfinished rays
+        do
+        {
+            if (!stackSize)
+            {
+                if (kAnyHit)
+                    return hit.GetBits();
+                alignas(SIMD_WIDTH * 4) float distances[SIMD_WIDTH];
+                closest.Store(distances);
+                uint32_t bits = hit.GetBits();
+                for (uint32_t lanes = bits; lanes; lanes &= lanes - 1)
+                {
+                    outDists[__builtin_ctz(lanes)] = distances[__builtin_ctz(lanes)];
+                }
+                return bits;
+            }
+            stackSize--;
+            active = AndNot(stack[stackSize].active, finished);
+        } while (!active.Any());
+        index = stack[stackSize].node;
+        tmin = stack[stackSize].tmin;
+        tmax = stack[stackSize].tmax;
+    }
+}
+
+//the leaf format is fixed per tree, so pick the test once per ray instead of once per triangle
+template<typename Function>
+static bool WithLeafTest(const KDTreeView& tree, const Function& function)
+{
+    if (tree.waldTriangles)
+        return function(WaldLeafTest{ tree });
+    if (tree.edgeTriangles)
+        return function(EdgeLeafTest{ tree });
+    if (tree.triangleBlocks)
+        return function(BlockLeafTest{ tree });
+    if (tree.quantizedTriangles)
+        return function(QuantizedLeafTest{ tree });
+    return function(IndexedLeafTest{ tree });
+}
+
+bool KDTree::Intersect(const Ray& ray, uint32_t* outTriangle, float* outDist, KDTraversalStats* stats) const
+{
+    return WithLeafTest(m_View, [&](const auto& leafTest) {
+        return WithMailbox(m_View, leafTest, stats, [&](const auto& test) { return TraverseFrontToBack<false>(ray, 0.0f, m_View, test, outTriangle, outDist, stats); }); });
+}
+
+bool KDTree::Intersect(const Ray& ray, KDTreeHit* outHit, KDTraversalStats* stats) const
+{
+    if (!Intersect(ray, &outHit->triangle, &outHit->t, stats))
+        return false;
+    GetBarycentrics(m_View.mesh->GetTriangle(outHit->triangle), ray, &outHit->u, &outHit->v);
+    return true;
+}
+
+bool KDTree::Occluded(const Ray& ray, float tMax, KDTraversalStats* stats) const
+{
+    return WithLeafTest(m_View, [&](const auto& leafTest) {
+        return WithMailbox(m_View, leafTest, stats, [&](const auto& test) { return TraverseFrontToBack<true>(ray, tMax, m_View, test, nullptr, nullptr, stats); }); });
+}
+
+bool KDTree::IntersectRecursive(const Ray& ray, uint32_t* outTriangle, float* outDist, KDTraversalStats* stats) const
+{
+    return WithLeafTest(m_View, [&](const auto& leafTest) {
+        return WithMailbox(m_View, leafTest, stats, [&](const auto& test) { return Travese(ray, m_View, test, m_View.GetRoot(), m_View.aabb, outTriangle, outDist, stats); }); });
+}
+
+bool KDTree::IntersectStackless(const Ray& ray, uint32_t* outTriangle, float* outDist, KDTraversalStats* stats) const
+{
+    if (!m_View.leafRopes)
+        return Intersect(ray, outTriangle, outDist, stats);
+    return WithLeafTest(m_View, [&](const auto& leafTest) {
+        return WithMailbox(m_View, leafTest, stats, [&](const auto& test) { return TraverseRopes(ray, m_View, test, outTriangle, outDist, stats); }); });
+}
+
+//the front child of a node has to be the same for every ray of a packet, an inverse direction of -inf counts as negative.
+//Returns false if the rays point different ways, or the leaf format has no packet test that gives the single ray results
+static bool GetPacketSigns(const KDTreeView& tree, const RayPacket& packet, bool* outNegative)
+{
+    bool coherent = !tree.waldTriangles && !tree.quantizedTriangles;
+    for (int k = 0; k < 3; ++k)
+    {
+        uint32_t negativeLanes = 0;
+        for (int lane = 0; lane < SIMD_WIDTH; ++lane)
+        {
+            negativeLanes |= (uint32_t)(packet.inverseDirection[k][lane] < 0.0f) << lane;
+        }
+        negativeLanes &= packet.activeMask;
+        outNegative[k] = negativeLanes != 0;
+        coherent = coherent && (!negativeLanes || negativeLanes == packet.activeMask);
+    }
+    return coherent;
+}
+
+//the packet test of the tree's leaf format
+template<typename Function>
+static uint32_t WithPacketTest(const KDTreeView& tree, const Function& function)
+{
+    if (tree.edgeTriangles)
+        return function(EdgePacketTest{ tree });
+    if (tree.triangleBlocks)
+        return function(BlockPacketTest{ tree });
+    return function(IndexedPacketTest{ tree });
+}
+
+uint32_t KDTree::IntersectPacket(const RayPacket& packet, uint32_t* outTriangles, float* outDists, KDTraversalStats* stats) const
+{
+    bool negative[3];
+    if (GetPacketSigns(m_View, packet, negative))
+    {
+        return WithPacketTest(m_View, [&](const auto& test) {
+            return TraversePacket<false>(packet, nullptr, m_View, test, negative, outTriangles, outDists, stats); });
+    }
+    uint32_t hits = 0;
+    for (uint32_t lanes = packet.activeMask; lanes; lanes &= lanes - 1)
+    {
+        int lane = __builtin_ctz(lanes);
+        if (Intersect(packet.GetRay(lane), &outTriangles[lane], &outDists[lane], stats))
+            hits |= 1u << lane;
+    }
+    return hits;
+}
+
+size_t KDTree::Occluded(const Ray* rays, const float* tMax, size_t count, bool* outOccluded, KDTraversalStats* stats) const
+{
+    size_t occludedCount = 0;
+    for (size_t first = 0; first < count; first += SIMD_WIDTH)
+    {
+        RayPacket packet;
+        alignas(SIMD_WIDTH * 4) float packetTMax[SIMD_WIDTH] = {};
+        int lanes = (int)std::min<size_t>(SIMD_WIDTH, count - first);
+        for (int lane = 0; lane < lanes; ++lane)
+        {
+            packet.SetRay(lane, rays[first + lane]);
+            packetTMax[lane] = tMax[first + lane];
+        }
+        bool negative[3];
+        uint32_t occluded = 0;
+        if (GetPacketSigns(m_View, packet, negative))
+        {
+            occluded = WithPacketTest(m_View, [&](const auto& test) {
+                return TraversePacket<true>(packet, packetTMax, m_View, test, negative, nullptr, nullptr, stats); });
+        }
+        else
+        {
+            for (int lane = 0; lane < lanes; ++lane)
+            {
+                if (Occluded(rays[first + lane], tMax[first + lane], stats))
+                    occluded |= 1u << lane;
+            }
+        }
+        for (int lane = 0; lane < lanes; ++lane)
+        {
+            outOccluded[first + lane] = (occluded >> lane) & 1;
+            occludedCount += outOccluded[first + lane];
+        }
+    }
+    return occludedCount;
+}
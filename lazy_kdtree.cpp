@@ -0,0 +1,196 @@
+#include "lazy_kdtree.h"
+#include "intersection.h"
+#include "task_scheduler.h"
+#include <chrono>
+#include <limits>
+
+//state of a node that has not been expanded yet, the other states are the split axes and kAxesCount for leaves
+static const uint8_t kUnbuiltNode = kAxesCount + 1;
+
+LazyKDTree::LazyKDTree(const TriangleMesh& mesh, const AABB& aabb, const KDTreeBuildParams& params)
+    : m_Mesh(&mesh), m_PlanarAxes(KDNode::CreatePlanarAxes(mesh)), m_Params(params), m_AABB(aabb),
+    m_NodeCount(0), m_ExpandedNodeCount(0), m_ExpandedTriangleCount(0), m_ExpansionNanoseconds(0)
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    //the root lists are the only part built up front, and big enough to be worth the build threads
+    TaskScheduler scheduler(params.threadCount);
+    std::unique_ptr<StackArena[]> arenas(new StackArena[scheduler.GetThreadCount()]);
+    KDBuildContext context = { m_Mesh, m_PlanarAxes.data(), &m_Params, &scheduler, arenas.get() };
+    StackArena& arena = context.GetArena();
+    ArenaArray<uint32_t> ids = arena.AllocateArray<uint32_t>(mesh.GetTriangleCount());
+    for (size_t i = 0; i < ids.size; ++i)
+    {
+        ids[i] = (uint32_t)i;
+    }
+    ArenaArray<SAHEvent> events[kAxesCount];
+    KDNode::CreateEventList(context, ids, aabb, events);
+    m_Root.reset(CreateNode(ids, events));
+    std::chrono::duration<double> eventListTime = std::chrono::steady_clock::now() - start;
+    m_EventListSeconds = eventListTime.count();
+}
+
+LazyKDTree::~LazyKDTree()
+{
+}
+
+//unbuilt node owning copies of lists that live in an arena
+LazyKDTree::Node* LazyKDTree::CreateNode(const ArenaArray<uint32_t>& ids, const ArenaArray<SAHEvent>* events) const
+{
+    Node* node = new Node();
+    m_NodeCount.fetch_add(1, std::memory_order_relaxed);
+    node->ids.assign(ids.begin(), ids.end());
+    //nothing to split, the eager build makes these empty leaves too
+    if (!ids.size)
+    {
+        node->state.store(kAxesCount, std::memory_order_relaxed);
+        return node;
+    }
+    for (int k = 0; k < kAxesCount; ++k)
+    {
+        node->events[k].assign(events[k].begin(), events[k].end());
+    }
+    node->state.store(kUnbuiltNode, std::memory_order_relaxed);
+    return node;
+}
+
+void LazyKDTree::Expand(Node* node, const AABB& aabb, int depth) const
+{
+    std::lock_guard<std::mutex> lock(node->mutex);
+    //another thread may have expanded the node while this one waited for the lock
+    if (node->state.load(std::memory_order_relaxed) != kUnbuiltNode)
+        return;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    //the trace threads are not scheduler threads, so every thread keeps its own scratch arena and splits single threaded
+    thread_local StackArena arena;
+    StackArena::Marker marker = arena.GetMarker();
+    KDBuildContext context = { m_Mesh, m_PlanarAxes.data(), &m_Params, nullptr, &arena };
+    ArenaArray<uint32_t> ids = { node->ids.data(), node->ids.size() };
+    ArenaArray<SAHEvent> events[kAxesCount];
+    for (int k = 0; k < kAxesCount; ++k)
+    {
+        events[k] = { node->events[k].data(), node->events[k].size() };
+    }
+    uint8_t state = kAxesCount;
+    KDSplit split;
+    if (depth < KDTREE_MAX_DEPTH && KDNode::SplitNode(context, ids, aabb, events, &split))
+    {
+        node->splitPosition = split.position;
+        node->children[0].reset(CreateNode(split.ids[0], split.events[0]));
+        node->children[1].reset(CreateNode(split.ids[1], split.events[1]));
+        state = split.axis;
+        std::vector<uint32_t>().swap(node->ids);
+    }
+    arena.Release(marker);
+    for (int k = 0; k < kAxesCount; ++k)
+    {
+        std::vector<SAHEvent>().swap(node->events[k]);
+    }
+    node->state.store(state, std::memory_order_release);
+    std::chrono::nanoseconds expansionTime = std::chrono::steady_clock::now() - start;
+    m_ExpandedNodeCount.fetch_add(1, std::memory_order_relaxed);
+    m_ExpandedTriangleCount.fetch_add(ids.size, std::memory_order_relaxed);
+    m_ExpansionNanoseconds.fetch_add(expansionTime.count(), std::memory_order_relaxed);
+}
+
+//closest hit at a distance of at least 0 and below *outDist among the leaf's triangles
+static inline bool TestLeaf(const TriangleMesh& mesh, const std::vector<uint32_t>& ids, const Ray& ray, uint32_t* outTriangle, float* outDist)
+{
+    bool hit = false;
+    for (uint32_t id : ids)
+    {
+        float t;
+        if (TestTriangle(mesh.GetTriangle(id), ray, &t) && t >= 0.0f && t < *outDist)
+        {
+            *outTriangle = id;
+            *outDist = t;
+            hit = true;
+        }
+    }
+    return hit;
+}
+
+//front to back walk like KDTree::Intersect, expanding the unbuilt nodes the ray reaches in [0, closest hit]. Nodes behind
+//the origin or behind the hit are never reached, so they stay unbuilt. The boxes and depths are carried along for Expand
+bool LazyKDTree::Traverse(const Ray& ray, uint32_t* outTriangle, float* outDist) const
+{
+    struct StackEntry
+    {
+        Node* node;
+        AABB aabb;
+        int depth;
+        float tmin;
+        float tmax;
+    };
+    float tmin, tmax;
+    if (!m_AABB.ClipRay(ray, &tmin, &tmax))
+        return false;
+    //one entry per level at most, and Expand never splits deeper than KDTREE_MAX_DEPTH
+    StackEntry stack[KDTREE_MAX_DEPTH];
+    int stackSize = 0;
+    Node* node = m_Root.get();
+    AABB aabb = m_AABB;
+    int depth = 0;
+    bool hit = false;
+    *outDist = std::numeric_limits<float>::max();
+    while (true)
+    {
+        while (true)
+        {
+            uint8_t state = node->state.load(std::memory_order_acquire);
+            if (state == kUnbuiltNode)
+            {
+                Expand(node, aabb, depth);
+                state = node->state.load(std::memory_order_acquire);
+            }
+            if (state == kAxesCount)
+                break;
+            Axis axis = (Axis)state;
+            float split = node->splitPosition;
+            float tPlane = (split - ray.origin[axis]) * ray.inverseDirection[axis];
+            //the child on the origin's side comes first, an origin on the plane goes with the direction
+            bool belowFirst = ray.origin[axis] < split || (ray.origin[axis] == split && ray.direction[axis] <= 0.0f);
+            AABB belowAABB = aabb;
+            AABB aboveAABB = aabb;
+            belowAABB.max[axis] = split;
+            aboveAABB.min[axis] = split;
+            Node* first = node->children[belowFirst ? 0 : 1].get();
+            Node* second = node->children[belowFirst ? 1 : 0].get();
+            const AABB& firstAABB = belowFirst ? belowAABB : aboveAABB;
+            const AABB& secondAABB = belowFirst ? aboveAABB : belowAABB;
+            depth++;
+            //the plane is crossed after the range, behind the origin, or never (NaN for a ray in the plane)
+            if (!(tPlane <= tmax) || tPlane <= 0.0f)
+            {
+                node = first;
+                aabb = firstAABB;
+            }
+            else if (tPlane < tmin)
+            {
+                node = second;
+                aabb = secondAABB;
+            }
+            else
+            {
+                stack[stackSize++] = { second, secondAABB, depth, tPlane, tmax };
+                node = first;
+                aabb = firstAABB;
+                tmax = tPlane;
+            }
+        }
+        if (TestLeaf(*m_Mesh, node->ids, ray, outTriangle, outDist))
+            hit = true;
+        if ((hit && *outDist <= tmax) || !stackSize)
+            return hit;
+        stackSize--;
+        node = stack[stackSize].node;
+        aabb = stack[stackSize].aabb;
+        depth = stack[stackSize].depth;
+        tmin = stack[stackSize].tmin;
+        tmax = stack[stackSize].tmax;
+    }
+}
+
+bool LazyKDTree::Intersect(const Ray& ray, uint32_t* outTriangle, float* outDist) const
+{
+    return Traverse(ray, outTriangle, outDist);
+}
@@ -0,0 +1,64 @@
+#pragma once
+#include "kdtree.h"
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+//kd-tree that is built while it is traced. The constructor only prepares the root's sorted event lists, and a node
+//is split the first time a ray reaches it, so parts of the model no ray sees are never built. Unbuilt nodes keep
+//their triangle ids and event lists until then. Intersect may be called from any number of threads at once,
+//a node reached by several threads is split by one of them while the others wait for it.
+//Every expanded node is split exactly as KDTree splits it, so the traced result is the same as with the eager tree.
+//Always uses the exact SAH sweep and kLeafFormatIndices, the binned mode's and the leaf format parameters are ignored.
+class LazyKDTree
+{
+public:
+    //the mesh is referenced by the tree, not copied, and has to outlive it
+    LazyKDTree(const TriangleMesh& mesh, const AABB& aabb, const KDTreeBuildParams& params = KDTreeBuildParams());
+    ~LazyKDTree();
+
+    //finds the closest triangle hit by the ray at a distance of at least 0, see KDTree::Intersect. Splits the unbuilt
+    //nodes the ray reaches before its hit
+    bool Intersect(const Ray& ray, uint32_t* outTriangle, float* outDist) const;
+
+    //nodes created so far, built or not
+    size_t GetNodeCount() const { return m_NodeCount.load(std::memory_order_relaxed); }
+    //nodes that have been split or turned into leaves
+    size_t GetExpandedNodeCount() const { return m_ExpandedNodeCount.load(std::memory_order_relaxed); }
+    //triangles of all expanded nodes, every node sweeps and classifies its own
+    size_t GetExpandedTriangleCount() const { return m_ExpandedTriangleCount.load(std::memory_order_relaxed); }
+    //time spent creating the root event lists, and in expanding nodes summed over all threads
+    double GetEventListSeconds() const { return m_EventListSeconds; }
+    double GetExpansionSeconds() const { return m_ExpansionNanoseconds.load(std::memory_order_relaxed) * 1e-9; }
+
+private:
+    struct Node
+    {
+        //kUnbuiltNode until the node is expanded, then its split axis or kAxesCount for a leaf.
+        //Written with release order after the rest of the node, so a reader that sees it built sees everything else
+        std::atomic<uint8_t> state;
+        float splitPosition;
+        std::unique_ptr<Node> children[2];
+        //global triangle ids, kept by unbuilt nodes and leaves
+        std::vector<uint32_t> ids;
+        //sorted events of an unbuilt node, freed once it is expanded
+        std::vector<SAHEvent> events[kAxesCount];
+        std::mutex mutex;
+    };
+
+    Node* CreateNode(const ArenaArray<uint32_t>& ids, const ArenaArray<SAHEvent>* events) const;
+    void Expand(Node* node, const AABB& aabb, int depth) const;
+    bool Traverse(const Ray& ray, uint32_t* outTriangle, float* outDist) const;
+
+    const TriangleMesh* m_Mesh;
+    std::vector<uint8_t> m_PlanarAxes;
+    KDTreeBuildParams m_Params;
+    AABB m_AABB;
+    std::unique_ptr<Node> m_Root;
+    double m_EventListSeconds;
+    mutable std::atomic<size_t> m_NodeCount;
+    mutable std::atomic<size_t> m_ExpandedNodeCount;
+    mutable std::atomic<size_t> m_ExpandedTriangleCount;
+    mutable std::atomic<uint64_t> m_ExpansionNanoseconds;
+};
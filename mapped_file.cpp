@@ -0,0 +1,45 @@
+#include "mapped_file.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+MappedFile::MappedFile() :
+    m_Data(nullptr),
+    m_Size(0)
+{}
+
+MappedFile::~MappedFile()
+{
+    Close();
+}
+
+bool MappedFile::Open(const char* path)
+{
+    Close();
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size == 0)
+    {
+        close(fd);
+        return false;
+    }
+    void* data = mmap(nullptr, (size_t)info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    //the mapping keeps its own reference to the file
+    close(fd);
+    if (data == MAP_FAILED)
+        return false;
+    m_Data = data;
+    m_Size = (size_t)info.st_size;
+    return true;
+}
+
+void MappedFile::Close()
+{
+    if (m_Data)
+        munmap(m_Data, m_Size);
+    m_Data = nullptr;
+    m_Size = 0;
+}
@@ -0,0 +1,23 @@
+#pragma once
+#include <cstddef>
+
+//read-only memory mapping of a whole file. The pages are shared, so every process mapping
+//the same file uses the same physical memory.
+class MappedFile
+{
+public:
+    MappedFile();
+    ~MappedFile();
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool Open(const char* path);
+    void Close();
+
+    const void* GetData() const { return m_Data; }
+    size_t GetSize() const { return m_Size; }
+
+private:
+    void* m_Data;
+    size_t m_Size;
+};
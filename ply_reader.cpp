@@ -24,34 +24,71 @@ std::unique_ptr<PLY_Model> Read_PLY_Model(const char *filename)
 	char header_field[1024] = "\0";
 	int  vertex_count = 0;
 	int  face_count = 0;
+	// Properties per vertex row, x y z are the first three. normal_property is the column of nx, followed by ny and nz
+	int  vertex_property_count = 0;
+	int  normal_property = -1;
+	bool in_vertex_element = false;
 
 	while (strcmp(header_field, "end_header"))
 	{
 		fscanf(file, "%s", header_field);
 
-		if (!strcmp(header_field, "vertex"))
-			fscanf(file, "%d", &vertex_count);
-
-		if (!strcmp(header_field, "face"))
-			fscanf(file, "%d", &face_count);
+		if (!strcmp(header_field, "element"))
+		{
+			fscanf(file, "%s", header_field);
+			in_vertex_element = !strcmp(header_field, "vertex");
+			if (in_vertex_element)
+				fscanf(file, "%d", &vertex_count);
+			else if (!strcmp(header_field, "face"))
+				fscanf(file, "%d", &face_count);
+		}
+		else if (!strcmp(header_field, "property") && in_vertex_element)
+		{
+			char property_name[1024];
+			fscanf(file, "%s %s", header_field, property_name);
+			if (!strcmp(property_name, "nx"))
+				normal_property = vertex_property_count;
+			vertex_property_count++;
+		}
+		else if (!strcmp(header_field, "comment"))
+		{
+			fscanf(file, "%*[^\n]");
+		}
 	}
 
 	// Construct the target buffers
 	std::unique_ptr<PLY_Model> res = std::make_unique<PLY_Model>();
-	std::vector<float> vertex_data;
-	vertex_data.reserve(vertex_count);
-	res->triangles.reserve(face_count);
+	TriangleMesh& mesh = res->mesh;
+	mesh.vertexX.resize(vertex_count);
+	mesh.vertexY.resize(vertex_count);
+	mesh.vertexZ.resize(vertex_count);
+	mesh.indices.reserve(face_count * 3);
 	res->triangleNormals.reserve(face_count);
 
+	if (normal_property >= 0)
+		res->vertexNormals.resize(vertex_count);
+
 	// Read vertex data
-	for (int i = 0; i < vertex_count * 3; ++i)
+	std::vector<float>* coordinates[3] = { &mesh.vertexX, &mesh.vertexY, &mesh.vertexZ };
+	for (int i = 0; i < vertex_count * vertex_property_count; ++i)
 	{
 		float val = 0;
 		fscanf(file, "%f", &val);
-		vertex_data.push_back(val);
-		res->aabb.min[(Axis)(i % 3)] = std::min(val, res->aabb.min[(Axis)(i % 3)]);
-		res->aabb.max[(Axis)(i % 3)] = std::max(val, res->aabb.max[(Axis)(i % 3)]);
+		int vertex = i / vertex_property_count;
+		int property = i % vertex_property_count;
+		if (property < 3)
+		{
+			(*coordinates[property])[vertex] = val;
+			res->aabb.min[(Axis)property] = std::min(val, res->aabb.min[(Axis)property]);
+			res->aabb.max[(Axis)property] = std::max(val, res->aabb.max[(Axis)property]);
+		}
+		else if (normal_property >= 0 && property >= normal_property && property < normal_property + 3)
+		{
+			res->vertexNormals[vertex][property - normal_property] = val;
+		}
 	}
+	for (Vector3& normal : res->vertexNormals)
+		normal = normal.Normalized();
 
 	// Read face (triangles) data
 	for (int i = 0; i < face_count; ++i)
@@ -62,15 +99,29 @@ std::unique_ptr<PLY_Model> Read_PLY_Model(const char *filename)
 		assert(val == 3);
 		int pa, pb, pc;
 		fscanf(file, "%d %d %d", &pa, &pb, &pc);
-		Triangle t = Triangle(
-				Vector3(vertex_data[pa * 3], vertex_data[pa * 3 + 1], vertex_data[pa * 3 + 2]),
-				Vector3(vertex_data[pb * 3], vertex_data[pb * 3 + 1], vertex_data[pb * 3 + 2]),
-				Vector3(vertex_data[pc * 3], vertex_data[pc * 3 + 1], vertex_data[pc * 3 + 2]));
-		res->triangles.push_back(t);
-		res->triangleNormals.push_back(t.GetNormal());
+		mesh.indices.push_back(pa);
+		mesh.indices.push_back(pb);
+		mesh.indices.push_back(pc);
+		res->triangleNormals.push_back(mesh.GetTriangle(i).GetNormal());
 	}
 
 	fclose(file);
 
 	return res;
 }
+
+void Compute_Vertex_Normals(PLY_Model *model)
+{
+	const TriangleMesh& mesh = model->mesh;
+	model->vertexNormals.assign(mesh.GetVertexCount(), Vector3(0.0f, 0.0f, 0.0f));
+	for (uint32_t i = 0; i < mesh.GetTriangleCount(); ++i)
+	{
+		// The cross product's length is twice the face's area
+		Triangle triangle = mesh.GetTriangle(i);
+		Vector3 weighted = Vector3::Cross(triangle.vertices[1] - triangle.vertices[0], triangle.vertices[2] - triangle.vertices[0]);
+		for (int corner = 0; corner < 3; ++corner)
+			model->vertexNormals[mesh.indices[3 * i + corner]] += weighted;
+	}
+	for (Vector3& normal : model->vertexNormals)
+		normal = normal.Normalized();
+}
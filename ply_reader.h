@@ -8,13 +8,17 @@
 #include <assert.h>
 #include <float.h>
 
-#include "triangle.h"
+#include "triangle_mesh.h"
 #include "aabb.h"
 
 struct PLY_Model
 {
-	std::vector<Triangle> triangles;
+	// Every vertex is stored once and shared by the faces that use it
+	TriangleMesh mesh;
+	// Unit normal of every face, indexed like the mesh's triangles
 	std::vector<Vector3> triangleNormals;
+	// Unit normal of every vertex, from the file's nx ny nz properties, empty if it has none
+	std::vector<Vector3> vertexNormals;
 	AABB aabb;
 };
 
@@ -24,4 +28,7 @@ struct PLY_Model
 
 std::unique_ptr<PLY_Model> Read_PLY_Model(const char *filename);
 
+// Fills vertexNormals with the area weighted average of the normals of the faces around each vertex
+void Compute_Vertex_Normals(PLY_Model *model);
+
 #endif
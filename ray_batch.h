@@ -0,0 +1,47 @@
+#pragma once
+#include "ray.h"
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+//rays as structure of arrays, for tracing many unrelated rays at once with KDTree::Intersect
+struct RayBatch
+{
+    std::vector<float> originX;
+    std::vector<float> originY;
+    std::vector<float> originZ;
+    std::vector<float> directionX;
+    std::vector<float> directionY;
+    std::vector<float> directionZ;
+
+    void Add(const Ray& ray)
+    {
+        originX.push_back(ray.origin.x);
+        originY.push_back(ray.origin.y);
+        originZ.push_back(ray.origin.z);
+        directionX.push_back(ray.direction.x);
+        directionY.push_back(ray.direction.y);
+        directionZ.push_back(ray.direction.z);
+    }
+
+    size_t GetCount() const { return originX.size(); }
+
+    Ray GetRay(size_t i) const
+    {
+        return Ray(Vector3(originX[i], originY[i], originZ[i]), Vector3(directionX[i], directionY[i], directionZ[i]));
+    }
+};
+
+#define HIT_BATCH_MISS 0xFFFFFFFFu
+
+//results of a RayBatch, entry i belongs to ray i
+struct HitBatch
+{
+    //the closest triangle, HIT_BATCH_MISS if the ray hits nothing
+    std::vector<uint32_t> triangles;
+    //in units of the ray's direction, infinity if the ray hits nothing
+    std::vector<float> distances;
+    //barycentric coordinates of the hit point, see GetBarycentrics, 0 if the ray hits nothing
+    std::vector<float> u;
+    std::vector<float> v;
+};
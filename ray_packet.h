@@ -0,0 +1,55 @@
+#pragma once
+#include "simd.h"
+#include "ray.h"
+#include "intersection.h"
+
+//pixels of the tile traced as one packet, SIMD_WIDTH of them
+#if SIMD_WIDTH == 16
+#define RAY_PACKET_WIDTH 4
+#define RAY_PACKET_HEIGHT 4
+#elif SIMD_WIDTH == 8
+#define RAY_PACKET_WIDTH 4
+#define RAY_PACKET_HEIGHT 2
+#else
+#define RAY_PACKET_WIDTH 2
+#define RAY_PACKET_HEIGHT 2
+#endif
+
+//up to SIMD_WIDTH rays as structure of arrays, one lane per ray
+struct RayPacket
+{
+    alignas(SIMD_WIDTH * 4) float origin[3][SIMD_WIDTH] = {};
+    alignas(SIMD_WIDTH * 4) float direction[3][SIMD_WIDTH] = {};
+    alignas(SIMD_WIDTH * 4) float inverseDirection[3][SIMD_WIDTH] = {};
+    //bit i is set if lane i holds a ray, the other lanes are ignored
+    uint32_t activeMask = 0;
+
+    void SetRay(int lane, const Ray& ray)
+    {
+        for (int k = 0; k < 3; ++k)
+        {
+            origin[k][lane] = ray.origin[k];
+            direction[k][lane] = ray.direction[k];
+            inverseDirection[k][lane] = ray.inverseDirection[k];
+        }
+        activeMask |= 1u << lane;
+    }
+
+    Ray GetRay(int lane) const
+    {
+        return Ray(Vector3(origin[0][lane], origin[1][lane], origin[2][lane]), Vector3(direction[0][lane], direction[1][lane], direction[2][lane]));
+    }
+};
+
+//TestTriangleSimd of one triangle against the rays of a packet
+inline SimdMask TestTrianglePacket(const EdgeTriangle& triangle, const SimdFloat* origin, const SimdFloat* direction, const SimdMask& mask, SimdFloat* outT)
+{
+    SimdFloat vertex[3], edge1[3], edge2[3];
+    for (int k = 0; k < 3; ++k)
+    {
+        vertex[k] = SimdFloat::Broadcast(triangle.vertex[k]);
+        edge1[k] = SimdFloat::Broadcast(triangle.edge1[k]);
+        edge2[k] = SimdFloat::Broadcast(triangle.edge2[k]);
+    }
+    return TestTriangleSimd(vertex, edge1, edge2, origin, direction, mask, outT);
+}
@@ -1,89 +1,27 @@
 #include "raytracer.h"
 #include "triangle.h"
 #include "ray.h"
+#include "intersection.h"
 #include <chrono>
-#include <pthread.h>
-
-//[Möller-Trumbore] http://www.graphics.cornell.edu/pubs/1997/MT97.pdf
-static inline bool TestTriangle(const Triangle& triangle, const Ray& ray, float* outT)
-{
-    Vector3 edge1 = triangle.vertices[1] - triangle.vertices[0];
-    Vector3 edge2 = triangle.vertices[2] - triangle.vertices[0];
-    Vector3 pvec = Vector3::Cross(ray.direction, edge2);
-    float det = Vector3::Dot(edge1, pvec);
-    float inv_det = 1.0f / det;
-    Vector3 tvec = ray.origin - triangle.vertices[0];
-    float u = Vector3::Dot(tvec, pvec) * inv_det;
-    if (u < 0.0f || u > 1.0f)
-        return false;
-    Vector3 qvec = Vector3::Cross(tvec, edge1);
-    float v = Vector3::Dot(ray.direction, qvec) * inv_det;
-    if (v < 0.0f || u + v >= 1.0f)
-        return false;
-    *outT = Vector3::Dot(edge2, qvec) * inv_det;
-    return true;
-}
-
-static inline const Triangle* TestTriangles(const std::vector<Triangle>& triangles, const Ray& ray, float* outDist)
+#include <cstdio>
+#include <limits>
+#include "task_scheduler.h"
+
+static inline bool TestTriangles(const TriangleMesh& mesh, const Ray& ray, uint32_t* outTriangle, float* outDist)
 {
     *outDist = std::numeric_limits<float>::max();
-    const Triangle* result = nullptr;
-    for (int i = 0; i < triangles.size(); ++i)
+    bool hit = false;
+    for (uint32_t i = 0; i < mesh.GetTriangleCount(); ++i)
     {
         float t;
-        if (TestTriangle(triangles[i], ray, &t) && t < *outDist)
+        if (TestTriangle(mesh.GetTriangle(i), ray, &t) && t < *outDist)
         {
-            result = &triangles[i];
+            *outTriangle = i;
             *outDist = t;
+            hit = true;
         }
     }
-    return result;
-}
-
-//traverse through nodes in the KDTree, return the closest triangle
-static const Triangle* Travese(Ray& ray, const KDNode* node, float* outDist = nullptr)
-{
-    if (node->GetAABB().Intersects(ray))
-    {
-        const KDNode* left = node->GetLeft();
-        const KDNode* right = node->GetRight();
-        if (left || right)
-        {
-            float distL = std::numeric_limits<float>::infinity();
-            float distR = std::numeric_limits<float>::infinity();
-            const Triangle* leftTri = nullptr;
-            const Triangle* rightTri = nullptr;
-            if (left)
-            {
-                leftTri = Travese(ray, left, &distL);
-            }
-            if (right)
-            {
-                rightTri = Travese(ray, right, &distR);
-            }
-            if (leftTri && distL <= distR)
-            {
-                if (outDist)
-                {
-                    *outDist = distL;
-                }
-                return leftTri;
-            }
-            if (rightTri)
-            {
-                if (outDist)
-                {
-                    *outDist = distR;
-                }
-                return rightTri;
-            }
-        }
-        else
-        {
-            return TestTriangles(node->GetTriangles(), ray, outDist);
-        }
-    }
-    return nullptr;
+    return hit;
 }
 
 static inline Vector3 IndexOfRefraction(const Vector3& rayDir, const Vector3& normal)
@@ -114,40 +52,53 @@ static inline Color SampleBackground(const Vector3& rayDir)
     return { uint8_t(f * 255), uint8_t(f * 255), uint8_t(f * 255) };
 }
 
-static inline Color GetPixelInternal(const std::vector<Triangle>& triangles, Vector3 cameraPosition, Vector3 rayDir, int depth, const KDTree* kdTree = nullptr)
+//reflection and refraction of the background at a hit with normal n
+static inline Color ShadeHit(const Ray& ray, const Vector3& n)
 {
-    Ray ray = Ray(cameraPosition, rayDir.Normalized());
-    const Triangle* triangle = nullptr;
+    Vector3 rayDir = IndexOfRefraction(ray.direction, n);
+
+    Color bg = SampleBackground(rayDir);
+
+    float cosX = -Vector3::Dot(ray.direction, n);
+    float fresnel = pow(1 - cosX, 3);
+
+    Vector3 refldir = ray.direction - n * 2.0f * Vector3::Dot(ray.direction, n);
+    refldir = refldir.Normalized();
+    Color reflection;
+    Color refraction;
+    reflection = SampleBackground(refldir);
+    refraction = SampleBackground(rayDir);
+    return (reflection * fresnel + refraction * (1.0f - fresnel) * 0.6f) * Color(255, 150, 150);
+}
+
+//normal at a hit of the model: the face normal read at load time, or with smooth shading the vertex normals
+//interpolated at the hit point
+static inline Vector3 GetHitNormal(const PLY_Model& model, bool smooth, const Ray& ray, uint32_t triangle)
+{
+    if (!smooth)
+        return model.triangleNormals[triangle];
+    KDTreeHit hit = { triangle, 0.0f, 0.0f, 0.0f };
+    GetBarycentrics(model.mesh.GetTriangle(triangle), ray, &hit.u, &hit.v);
+    return GetSmoothNormal(model, hit);
+}
+
+static inline Color GetPixelInternal(const PLY_Model& model, bool smooth, const Ray& ray, const KDTree* kdTree = nullptr)
+{
+    uint32_t triangle;
     float outDist;
+    bool hit;
     if (kdTree != nullptr)
     {
-        triangle = Travese(ray, kdTree->GetRoot(), &outDist);
+        //a tree built with ropes was asked for the stackless traversal
+        hit = kdTree->HasRopes() ? kdTree->IntersectStackless(ray, &triangle, &outDist) : kdTree->Intersect(ray, &triangle, &outDist);
     }
     else
     {
-        triangle = TestTriangles(triangles, ray, &outDist);
+        hit = TestTriangles(model.mesh, ray, &triangle, &outDist);
     }
-    if (triangle)
+    if (hit)
     {
-        Vector3 n = triangle->GetNormal();
-
-        Vector3 rayDir = IndexOfRefraction(ray.direction, n);
-
-        Color bg = SampleBackground(rayDir);
-
-        Vector3 phit = ray.origin + ray.direction * outDist;
-
-        float cosX = -Vector3::Dot(ray.direction, n);
-        float fresnel = pow(1 - cosX, 3);
-
-        float bias = 1e-4;
-        Vector3 refldir = ray.direction - n * 2.0f * Vector3::Dot(ray.direction, n);
-        refldir = refldir.Normalized();
-        Color reflection;
-        Color refraction;
-        reflection = SampleBackground(refldir);
-        refraction = SampleBackground(rayDir);
-        return (reflection * fresnel + refraction * (1.0f - fresnel) * 0.6f) * Color(255, 150, 150);
+        return ShadeHit(ray, GetHitNormal(model, smooth, ray, triangle));
     }
     else
     {
@@ -155,7 +106,24 @@ static inline Color GetPixelInternal(const std::vector<Triangle>& triangles, Vec
     }
 }
 
-Color Raytracer::GetPixel(uint16_t x, uint16_t y) const
+static inline Color GetPixelInternal(const PLY_Model& model, bool smooth, const LazyKDTree& tree, const Ray& ray)
+{
+    uint32_t triangle;
+    float outDist;
+    if (tree.Intersect(ray, &triangle, &outDist))
+        return ShadeHit(ray, GetHitNormal(model, smooth, ray, triangle));
+    return SampleBackground(ray.direction);
+}
+
+static inline Color GetPixelInternal(const Scene& scene, const Ray& ray)
+{
+    SceneHit hit;
+    if (scene.Intersect(ray, &hit))
+        return ShadeHit(ray, hit.normal);
+    return SampleBackground(ray.direction);
+}
+
+Ray Raytracer::GetCameraRay(uint16_t x, uint16_t y) const
 {
     float inverseWidth = 1.0f / (float)m_ResolutionX;
     float inverseHeight = 1.0f / (float)m_ResolutionY;
@@ -163,61 +131,196 @@ Color Raytracer::GetPixel(uint16_t x, uint16_t y) const
     float fovTan = tan(m_FOV * 0.5f);
     Vector3 L = m_Left * ((2 * (x * inverseWidth) - 1) * fovTan * aspectRatio);
     Vector3 D = m_Down * ((2 * (y * inverseHeight) - 1) * fovTan);
-    return GetPixelInternal(m_Model->triangles, m_CameraPosition, L + D + m_Forward, 0, m_UseKDTree ? m_KDTree.get() : nullptr);
+    return Ray(m_CameraPosition, (L + D + m_Forward).Normalized());
 }
 
-struct TraceThreadArgs
+Frustum Raytracer::GetFrustum(float nearDist, float farDist) const
 {
-    int index;
-    uint16_t width;
-    uint16_t height;
-    const Raytracer* raytracer;
-};
+    float fovTan = tan(m_FOV * 0.5f);
+    float horizontalTan = fovTan * m_ResolutionX / (float)m_ResolutionY;
+    //the sides go through the image's edges, the rays of GetCameraRay stay inside them
+    Frustum frustum;
+    frustum.SetPlane(0, m_Forward * horizontalTan - m_Left, m_CameraPosition);
+    frustum.SetPlane(1, m_Forward * horizontalTan + m_Left, m_CameraPosition);
+    frustum.SetPlane(2, m_Forward * fovTan - m_Down, m_CameraPosition);
+    frustum.SetPlane(3, m_Forward * fovTan + m_Down, m_CameraPosition);
+    frustum.SetPlane(4, m_Forward, m_CameraPosition + m_Forward * nearDist);
+    frustum.SetPlane(5, -m_Forward, m_CameraPosition + m_Forward * farDist);
+    return frustum;
+}
 
-#define NUM_THREADS 16
+Color Raytracer::GetPixel(uint16_t x, uint16_t y) const
+{
+    Ray ray = GetCameraRay(x, y);
+    if (m_Scene)
+        return GetPixelInternal(*m_Scene, ray);
+    bool smooth = m_SmoothShading && !m_Model->vertexNormals.empty();
+    if (m_UseKDTree && m_LazyKDTree)
+        return GetPixelInternal(*m_Model, smooth, *m_LazyKDTree, ray);
+    return GetPixelInternal(*m_Model, smooth, ray, m_UseKDTree ? m_KDTree.get() : nullptr);
+}
 
-static std::vector<Color> pixelArrays[NUM_THREADS];
-static void* TraceThread(void* _args)
+void Raytracer::GetTile(uint16_t x, uint16_t y, uint16_t width, uint16_t height, Color* pixels, size_t rowPitch) const
 {
-    TraceThreadArgs args = *(TraceThreadArgs*)_args;
-    #define THREAD_STRIDE (args.height / NUM_THREADS)
-    int yOff = args.index * THREAD_STRIDE;
-    std::vector<Color> pixels;
-    pixels.reserve(args.width * THREAD_STRIDE);
-    for (uint16_t y = yOff; y < yOff + THREAD_STRIDE; ++y)
+    if (!m_UsePackets || m_Scene || !m_UseKDTree || m_LazyKDTree || !m_KDTree)
+    {
+        for (uint16_t j = 0; j < height; ++j)
+        {
+            for (uint16_t i = 0; i < width; ++i)
+            {
+                pixels[j * rowPitch + i] = GetPixel(x + i, y + j);
+            }
+        }
+        return;
+    }
+    RayPacket packet;
+    Ray rays[SIMD_WIDTH];
+    for (uint16_t j = 0; j < height; ++j)
     {
-        for (uint16_t x = 0; x < args.width; ++x)
+        for (uint16_t i = 0; i < width; ++i)
         {
-            pixels.push_back(args.raytracer->GetPixel(x, y));
+            int lane = j * RAY_PACKET_WIDTH + i;
+            rays[lane] = GetCameraRay(x + i, y + j);
+            packet.SetRay(lane, rays[lane]);
+        }
+    }
+    uint32_t triangles[SIMD_WIDTH];
+    float distances[SIMD_WIDTH];
+    uint32_t hits = m_KDTree->IntersectPacket(packet, triangles, distances);
+    bool smooth = m_SmoothShading && !m_Model->vertexNormals.empty();
+    for (uint16_t j = 0; j < height; ++j)
+    {
+        for (uint16_t i = 0; i < width; ++i)
+        {
+            int lane = j * RAY_PACKET_WIDTH + i;
+            if (hits & (1u << lane))
+                pixels[j * rowPitch + i] = ShadeHit(rays[lane], GetHitNormal(*m_Model, smooth, rays[lane], triangles[lane]));
+            else
+                pixels[j * rowPitch + i] = SampleBackground(rays[lane].direction);
         }
     }
-    pixelArrays[args.index] = pixels;
-    return nullptr;
 }
 
-std::vector<Color> Raytracer::Trace() const
+#define CALIBRATION_SAMPLES 1024
+#define CALIBRATION_ROUNDS 5
+#define CALIBRATION_PASSES 64
+
+//keeps the benchmark loops from being optimized away
+static volatile uint32_t s_CalibrationSink;
+
+//fastest of a few rounds, in seconds per call of function(i)
+template<typename Function>
+static double TimeKernel(const Function& function)
 {
-    pthread_t threads[NUM_THREADS];
-    TraceThreadArgs args[NUM_THREADS];
-    for (int i = 0; i < NUM_THREADS; i++)
+    double best = std::numeric_limits<double>::max();
+    for (int round = 0; round < CALIBRATION_ROUNDS; ++round)
     {
-        args[i].width = m_ResolutionX;
-        args[i].height = m_ResolutionY;
-        args[i].index = i;
-        args[i].raytracer = this;
-        
-        pthread_create(&threads[i], nullptr, TraceThread, &args[i]);
+        uint32_t hits = 0;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for (int pass = 0; pass < CALIBRATION_PASSES; ++pass)
+        {
+            for (int i = 0; i < CALIBRATION_SAMPLES; ++i)
+            {
+                hits += function(i);
+            }
+        }
+        std::chrono::duration<double> time = std::chrono::steady_clock::now() - start;
+        best = std::min(best, time.count());
+        s_CalibrationSink = hits;
     }
-    for (int i = 0; i < NUM_THREADS; i++)
+    return best / (CALIBRATION_PASSES * CALIBRATION_SAMPLES);
+}
+
+SAHCostModel Raytracer::CalibrateCostModel()
+{
+    //random rays, boxes and triangles around the unit cube, with a fixed seed so every run measures the same work
+    uint32_t seed = 1;
+    auto random = [&seed]()
+    {
+        seed = seed * 1664525u + 1013904223u;
+        return (seed >> 8) * (1.0f / 16777216.0f);
+    };
+    auto randomPoint = [&random]() { return Vector3(random(), random(), random()); };
+    std::vector<Ray> rays;
+    std::vector<AABB> boxes;
+    std::vector<float> splits;
+    //the triangles are gathered from a shared vertex buffer like the model's
+    std::vector<Triangle> triangles;
+    for (int i = 0; i < CALIBRATION_SAMPLES; ++i)
     {
-        pthread_join(threads[i], NULL);
+        Vector3 origin = randomPoint() * 4.0f - Vector3(1.5f, 1.5f, 1.5f);
+        Vector3 target = randomPoint();
+        rays.push_back(Ray(origin, (target - origin).Normalized()));
+        Vector3 a = randomPoint();
+        Vector3 b = randomPoint();
+        AABB box;
+        box.min = Vector3(std::min(a.x, b.x), std::min(a.y, b.y), std::min(a.z, b.z));
+        box.max = Vector3(std::max(a.x, b.x), std::max(a.y, b.y), std::max(a.z, b.z));
+        boxes.push_back(box);
+        splits.push_back(random());
+        Vector3 v = randomPoint();
+        triangles.push_back(Triangle(v, v + randomPoint() * 0.5f, v + randomPoint() * 0.5f));
     }
-    std::vector<Color> pixels;
-    pixels.reserve(m_ResolutionX * m_ResolutionY);
+    //one step of the kd-tree traversal: derive the child box from the parent and the split plane and test the ray against it
+    double descent = TimeKernel([&](int i)
+    {
+        const AABB& parent = boxes[i];
+        AABB child = parent;
+        Axis axis = (Axis)(i % kAxesCount);
+        child.max[axis] = parent.min[axis] + (parent.max[axis] - parent.min[axis]) * splits[i];
+        return (uint32_t)child.Intersects(rays[(i * 7) % CALIBRATION_SAMPLES]);
+    });
+    TriangleMesh mesh = TriangleMesh::FromTriangles(triangles);
+    double intersection = TimeKernel([&](int i)
+    {
+        float t;
+        return (uint32_t)TestTriangle(mesh.GetTriangle(i), rays[(i * 7) % CALIBRATION_SAMPLES], &t);
+    });
+    SAHCostModel costModel;
+    costModel.traversal = 1.0f;
+    costModel.intersection = (float)(intersection / descent);
+    return costModel;
+}
 
-    for (int i = 0; i < NUM_THREADS; i++)
+std::vector<Color> Raytracer::Trace(TraceStats* stats) const
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::vector<Color> pixels(m_ResolutionX * m_ResolutionY);
+    TaskScheduler scheduler(m_ThreadCount);
+    std::vector<TraceThreadStats> threads(scheduler.GetThreadCount());
+    TaskGroup group;
+    for (int tileY = 0; tileY < m_ResolutionY; tileY += TRACE_TILE_SIZE)
+    {
+        for (int tileX = 0; tileX < m_ResolutionX; tileX += TRACE_TILE_SIZE)
+        {
+            scheduler.Run(group, [&, tileX, tileY]()
+            {
+                std::chrono::steady_clock::time_point tileStart = std::chrono::steady_clock::now();
+                int tileEndX = std::min(tileX + TRACE_TILE_SIZE, (int)m_ResolutionX);
+                int tileEndY = std::min(tileY + TRACE_TILE_SIZE, (int)m_ResolutionY);
+                //tiles of neighbouring pixels, whose rays can be traced as a packet
+                for (int y = tileY; y < tileEndY; y += RAY_PACKET_HEIGHT)
+                {
+                    for (int x = tileX; x < tileEndX; x += RAY_PACKET_WIDTH)
+                    {
+                        GetTile(x, y, std::min(RAY_PACKET_WIDTH, tileEndX - x), std::min(RAY_PACKET_HEIGHT, tileEndY - y),
+                            &pixels[y * m_ResolutionX + x], m_ResolutionX);
+                    }
+                }
+                //every thread only writes its own entry
+                TraceThreadStats& thread = threads[scheduler.GetCurrentThreadIndex()];
+                std::chrono::duration<double> tileTime = std::chrono::steady_clock::now() - tileStart;
+                thread.busySeconds += tileTime.count();
+                thread.tileCount++;
+            });
+        }
+    }
+    scheduler.Wait(group);
+    if (stats)
     {
-        pixels.insert(pixels.end(), pixelArrays[i].begin(), pixelArrays[i].end());
+        std::chrono::duration<double> traceTime = std::chrono::steady_clock::now() - start;
+        stats->seconds = traceTime.count();
+        stats->threads = threads;
     }
     return pixels;
 }
@@ -242,6 +345,37 @@ void Raytracer::Setup()
     AABB aabb;
     aabb.min = Vector3(-10, -10, -10);
     aabb.max = Vector3(10, 10, 10);
+    if (m_LazyBuild)
+    {
+        m_KDTree.reset();
+        m_LazyKDTree = std::make_unique<LazyKDTree>(m_Model->mesh, aabb, m_BuildParams);
+        printf("Lazy kd-Tree root prepared in %f seconds, nodes are built while tracing.\n", m_LazyKDTree->GetEventListSeconds());
+        return;
+    }
+    m_LazyKDTree.reset();
+    if (!m_CachePath.empty())
+    {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        m_KDTree = KDTree::LoadCache(m_CachePath.c_str(), m_Model->mesh, aabb, m_BuildParams);
+        if (m_KDTree)
+        {
+            std::chrono::duration<double> loadTime = std::chrono::steady_clock::now() - start;
+            printf("kd-Tree mapped from %s in %f seconds.\n", m_CachePath.c_str(), loadTime.count());
+            return;
+        }
+    }
     printf("Creating kd-Tree...\n");
-    m_KDTree = std::make_unique<KDTree>(m_Model->triangles, aabb);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    m_KDTree = std::make_unique<KDTree>(m_Model->mesh, aabb, m_BuildParams);
+    std::chrono::duration<double> buildTime = std::chrono::steady_clock::now() - start;
+    unsigned int threadCount = m_BuildParams.threadCount ? m_BuildParams.threadCount : TaskScheduler::GetHardwareThreadCount();
+    printf("kd-Tree built in %f seconds using %u threads (%s), %.1f MB scratch memory.\n", buildTime.count(), threadCount,
+        m_BuildParams.mode == kBuildModeBinned ? "binned SAH" : "exact SAH", m_KDTree->GetBuildScratchBytes() / (1024.0 * 1024.0));
+    printf("  event lists %f seconds, nodes %f seconds.\n", m_KDTree->GetEventListSeconds(), m_KDTree->GetNodeBuildSeconds());
+    printf("  %zu nodes, %zu triangle references (%.2f per triangle%s).\n", m_KDTree->GetNodeCount(), m_KDTree->GetTriangleIndexCount(),
+        (double)m_KDTree->GetTriangleIndexCount() / m_Model->mesh.GetTriangleCount(), m_BuildParams.perfectSplits ? ", perfect splits" : "");
+    if (m_KDTree->GetLeafTriangleBytes())
+        printf("  %.1f MB precomputed leaf triangles.\n", m_KDTree->GetLeafTriangleBytes() / (1024.0 * 1024.0));
+    if (!m_CachePath.empty() && !m_KDTree->SaveCache(m_CachePath.c_str(), m_Model->mesh, m_BuildParams))
+        printf("Could not write kd-Tree cache %s.\n", m_CachePath.c_str());
 }
@@ -1,7 +1,13 @@
 #pragma once
 #include <math.h>
+#include <string>
 #include "ply_reader.h"
 #include "kdtree.h"
+#include "lazy_kdtree.h"
+#include "scene.h"
+
+//side of the square pixel tiles Trace hands out, a multiple of RAY_PACKET_WIDTH and RAY_PACKET_HEIGHT
+#define TRACE_TILE_SIZE 16
 
 struct Color
 {
@@ -38,6 +44,29 @@ struct Color
     }
 };
 
+//normal of the model's surface at the hit, the vertex normals weighted by the barycentric coordinates. The model needs vertexNormals
+inline Vector3 GetSmoothNormal(const PLY_Model& model, const KDTreeHit& hit)
+{
+    const uint32_t* corners = &model.mesh.indices[3 * hit.triangle];
+    Vector3 normal = model.vertexNormals[corners[0]] * (1.0f - hit.u - hit.v) + model.vertexNormals[corners[1]] * hit.u +
+        model.vertexNormals[corners[2]] * hit.v;
+    return normal.Normalized();
+}
+
+//time a thread of Raytracer::Trace spent rendering tiles, and how many it rendered
+struct TraceThreadStats
+{
+    double busySeconds = 0.0;
+    size_t tileCount = 0;
+};
+
+//load balance of one Raytracer::Trace call, threads[i] is thread i of its pool, the calling thread last
+struct TraceStats
+{
+    double seconds = 0.0;
+    std::vector<TraceThreadStats> threads;
+};
+
 class Raytracer
 {
 public:
@@ -54,7 +83,17 @@ public:
         m_ResolutionY = resolutionY;
         m_FOV = fov;
         m_CameraPosition = cameraPosition;
-        m_Forward = forward.Normalized();
+        SetForward(forward);
+        m_UseKDTree = true;
+        m_BuildParams = KDTreeBuildParams();
+        m_Scene = nullptr;
+        m_LazyBuild = false;
+        m_UsePackets = true;
+        m_SmoothShading = false;
+        m_ThreadCount = 0;
+        m_Skybox = nullptr;
+        m_SkyboxWidth = 0;
+        m_SkyboxHeight = 0;
     }
 
     void SetModel(PLY_Model* model)
@@ -90,6 +129,59 @@ public:
         m_UseKDTree = useKDTree;
     }
 
+    void SetBuildParams(const KDTreeBuildParams& params)
+    {
+        m_BuildParams = params;
+    }
+
+    //Trace sends the primary rays of each tile through the kd-tree as one packet, see KDTree::IntersectPacket.
+    //Only the eager kd-tree has a packet traversal, the other modes always trace single rays
+    void SetUsePackets(bool usePackets)
+    {
+        m_UsePackets = usePackets;
+    }
+
+    //interpolate the model's vertex normals at the hits instead of using the face normals. A model without
+    //vertexNormals is shaded flat, see Compute_Vertex_Normals
+    void SetSmoothShading(bool smoothShading)
+    {
+        m_SmoothShading = smoothShading;
+    }
+
+    //threads that trace a frame, the calling thread included, 0 means one per hardware thread
+    void SetThreadCount(unsigned int threadCount)
+    {
+        m_ThreadCount = threadCount;
+    }
+
+    //Setup only prepares a LazyKDTree, which is built while the first frames are traced. The cache path is not used then
+    void SetLazyBuild(bool lazyBuild)
+    {
+        m_LazyBuild = lazyBuild;
+    }
+
+    //Setup maps the kd-tree from this file if it matches the model and build parameters, otherwise builds and writes it
+    void SetCachePath(const char* path)
+    {
+        m_CachePath = path ? path : "";
+    }
+
+    //trace an instanced scene instead of the model, Setup is not needed then. The scene has to be committed
+    void SetScene(const Scene* scene)
+    {
+        m_Scene = scene;
+    }
+
+    const KDTree* GetKDTree() const
+    {
+        return m_KDTree.get();
+    }
+
+    const LazyKDTree* GetLazyKDTree() const
+    {
+        return m_LazyKDTree.get();
+    }
+
     void SetSkybox(uint8_t* data, uint16_t width, uint16_t height)
     {
         m_Skybox = data;
@@ -97,11 +189,27 @@ public:
         m_SkyboxHeight = height;
     }
 
+    //microbenchmarks node descent and the ray triangle test on this machine. Traversal is kept at 1 and intersection
+    //becomes the measured ratio of the two, the λ bias is not a timing and keeps its default
+    static SAHCostModel CalibrateCostModel();
+
     void Setup();
 
+    //normalized primary ray through the pixel
+    Ray GetCameraRay(uint16_t x, uint16_t y) const;
+
+    //the volume the camera's primary rays pass between nearDist and farDist along the forward axis, for KDTree::FindTriangles
+    Frustum GetFrustum(float nearDist, float farDist) const;
+
     Color GetPixel(uint16_t x, uint16_t y) const;
 
-    std::vector<Color> Trace() const;
+    //pixels of the tile at x, y that is width by height pixels, at most RAY_PACKET_WIDTH by RAY_PACKET_HEIGHT.
+    //Pixel (i, j) of the tile goes to pixels[j * rowPitch + i]
+    void GetTile(uint16_t x, uint16_t y, uint16_t width, uint16_t height, Color* pixels, size_t rowPitch) const;
+
+    //renders the frame in tiles of TRACE_TILE_SIZE pixels, which the threads of a pool started for the call take from
+    //work-stealing queues and write straight into the returned image. stats gets the busy time of each thread
+    std::vector<Color> Trace(TraceStats* stats = nullptr) const;
 
 private:
     PLY_Model* m_Model;
@@ -113,7 +221,15 @@ private:
     Vector3 m_Left;
     Vector3 m_Down;
     std::unique_ptr<KDTree> m_KDTree;
+    std::unique_ptr<LazyKDTree> m_LazyKDTree;
+    KDTreeBuildParams m_BuildParams;
+    std::string m_CachePath;
+    const Scene* m_Scene;
     bool m_UseKDTree;
+    bool m_LazyBuild;
+    bool m_UsePackets;
+    bool m_SmoothShading;
+    unsigned int m_ThreadCount;
     uint8_t* m_Skybox;
     uint16_t m_SkyboxWidth;
     uint16_t m_SkyboxHeight;
@@ -0,0 +1,46 @@
+#include "kdtree.h"
+#include <cstdio>
+#include <cstring>
+
+bool LoadSAHProfile(const char* path, SAHCostModel* costModel)
+{
+    FILE* file = fopen(path, "r");
+    if (!file)
+        return false;
+    SAHCostModel model = *costModel;
+    char line[256];
+    bool ok = true;
+    while (ok && fgets(line, sizeof(line), file))
+    {
+        char name[64];
+        float value;
+        //skip comments and empty lines
+        if (line[0] == '#' || sscanf(line, "%63s", name) != 1)
+            continue;
+        if (sscanf(line, "%63s %f", name, &value) != 2 || !(value >= 0.0f))
+            ok = false;
+        else if (!strcmp(name, "traversal"))
+            model.traversal = value;
+        else if (!strcmp(name, "intersection"))
+            model.intersection = value;
+        else if (!strcmp(name, "lambdaBias"))
+            model.lambdaBias = value;
+        else
+            ok = false;
+    }
+    fclose(file);
+    if (ok)
+        *costModel = model;
+    return ok;
+}
+
+bool SaveSAHProfile(const char* path, const SAHCostModel& costModel)
+{
+    FILE* file = fopen(path, "w");
+    if (!file)
+        return false;
+    //9 significant digits give back the exact float, so a loaded profile builds the same tree and hits the same cache
+    bool ok = fprintf(file, "# SAH cost model\ntraversal %.9g\nintersection %.9g\nlambdaBias %.9g\n",
+        costModel.traversal, costModel.intersection, costModel.lambdaBias) > 0;
+    return fclose(file) == 0 && ok;
+}
@@ -0,0 +1,193 @@
+#include "scene.h"
+#include <algorithm>
+#include <limits>
+#include <numeric>
+
+//instances per leaf of the top level hierarchy
+#define SCENE_LEAF_INSTANCES 2
+//the hierarchy is balanced, so this is plenty for any instance count that fits in memory
+#define SCENE_STACK_SIZE 64
+
+uint32_t Scene::AddMesh(const TriangleMesh& faces, const KDTreeBuildParams& params, const Vector3* triangleNormals)
+{
+    Mesh mesh;
+    mesh.faces = &faces;
+    mesh.triangleNormals = triangleNormals;
+    for (int k = 0; k < kAxesCount; ++k)
+    {
+        mesh.bounds.min[k] = std::numeric_limits<float>::max();
+        mesh.bounds.max[k] = -std::numeric_limits<float>::max();
+    }
+    for (uint32_t i = 0; i < faces.GetTriangleCount(); ++i)
+    {
+        Triangle triangle = faces.GetTriangle(i);
+        for (int k = 0; k < kAxesCount; ++k)
+        {
+            mesh.bounds.min[k] = std::min(mesh.bounds.min[k], triangle.GetAxisMin((Axis)k));
+            mesh.bounds.max[k] = std::max(mesh.bounds.max[k], triangle.GetAxisMax((Axis)k));
+        }
+    }
+    mesh.tree = std::make_unique<KDTree>(faces, mesh.bounds, params);
+    m_Meshes.push_back(std::move(mesh));
+    return (uint32_t)m_Meshes.size() - 1;
+}
+
+uint32_t Scene::AddInstance(uint32_t mesh, const Transform& objectToWorld)
+{
+    Instance instance;
+    instance.mesh = mesh;
+    m_Instances.push_back(instance);
+    SetTransform((uint32_t)m_Instances.size() - 1, objectToWorld);
+    return (uint32_t)m_Instances.size() - 1;
+}
+
+void Scene::SetTransform(uint32_t instance, const Transform& objectToWorld)
+{
+    Instance& target = m_Instances[instance];
+    target.objectToWorld = objectToWorld;
+    target.worldToObject = objectToWorld.Inverse();
+    target.bounds = objectToWorld.TransformBounds(m_Meshes[target.mesh].bounds);
+}
+
+void Scene::Commit()
+{
+    m_Nodes.clear();
+    m_InstanceOrder.resize(m_Instances.size());
+    std::iota(m_InstanceOrder.begin(), m_InstanceOrder.end(), 0);
+    if (!m_Instances.empty())
+        BuildNode(0, (uint32_t)m_Instances.size());
+}
+
+//split at the median of the instance centers along the axis they spread the most
+void Scene::BuildNode(uint32_t begin, uint32_t end)
+{
+    uint32_t index = (uint32_t)m_Nodes.size();
+    m_Nodes.emplace_back();
+    auto center = [this](uint32_t instance, int k)
+    {
+        return m_Instances[instance].bounds.min[k] + m_Instances[instance].bounds.max[k];
+    };
+    AABB bounds = m_Instances[m_InstanceOrder[begin]].bounds;
+    AABB centers;
+    for (int k = 0; k < kAxesCount; ++k)
+    {
+        centers.min[k] = centers.max[k] = center(m_InstanceOrder[begin], k);
+    }
+    for (uint32_t i = begin + 1; i < end; ++i)
+    {
+        const AABB& instanceBounds = m_Instances[m_InstanceOrder[i]].bounds;
+        for (int k = 0; k < kAxesCount; ++k)
+        {
+            bounds.min[k] = std::min(bounds.min[k], instanceBounds.min[k]);
+            bounds.max[k] = std::max(bounds.max[k], instanceBounds.max[k]);
+            centers.min[k] = std::min(centers.min[k], center(m_InstanceOrder[i], k));
+            centers.max[k] = std::max(centers.max[k], center(m_InstanceOrder[i], k));
+        }
+    }
+    if (end - begin <= SCENE_LEAF_INSTANCES)
+    {
+        m_Nodes[index] = { bounds, begin, end - begin };
+        return;
+    }
+    int axis = kAxisX;
+    for (int k = kAxisY; k < kAxesCount; ++k)
+    {
+        if (centers.max[k] - centers.min[k] > centers.max[axis] - centers.min[axis])
+            axis = k;
+    }
+    uint32_t middle = (begin + end) / 2;
+    std::nth_element(m_InstanceOrder.begin() + begin, m_InstanceOrder.begin() + middle, m_InstanceOrder.begin() + end,
+        [&](uint32_t a, uint32_t b) { return center(a, axis) < center(b, axis); });
+    BuildNode(begin, middle);
+    uint32_t second = (uint32_t)m_Nodes.size();
+    BuildNode(middle, end);
+    m_Nodes[index] = { bounds, second, 0 };
+}
+
+//slab test that also returns where the ray enters the box, boxes behind the origin or beyond maxDist are missed
+static bool IntersectBounds(const AABB& aabb, const Ray& ray, float maxDist, float* outNear)
+{
+    float tmin = 0.0f;
+    float tmax = maxDist;
+    for (int k = 0; k < kAxesCount; ++k)
+    {
+        float t0 = (aabb.min[k] - ray.origin[k]) * ray.inverseDirection[k];
+        float t1 = (aabb.max[k] - ray.origin[k]) * ray.inverseDirection[k];
+        if (t0 > t1)
+            std::swap(t0, t1);
+        tmin = std::max(tmin, t0);
+        tmax = std::min(tmax, t1);
+    }
+    *outNear = tmin;
+    return tmin <= tmax;
+}
+
+bool Scene::Intersect(const Ray& ray, SceneHit* hit) const
+{
+    bool found = false;
+    hit->distance = std::numeric_limits<float>::max();
+    struct StackEntry
+    {
+        uint32_t node;
+        float nearDist;
+    };
+    StackEntry stack[SCENE_STACK_SIZE];
+    int stackSize = 0;
+    float nearDist;
+    if (!m_Nodes.empty() && IntersectBounds(m_Nodes[0].bounds, ray, hit->distance, &nearDist))
+        stack[stackSize++] = { 0, nearDist };
+    while (stackSize)
+    {
+        StackEntry entry = stack[--stackSize];
+        //a closer hit may have been found since the node was pushed
+        if (entry.nearDist > hit->distance)
+            continue;
+        const BVHNode& node = m_Nodes[entry.node];
+        if (!node.count)
+        {
+            //visit the nearer child first so its hits cull the other one
+            uint32_t children[2] = { entry.node + 1, node.offset };
+            float nearDists[2];
+            bool hits[2];
+            for (int i = 0; i < 2; ++i)
+            {
+                hits[i] = IntersectBounds(m_Nodes[children[i]].bounds, ray, hit->distance, &nearDists[i]);
+            }
+            int nearer = hits[1] && (!hits[0] || nearDists[1] < nearDists[0]) ? 1 : 0;
+            if (hits[1 - nearer])
+                stack[stackSize++] = { children[1 - nearer], nearDists[1 - nearer] };
+            if (hits[nearer])
+                stack[stackSize++] = { children[nearer], nearDists[nearer] };
+            continue;
+        }
+        for (uint32_t i = node.offset; i < node.offset + node.count; ++i)
+        {
+            const Instance& instance = m_Instances[m_InstanceOrder[i]];
+            //the direction is not normalized in object space, so distances along it stay world space distances
+            Ray objectRay(instance.worldToObject.TransformPoint(ray.origin), instance.worldToObject.TransformVector(ray.direction));
+            uint32_t triangle;
+            float distance;
+            if (m_Meshes[instance.mesh].tree->Intersect(objectRay, &triangle, &distance) && distance >= 0.0f && distance < hit->distance)
+            {
+                found = true;
+                hit->triangle = triangle;
+                hit->instance = m_InstanceOrder[i];
+                hit->distance = distance;
+            }
+        }
+    }
+    if (!found)
+        return false;
+    //normals move with the inverse transposed transform
+    const Instance& instance = m_Instances[hit->instance];
+    const Mesh& mesh = m_Meshes[instance.mesh];
+    Vector3 normal = mesh.triangleNormals ? mesh.triangleNormals[hit->triangle] : mesh.faces->GetTriangle(hit->triangle).GetNormal();
+    hit->normal = instance.worldToObject.TransformTransposed(normal).Normalized();
+    return true;
+}
+
+size_t Scene::GetTopLevelBytes() const
+{
+    return m_Meshes.size() * sizeof(Mesh) + m_Instances.size() * sizeof(Instance) +
+        m_InstanceOrder.size() * sizeof(uint32_t) + m_Nodes.size() * sizeof(BVHNode);
+}
@@ -0,0 +1,77 @@
+#pragma once
+#include "kdtree.h"
+#include "transform.h"
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+struct SceneHit
+{
+    //index of the triangle in the instance's mesh
+    uint32_t triangle;
+    uint32_t instance;
+    float distance;
+    //world space normal of the triangle, unit length
+    Vector3 normal;
+};
+
+//two level acceleration structure. Every mesh gets its own kd-tree, built once in object space, and instances place
+//a mesh in the world with a transform. A bounding volume hierarchy over the instances' world bounds finds the
+//instances a ray passes, then the ray is moved into the instance's object space and traced in the mesh's tree.
+//Memory grows with the meshes, an instance only costs its transforms and bounds.
+class Scene
+{
+public:
+    //the mesh is referenced, not copied, and has to outlive the scene, like the unit normals of its triangles if given.
+    //Without them the normal is computed from the triangle at every hit. Returns the mesh index
+    uint32_t AddMesh(const TriangleMesh& faces, const KDTreeBuildParams& params = KDTreeBuildParams(), const Vector3* triangleNormals = nullptr);
+    //the transform has to be invertible. Returns the instance index
+    uint32_t AddInstance(uint32_t mesh, const Transform& objectToWorld);
+    //moving an instance never rebuilds a mesh's tree, only the top level on the next Commit
+    void SetTransform(uint32_t instance, const Transform& objectToWorld);
+    //rebuilds the top level after instances were added or moved, has to be called before tracing
+    void Commit();
+
+    bool Intersect(const Ray& ray, SceneHit* hit) const;
+
+    size_t GetMeshCount() const { return m_Meshes.size(); }
+    size_t GetInstanceCount() const { return m_Instances.size(); }
+    const KDTree& GetMeshTree(uint32_t mesh) const { return *m_Meshes[mesh].tree; }
+    uint32_t GetInstanceMesh(uint32_t instance) const { return m_Instances[instance].mesh; }
+    //memory of the instances and the hierarchy over them, the meshes' trees not included
+    size_t GetTopLevelBytes() const;
+
+private:
+    struct Mesh
+    {
+        const TriangleMesh* faces;
+        const Vector3* triangleNormals;
+        std::unique_ptr<KDTree> tree;
+        //tight bounds of the faces, the tree is built in them
+        AABB bounds;
+    };
+
+    struct Instance
+    {
+        uint32_t mesh;
+        Transform objectToWorld;
+        Transform worldToObject;
+        AABB bounds;
+    };
+
+    //inner nodes have count 0, their first child follows them and offset is the second one.
+    //Leaves hold count instances starting at offset in m_InstanceOrder
+    struct BVHNode
+    {
+        AABB bounds;
+        uint32_t offset;
+        uint32_t count;
+    };
+
+    void BuildNode(uint32_t begin, uint32_t end);
+
+    std::vector<Mesh> m_Meshes;
+    std::vector<Instance> m_Instances;
+    std::vector<uint32_t> m_InstanceOrder;
+    std::vector<BVHNode> m_Nodes;
+};
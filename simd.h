@@ -0,0 +1,229 @@
+#pragma once
+#include <cstdint>
+
+//SIMD floats as wide as the instruction sets the compiler may use: 16 lanes with AVX-512, 8 with AVX, 4 with SSE2.
+//Other targets get 4 plain floats, so the code that uses them works everywhere. The width is picked at compile time,
+//build with -mavx2 or -mavx512f to get the wider ones
+#if defined(__AVX512F__)
+#define SIMD_AVX512
+#define SIMD_WIDTH 16
+#elif defined(__AVX__)
+#define SIMD_AVX
+#define SIMD_WIDTH 8
+#elif defined(__SSE2__) || defined(_M_X64)
+#define SIMD_SSE
+#define SIMD_WIDTH 4
+#else
+#define SIMD_WIDTH 4
+#endif
+
+#if defined(SIMD_AVX512) || defined(SIMD_AVX) || defined(SIMD_SSE)
+#include <immintrin.h>
+#endif
+
+//one flag per lane, the result of comparing SimdFloats
+struct SimdMask
+{
+#if defined(SIMD_AVX512)
+    __mmask16 m;
+#elif defined(SIMD_AVX)
+    __m256 m;
+#elif defined(SIMD_SSE)
+    __m128 m;
+#else
+    uint32_t m;
+#endif
+
+    //bit i is lane i
+    static SimdMask FromBits(uint32_t bits)
+    {
+#if defined(SIMD_AVX512)
+        return { (__mmask16)bits };
+#elif defined(SIMD_AVX) || defined(SIMD_SSE)
+        alignas(SIMD_WIDTH * 4) int32_t lanes[SIMD_WIDTH];
+        for (int i = 0; i < SIMD_WIDTH; ++i)
+        {
+            lanes[i] = (bits >> i) & 1 ? -1 : 0;
+        }
+#if defined(SIMD_AVX)
+        return { _mm256_load_ps((const float*)lanes) };
+#else
+        return { _mm_load_ps((const float*)lanes) };
+#endif
+#else
+        return { bits & ((1u << SIMD_WIDTH) - 1) };
+#endif
+    }
+
+    uint32_t GetBits() const
+    {
+#if defined(SIMD_AVX512)
+        return m;
+#elif defined(SIMD_AVX)
+        return (uint32_t)_mm256_movemask_ps(m);
+#elif defined(SIMD_SSE)
+        return (uint32_t)_mm_movemask_ps(m);
+#else
+        return m;
+#endif
+    }
+
+    bool Any() const { return GetBits() != 0; }
+};
+
+inline SimdMask operator&(const SimdMask& a, const SimdMask& b)
+{
+#if defined(SIMD_AVX512)
+    return { (__mmask16)(a.m & b.m) };
+#elif defined(SIMD_AVX)
+    return { _mm256_and_ps(a.m, b.m) };
+#elif defined(SIMD_SSE)
+    return { _mm_and_ps(a.m, b.m) };
+#else
+    return { a.m & b.m };
+#endif
+}
+
+inline SimdMask operator|(const SimdMask& a, const SimdMask& b)
+{
+#if defined(SIMD_AVX512)
+    return { (__mmask16)(a.m | b.m) };
+#elif defined(SIMD_AVX)
+    return { _mm256_or_ps(a.m, b.m) };
+#elif defined(SIMD_SSE)
+    return { _mm_or_ps(a.m, b.m) };
+#else
+    return { a.m | b.m };
+#endif
+}
+
+//lanes set in a but not in b
+inline SimdMask AndNot(const SimdMask& a, const SimdMask& b)
+{
+#if defined(SIMD_AVX512)
+    return { (__mmask16)(a.m & ~b.m) };
+#elif defined(SIMD_AVX)
+    return { _mm256_andnot_ps(b.m, a.m) };
+#elif defined(SIMD_SSE)
+    return { _mm_andnot_ps(b.m, a.m) };
+#else
+    return { a.m & ~b.m };
+#endif
+}
+
+//every operation is the IEEE one of each lane, so lane i of a result is bit for bit what the same scalar code gives
+struct SimdFloat
+{
+#if defined(SIMD_AVX512)
+    __m512 v;
+#elif defined(SIMD_AVX)
+    __m256 v;
+#elif defined(SIMD_SSE)
+    __m128 v;
+#else
+    float v[SIMD_WIDTH];
+#endif
+
+    static SimdFloat Broadcast(float f)
+    {
+#if defined(SIMD_AVX512)
+        return { _mm512_set1_ps(f) };
+#elif defined(SIMD_AVX)
+        return { _mm256_set1_ps(f) };
+#elif defined(SIMD_SSE)
+        return { _mm_set1_ps(f) };
+#else
+        return { { f, f, f, f } };
+#endif
+    }
+
+    //p has to be aligned to SIMD_WIDTH floats
+    static SimdFloat Load(const float* p)
+    {
+#if defined(SIMD_AVX512)
+        return { _mm512_load_ps(p) };
+#elif defined(SIMD_AVX)
+        return { _mm256_load_ps(p) };
+#elif defined(SIMD_SSE)
+        return { _mm_load_ps(p) };
+#else
+        return { { p[0], p[1], p[2], p[3] } };
+#endif
+    }
+
+    void Store(float* p) const
+    {
+#if defined(SIMD_AVX512)
+        _mm512_store_ps(p, v);
+#elif defined(SIMD_AVX)
+        _mm256_store_ps(p, v);
+#elif defined(SIMD_SSE)
+        _mm_store_ps(p, v);
+#else
+        for (int i = 0; i < SIMD_WIDTH; ++i)
+        {
+            p[i] = v[i];
+        }
+#endif
+    }
+};
+
+#if defined(SIMD_AVX512)
+#define SIMD_BINARY_OPERATOR(op, avx512, avx, sse) \
+    inline SimdFloat operator op(const SimdFloat& a, const SimdFloat& b) { return { avx512(a.v, b.v) }; }
+#define SIMD_COMPARE_OPERATOR(op, predicate, sse) \
+    inline SimdMask operator op(const SimdFloat& a, const SimdFloat& b) { return { _mm512_cmp_ps_mask(a.v, b.v, predicate) }; }
+#elif defined(SIMD_AVX)
+#define SIMD_BINARY_OPERATOR(op, avx512, avx, sse) \
+    inline SimdFloat operator op(const SimdFloat& a, const SimdFloat& b) { return { avx(a.v, b.v) }; }
+#define SIMD_COMPARE_OPERATOR(op, predicate, sse) \
+    inline SimdMask operator op(const SimdFloat& a, const SimdFloat& b) { return { _mm256_cmp_ps(a.v, b.v, predicate) }; }
+#elif defined(SIMD_SSE)
+#define SIMD_BINARY_OPERATOR(op, avx512, avx, sse) \
+    inline SimdFloat operator op(const SimdFloat& a, const SimdFloat& b) { return { sse(a.v, b.v) }; }
+#define SIMD_COMPARE_OPERATOR(op, predicate, sse) \
+    inline SimdMask operator op(const SimdFloat& a, const SimdFloat& b) { return { sse(a.v, b.v) }; }
+#else
+#define SIMD_BINARY_OPERATOR(op, avx512, avx, sse) \
+    inline SimdFloat operator op(const SimdFloat& a, const SimdFloat& b) \
+    { \
+        return { { a.v[0] op b.v[0], a.v[1] op b.v[1], a.v[2] op b.v[2], a.v[3] op b.v[3] } }; \
+    }
+#define SIMD_COMPARE_OPERATOR(op, predicate, sse) \
+    inline SimdMask operator op(const SimdFloat& a, const SimdFloat& b) \
+    { \
+        return { (uint32_t)(a.v[0] op b.v[0]) | (uint32_t)(a.v[1] op b.v[1]) << 1 | (uint32_t)(a.v[2] op b.v[2]) << 2 | (uint32_t)(a.v[3] op b.v[3]) << 3 }; \
+    }
+#endif
+
+SIMD_BINARY_OPERATOR(+, _mm512_add_ps, _mm256_add_ps, _mm_add_ps)
+SIMD_BINARY_OPERATOR(-, _mm512_sub_ps, _mm256_sub_ps, _mm_sub_ps)
+SIMD_BINARY_OPERATOR(*, _mm512_mul_ps, _mm256_mul_ps, _mm_mul_ps)
+SIMD_BINARY_OPERATOR(/, _mm512_div_ps, _mm256_div_ps, _mm_div_ps)
+//ordered compares, false for NaN lanes like the scalar operators
+SIMD_COMPARE_OPERATOR(<, _CMP_LT_OQ, _mm_cmplt_ps)
+SIMD_COMPARE_OPERATOR(<=, _CMP_LE_OQ, _mm_cmple_ps)
+SIMD_COMPARE_OPERATOR(>, _CMP_GT_OQ, _mm_cmpgt_ps)
+SIMD_COMPARE_OPERATOR(>=, _CMP_GE_OQ, _mm_cmpge_ps)
+
+#undef SIMD_BINARY_OPERATOR
+#undef SIMD_COMPARE_OPERATOR
+
+//mask ? a : b per lane
+inline SimdFloat Select(const SimdMask& mask, const SimdFloat& a, const SimdFloat& b)
+{
+#if defined(SIMD_AVX512)
+    return { _mm512_mask_blend_ps(mask.m, b.v, a.v) };
+#elif defined(SIMD_AVX)
+    return { _mm256_blendv_ps(b.v, a.v, mask.m) };
+#elif defined(SIMD_SSE)
+    return { _mm_or_ps(_mm_and_ps(mask.m, a.v), _mm_andnot_ps(mask.m, b.v)) };
+#else
+    SimdFloat result;
+    for (int i = 0; i < SIMD_WIDTH; ++i)
+    {
+        result.v[i] = (mask.m >> i) & 1 ? a.v[i] : b.v[i];
+    }
+    return result;
+#endif
+}
@@ -0,0 +1,132 @@
+#include "task_scheduler.h"
+
+static thread_local const TaskScheduler* s_CurrentScheduler = nullptr;
+static thread_local unsigned int s_CurrentQueue = 0;
+
+TaskScheduler::TaskScheduler(unsigned int threadCount)
+{
+    m_ThreadCount = threadCount ? threadCount : GetHardwareThreadCount();
+    m_Queues.reset(new TaskQueue[m_ThreadCount]);
+    //the calling thread takes part when it waits, so spawn one thread less
+    for (unsigned int i = 0; i + 1 < m_ThreadCount; ++i)
+    {
+        m_Workers.emplace_back(&TaskScheduler::WorkerLoop, this, i);
+    }
+}
+
+TaskScheduler::~TaskScheduler()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_SleepMutex);
+        m_Quit = true;
+    }
+    m_WakeCondition.notify_all();
+    for (std::thread& worker : m_Workers)
+    {
+        worker.join();
+    }
+}
+
+unsigned int TaskScheduler::GetHardwareThreadCount()
+{
+    unsigned int count = std::thread::hardware_concurrency();
+    return count ? count : 1;
+}
+
+unsigned int TaskScheduler::GetQueueIndex() const
+{
+    return s_CurrentScheduler == this ? s_CurrentQueue : m_ThreadCount - 1;
+}
+
+void TaskScheduler::Run(TaskGroup& group, std::function<void()> task)
+{
+    if (m_ThreadCount <= 1)
+    {
+        task();
+        return;
+    }
+    group.m_Pending.fetch_add(1, std::memory_order_relaxed);
+    TaskQueue& queue = m_Queues[GetQueueIndex()];
+    {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.tasks.push_back({ &group, std::move(task) });
+    }
+    m_QueuedTasks.fetch_add(1, std::memory_order_release);
+    //taking the lock orders the push against a worker that is about to go to sleep
+    {
+        std::lock_guard<std::mutex> lock(m_SleepMutex);
+    }
+    m_WakeCondition.notify_one();
+}
+
+void TaskScheduler::Wait(TaskGroup& group)
+{
+    unsigned int queueIndex = GetQueueIndex();
+    while (group.m_Pending.load(std::memory_order_acquire) > 0)
+    {
+        Task task;
+        if (PopTask(queueIndex, &task))
+        {
+            Execute(task);
+        }
+        else
+        {
+            std::this_thread::yield();
+        }
+    }
+}
+
+bool TaskScheduler::PopTask(unsigned int queueIndex, Task* outTask)
+{
+    //newest task from our own queue first, it is the one whose data is still in cache
+    {
+        TaskQueue& queue = m_Queues[queueIndex];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (!queue.tasks.empty())
+        {
+            *outTask = std::move(queue.tasks.back());
+            queue.tasks.pop_back();
+            m_QueuedTasks.fetch_sub(1, std::memory_order_relaxed);
+            return true;
+        }
+    }
+    //otherwise steal the oldest (usually largest) task of another queue
+    for (unsigned int i = 1; i < m_ThreadCount; ++i)
+    {
+        TaskQueue& queue = m_Queues[(queueIndex + i) % m_ThreadCount];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (!queue.tasks.empty())
+        {
+            *outTask = std::move(queue.tasks.front());
+            queue.tasks.pop_front();
+            m_QueuedTasks.fetch_sub(1, std::memory_order_relaxed);
+            return true;
+        }
+    }
+    return false;
+}
+
+void TaskScheduler::Execute(Task& task)
+{
+    task.function();
+    task.group->m_Pending.fetch_sub(1, std::memory_order_release);
+}
+
+void TaskScheduler::WorkerLoop(unsigned int queueIndex)
+{
+    s_CurrentScheduler = this;
+    s_CurrentQueue = queueIndex;
+    while (true)
+    {
+        Task task;
+        if (PopTask(queueIndex, &task))
+        {
+            Execute(task);
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(m_SleepMutex);
+        m_WakeCondition.wait(lock, [this] { return m_Quit || m_QueuedTasks.load(std::memory_order_acquire) > 0; });
+        if (m_Quit)
+            return;
+    }
+}
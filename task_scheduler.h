@@ -0,0 +1,63 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+//a set of tasks that can be waited on together
+class TaskGroup
+{
+    friend class TaskScheduler;
+    std::atomic<int> m_Pending{0};
+};
+
+//work-stealing thread pool: every worker owns a deque, pushes and pops its own work LIFO and
+//steals FIFO from the others when it runs dry. A thread waiting on a group keeps executing tasks.
+class TaskScheduler
+{
+public:
+    //threadCount includes the calling thread, 0 means one per hardware thread
+    explicit TaskScheduler(unsigned int threadCount = 0);
+    ~TaskScheduler();
+    TaskScheduler(const TaskScheduler&) = delete;
+    TaskScheduler& operator=(const TaskScheduler&) = delete;
+
+    static unsigned int GetHardwareThreadCount();
+    unsigned int GetThreadCount() const { return m_ThreadCount; }
+    //index of the calling thread in [0, GetThreadCount()), threads outside the pool share the last one
+    unsigned int GetCurrentThreadIndex() const { return GetQueueIndex(); }
+
+    void Run(TaskGroup& group, std::function<void()> task);
+    void Wait(TaskGroup& group);
+
+private:
+    struct Task
+    {
+        TaskGroup* group;
+        std::function<void()> function;
+    };
+
+    struct TaskQueue
+    {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    unsigned int GetQueueIndex() const;
+    bool PopTask(unsigned int queueIndex, Task* outTask);
+    void Execute(Task& task);
+    void WorkerLoop(unsigned int queueIndex);
+
+    unsigned int m_ThreadCount;
+    //one queue per worker, the last one is shared by threads outside the pool
+    std::unique_ptr<TaskQueue[]> m_Queues;
+    std::vector<std::thread> m_Workers;
+    std::atomic<int> m_QueuedTasks{0};
+    std::mutex m_SleepMutex;
+    std::condition_variable m_WakeCondition;
+    bool m_Quit = false;
+};
@@ -0,0 +1,121 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include "vector3.h"
+#include "aabb.h"
+
+//affine transform stored as the rows of a 3x4 matrix, the last column is the translation
+struct Transform
+{
+    float m[3][4];
+
+    static Transform Identity()
+    {
+        return Scale(1.0f);
+    }
+
+    static Transform Translation(const Vector3& offset)
+    {
+        Transform transform = Identity();
+        transform.m[0][3] = offset.x;
+        transform.m[1][3] = offset.y;
+        transform.m[2][3] = offset.z;
+        return transform;
+    }
+
+    static Transform Scale(float scale)
+    {
+        Transform transform = {};
+        transform.m[0][0] = transform.m[1][1] = transform.m[2][2] = scale;
+        return transform;
+    }
+
+    static Transform RotationY(float angle)
+    {
+        Transform transform = Identity();
+        transform.m[0][0] = transform.m[2][2] = cosf(angle);
+        transform.m[0][2] = sinf(angle);
+        transform.m[2][0] = -sinf(angle);
+        return transform;
+    }
+
+    //applies other first, then this
+    Transform operator*(const Transform& other) const
+    {
+        Transform result;
+        for (int i = 0; i < 3; ++i)
+        {
+            for (int j = 0; j < 4; ++j)
+            {
+                result.m[i][j] = m[i][0] * other.m[0][j] + m[i][1] * other.m[1][j] + m[i][2] * other.m[2][j] + (j == 3 ? m[i][3] : 0.0f);
+            }
+        }
+        return result;
+    }
+
+    Vector3 TransformPoint(const Vector3& p) const
+    {
+        return TransformVector(p) + Vector3(m[0][3], m[1][3], m[2][3]);
+    }
+
+    Vector3 TransformVector(const Vector3& v) const
+    {
+        return Vector3(
+            m[0][0] * v.x + m[0][1] * v.y + m[0][2] * v.z,
+            m[1][0] * v.x + m[1][1] * v.y + m[1][2] * v.z,
+            m[2][0] * v.x + m[2][1] * v.y + m[2][2] * v.z);
+    }
+
+    //multiplies with the transposed linear part, called on the inverse transform this maps normals
+    Vector3 TransformTransposed(const Vector3& v) const
+    {
+        return Vector3(
+            m[0][0] * v.x + m[1][0] * v.y + m[2][0] * v.z,
+            m[0][1] * v.x + m[1][1] * v.y + m[2][1] * v.z,
+            m[0][2] * v.x + m[1][2] * v.y + m[2][2] * v.z);
+    }
+
+    //the linear part has to be invertible
+    Transform Inverse() const
+    {
+        //inverse of the 3x3 part from its cofactors
+        float c00 = m[1][1] * m[2][2] - m[1][2] * m[2][1];
+        float c01 = m[1][2] * m[2][0] - m[1][0] * m[2][2];
+        float c02 = m[1][0] * m[2][1] - m[1][1] * m[2][0];
+        float rcpDet = 1.0f / (m[0][0] * c00 + m[0][1] * c01 + m[0][2] * c02);
+        Transform inverse;
+        inverse.m[0][0] = c00 * rcpDet;
+        inverse.m[0][1] = (m[0][2] * m[2][1] - m[0][1] * m[2][2]) * rcpDet;
+        inverse.m[0][2] = (m[0][1] * m[1][2] - m[0][2] * m[1][1]) * rcpDet;
+        inverse.m[1][0] = c01 * rcpDet;
+        inverse.m[1][1] = (m[0][0] * m[2][2] - m[0][2] * m[2][0]) * rcpDet;
+        inverse.m[1][2] = (m[0][2] * m[1][0] - m[0][0] * m[1][2]) * rcpDet;
+        inverse.m[2][0] = c02 * rcpDet;
+        inverse.m[2][1] = (m[0][1] * m[2][0] - m[0][0] * m[2][1]) * rcpDet;
+        inverse.m[2][2] = (m[0][0] * m[1][1] - m[0][1] * m[1][0]) * rcpDet;
+        //the translation moves back by the inverted linear part
+        Vector3 translation = inverse.TransformVector(Vector3(m[0][3], m[1][3], m[2][3]));
+        inverse.m[0][3] = -translation.x;
+        inverse.m[1][3] = -translation.y;
+        inverse.m[2][3] = -translation.z;
+        return inverse;
+    }
+
+    //bounds of the transformed box [Arvo, Graphics Gems 1990]
+    AABB TransformBounds(const AABB& aabb) const
+    {
+        AABB result;
+        for (int i = 0; i < 3; ++i)
+        {
+            result.min[i] = result.max[i] = m[i][3];
+            for (int j = 0; j < 3; ++j)
+            {
+                float a = m[i][j] * aabb.min[j];
+                float b = m[i][j] * aabb.max[j];
+                result.min[i] += std::min(a, b);
+                result.max[i] += std::max(a, b);
+            }
+        }
+        return result;
+    }
+};
@@ -0,0 +1,57 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "triangle.h"
+
+//indexed triangle mesh: one shared vertex buffer, stored as structure of arrays, and three vertex indices per triangle.
+//Triangles are identified by their index, and gathered into a Triangle only where the code needs all three vertices
+struct TriangleMesh
+{
+    std::vector<float> vertexX;
+    std::vector<float> vertexY;
+    std::vector<float> vertexZ;
+    //vertex indices, triangle i uses indices[3 * i] to indices[3 * i + 2]
+    std::vector<uint32_t> indices;
+
+    //one vertex per corner, for meshes that come as separate triangles
+    static TriangleMesh FromTriangles(const std::vector<Triangle>& triangles)
+    {
+        TriangleMesh mesh;
+        for (const Triangle& triangle : triangles)
+        {
+            for (int i = 0; i < 3; ++i)
+            {
+                mesh.indices.push_back(mesh.AddVertex(triangle.vertices[i]));
+            }
+        }
+        return mesh;
+    }
+
+    uint32_t AddVertex(const Vector3& vertex)
+    {
+        vertexX.push_back(vertex.x);
+        vertexY.push_back(vertex.y);
+        vertexZ.push_back(vertex.z);
+        return (uint32_t)vertexX.size() - 1;
+    }
+
+    size_t GetVertexCount() const { return vertexX.size(); }
+    size_t GetTriangleCount() const { return indices.size() / 3; }
+
+    Vector3 GetVertex(uint32_t vertex) const
+    {
+        return Vector3(vertexX[vertex], vertexY[vertex], vertexZ[vertex]);
+    }
+
+    Triangle GetTriangle(uint32_t triangle) const
+    {
+        const uint32_t* corners = &indices[3 * triangle];
+        return Triangle(GetVertex(corners[0]), GetVertex(corners[1]), GetVertex(corners[2]));
+    }
+
+    size_t GetBytes() const
+    {
+        return GetVertexCount() * 3 * sizeof(float) + indices.size() * sizeof(uint32_t);
+    }
+};
@@ -1,8 +1,28 @@
 #include <cstdio>
+#include <cstring>
 #include "ply_reader.h"
 #include "raytracer.h"
 #include "tga_saver.h"
 
+static bool SameTree(const KDTree& a, const KDTree& b)
+{
+    const KDTreeView& va = a.GetView();
+    const KDTreeView& vb = b.GetView();
+    if (va.nodeCount != vb.nodeCount || va.triangleIndexCount != vb.triangleIndexCount)
+        return false;
+    for (size_t i = 0; i < va.nodeCount; ++i)
+    {
+        if (va.nodes[i].flags != vb.nodes[i].flags || va.nodes[i].triangleOffset != vb.nodes[i].triangleOffset)
+            return false;
+    }
+    for (size_t i = 0; i < va.triangleIndexCount; ++i)
+    {
+        if (va.triangleIndices[i] != vb.triangleIndices[i])
+            return false;
+    }
+    return true;
+}
+
 int main()
 {
     uint16_t width = 640, height = 480;
@@ -12,7 +32,100 @@ int main()
     raytracer.SetResolution(width, height);
     raytracer.SetFOV((float)M_PI / 6.0f);
     raytracer.SetCameraPosition(Vector3(0.0f, 0.15f, 0.5f));
+    raytracer.SetForward(Vector3(0.0f, 0.0f, -1.0f));
     raytracer.Setup();
+    printf("Testing parallel kd-Tree build...\n");
+    {
+        AABB aabb;
+        aabb.min = Vector3(-10, -10, -10);
+        aabb.max = Vector3(10, 10, 10);
+        KDTreeBuildParams serialParams;
+        serialParams.threadCount = 1;
+        KDTreeBuildParams parallelParams;
+        parallelParams.threadCount = 8;
+        KDTree serialTree(model->mesh, aabb, serialParams);
+        KDTree parallelTree(model->mesh, aabb, parallelParams);
+        assert(SameTree(serialTree, parallelTree));
+
+        printf("Testing kd-Tree stats...\n");
+        KDTreeStats stats = serialTree.ComputeStats();
+        assert(stats.nodeCount == serialTree.GetNodeCount());
+        assert(stats.innerNodeCount + stats.leafCount == stats.nodeCount && stats.leafCount == stats.innerNodeCount + 1);
+        size_t histogramLeaves = 0, histogramReferences = 0, depthLeaves = 0;
+        for (size_t n = 0; n < stats.leafSizeHistogram.size(); ++n)
+        {
+            histogramLeaves += stats.leafSizeHistogram[n];
+            histogramReferences += n * stats.leafSizeHistogram[n];
+        }
+        for (size_t count : stats.depthHistogram)
+        {
+            depthLeaves += count;
+        }
+        assert(histogramLeaves == stats.leafCount && depthLeaves == stats.leafCount);
+        assert(histogramReferences == stats.triangleReferenceCount && stats.leafSizeHistogram[0] == stats.emptyLeafCount);
+        assert(stats.triangleCount <= model->mesh.GetTriangleCount() && stats.duplicationFactor >= 1.0);
+        assert(stats.depthHistogram.size() == stats.maxDepth + 1 && stats.leafSizeHistogram.size() == stats.maxLeafSize + 1);
+        FILE* json = tmpfile();
+        assert(json && stats.WriteJSON(json));
+        fclose(json);
+
+        printf("Testing kd-Tree cache...\n");
+        const char* cachePath = "unit_test.kdtree";
+        assert(serialTree.SaveCache(cachePath, model->mesh, serialParams));
+        std::unique_ptr<KDTree> mapped = KDTree::LoadCache(cachePath, model->mesh, aabb, parallelParams);
+        assert(mapped && mapped->IsMapped());
+        assert(SameTree(serialTree, *mapped));
+        KDTreeBuildParams binnedParams;
+        binnedParams.mode = kBuildModeBinned;
+        assert(!KDTree::LoadCache(cachePath, model->mesh, aabb, binnedParams));
+        TriangleMesh moved = model->mesh;
+        moved.vertexX[moved.indices[0]] += 1e-3f;
+        assert(!KDTree::LoadCache(cachePath, moved, aabb, serialParams));
+        //a file whose header still matches but whose nodes or indices point outside their arrays is rebuilt, not traversed.
+        //The index array ends the file and the node array directly precedes it
+        {
+            FILE* file = fopen(cachePath, "rb");
+            assert(file);
+            std::vector<uint8_t> bytes;
+            uint8_t buffer[4096];
+            for (size_t read; (read = fread(buffer, 1, sizeof(buffer), file)) > 0;)
+                bytes.insert(bytes.end(), buffer, buffer + read);
+            fclose(file);
+            size_t indicesOffset = bytes.size() - serialTree.GetTriangleIndexCount() * sizeof(uint32_t);
+            size_t nodesOffset = indicesOffset - serialTree.GetNodeCount() * sizeof(KDTreeNode);
+            const char* corruptPath = "unit_test_corrupt.kdtree";
+            auto loadCorrupted = [&](size_t offset, uint32_t value) {
+                std::vector<uint8_t> corrupted = bytes;
+                memcpy(&corrupted[offset], &value, sizeof(value));
+                FILE* out = fopen(corruptPath, "wb");
+                assert(out && fwrite(corrupted.data(), 1, corrupted.size(), out) == corrupted.size());
+                fclose(out);
+                return KDTree::LoadCache(corruptPath, model->mesh, aabb, serialParams) != nullptr;
+            };
+            assert(loadCorrupted(indicesOffset, 0));
+            //the root's above child past the last node
+            assert(!loadCorrupted(nodesOffset + 4, ((uint32_t)serialTree.GetNodeCount() << 2) | serialTree.GetView().GetRoot().GetAxis()));
+            //a triangle id past the mesh
+            assert(!loadCorrupted(indicesOffset, (uint32_t)model->mesh.GetTriangleCount()));
+            remove(corruptPath);
+        }
+
+        printf("Testing SAH profile...\n");
+        const char* profilePath = "unit_test.sah";
+        KDTreeBuildParams profileParams;
+        profileParams.costModel = Raytracer::CalibrateCostModel();
+        assert(profileParams.costModel.intersection > 0.0f && profileParams.costModel.intersection < 1e3f);
+        assert(SaveSAHProfile(profilePath, profileParams.costModel));
+        KDTreeBuildParams loadedParams;
+        assert(LoadSAHProfile(profilePath, &loadedParams.costModel));
+        assert(loadedParams.costModel.traversal == profileParams.costModel.traversal);
+        assert(loadedParams.costModel.intersection == profileParams.costModel.intersection);
+        assert(loadedParams.costModel.lambdaBias == profileParams.costModel.lambdaBias);
+        //a tree built with other constants must not be mapped
+        assert(!KDTree::LoadCache(cachePath, model->mesh, aabb, loadedParams) || loadedParams.costModel.intersection == serialParams.costModel.intersection);
+        remove(profilePath);
+        remove(cachePath);
+    }
     printf("Testing pixels...\n");
     for (int y = 100; y < 200; ++y)
     {
@@ -24,6 +137,649 @@ int main()
         assert(c1.g == c2.g);
         assert(c1.b == c2.b);
     }
+    printf("Testing binned kd-Tree pixels...\n");
+    {
+        Raytracer binned;
+        binned.SetModel(model.get());
+        binned.SetResolution(width, height);
+        binned.SetCameraPosition(Vector3(0.0f, 0.15f, 0.5f));
+        binned.SetForward(Vector3(0.0f, 0.0f, -1.0f));
+        KDTreeBuildParams params;
+        params.mode = kBuildModeBinned;
+        params.binCount = 32;
+        params.exactThreshold = 64;
+        binned.SetBuildParams(params);
+        binned.Setup();
+        raytracer.SetUseKDTree(false);
+        for (int y = 100; y < 200; ++y)
+        {
+            Color c1 = raytracer.GetPixel(320, y);
+            Color c2 = binned.GetPixel(320, y);
+            assert(c1.r == c2.r);
+            assert(c1.g == c2.g);
+            assert(c1.b == c2.b);
+        }
+    }
+    printf("Testing perfect split kd-Tree pixels...\n");
+    {
+        KDTreeBuildParams params;
+        params.perfectSplits = true;
+        Raytracer perfect;
+        perfect.SetModel(model.get());
+        perfect.SetResolution(width, height);
+        perfect.SetCameraPosition(Vector3(0.0f, 0.15f, 0.5f));
+        perfect.SetForward(Vector3(0.0f, 0.0f, -1.0f));
+        perfect.SetBuildParams(params);
+        perfect.Setup();
+        //clipping can only take references away
+        assert(perfect.GetKDTree()->GetTriangleIndexCount() <= raytracer.GetKDTree()->GetTriangleIndexCount());
+        raytracer.SetUseKDTree(false);
+        for (int y = 100; y < 200; ++y)
+        {
+            Color c1 = raytracer.GetPixel(320, y);
+            Color c2 = perfect.GetPixel(320, y);
+            assert(c1.r == c2.r);
+            assert(c1.g == c2.g);
+            assert(c1.b == c2.b);
+        }
+    }
+    printf("Testing front to back traversal...\n");
+    {
+        const KDTree& tree = *raytracer.GetKDTree();
+        KDTraversalStats recursiveStats, frontToBackStats;
+        for (uint16_t y = 0; y < height; y += 4)
+        {
+            for (uint16_t x = 0; x < width; x += 4)
+            {
+                Ray ray = raytracer.GetCameraRay(x, y);
+                uint32_t recursiveTriangle, triangle;
+                float recursiveDist, dist;
+                bool recursiveHit = tree.IntersectRecursive(ray, &recursiveTriangle, &recursiveDist, &recursiveStats);
+                assert(tree.Intersect(ray, &triangle, &dist, &frontToBackStats) == recursiveHit);
+                //triangles at exactly the same distance may be found in another order
+                assert(!recursiveHit || dist == recursiveDist);
+            }
+        }
+        assert(frontToBackStats.innerNodes < recursiveStats.innerNodes && frontToBackStats.triangleTests < recursiveStats.triangleTests);
+    }
+    printf("Testing ray packets...\n");
+    {
+        const KDTree& tree = *raytracer.GetKDTree();
+        KDTraversalStats singleStats, packetStats;
+        //tiles with a missing last row and column, and ones around the image center whose rays point different ways
+        for (uint16_t y = 0; y < height; y += RAY_PACKET_HEIGHT + 1)
+        {
+            for (uint16_t x = 0; x < width; x += RAY_PACKET_WIDTH + 1)
+            {
+                RayPacket packet;
+                for (uint16_t j = 0; j < RAY_PACKET_HEIGHT - (y % 2); ++j)
+                {
+                    for (uint16_t i = 0; i < RAY_PACKET_WIDTH - (x % 2); ++i)
+                    {
+                        packet.SetRay(j * RAY_PACKET_WIDTH + i, raytracer.GetCameraRay(x + i, y + j));
+                    }
+                }
+                uint32_t triangles[SIMD_WIDTH];
+                float distances[SIMD_WIDTH];
+                uint32_t hits = tree.IntersectPacket(packet, triangles, distances, &packetStats);
+                assert(!(hits & ~packet.activeMask));
+                for (int lane = 0; lane < SIMD_WIDTH; ++lane)
+                {
+                    if (!((packet.activeMask >> lane) & 1))
+                        continue;
+                    uint32_t triangle;
+                    float dist;
+                    bool hit = tree.Intersect(packet.GetRay(lane), &triangle, &dist, &singleStats);
+                    assert(hit == (bool)((hits >> lane) & 1));
+                    assert(!hit || (triangle == triangles[lane] && dist == distances[lane]));
+                }
+            }
+        }
+        assert(packetStats.innerNodes < singleStats.innerNodes);
+        //Trace goes through the packets, GetPixel always traces single rays
+        raytracer.SetUseKDTree(true);
+        std::vector<Color> pixels = raytracer.Trace();
+        for (uint16_t y = 0; y < height; y += 3)
+        {
+            for (uint16_t x = 0; x < width; x += 3)
+            {
+                Color pixel = raytracer.GetPixel(x, y);
+                const Color& traced = pixels[y * width + x];
+                assert(pixel.r == traced.r && pixel.g == traced.g && pixel.b == traced.b);
+            }
+        }
+    }
+    printf("Testing tiled trace...\n");
+    {
+        //a size that is no multiple of the tiles or packets, so the last row and column of tiles are partial
+        Raytracer odd;
+        odd.SetModel(model.get());
+        odd.SetResolution(203, 77);
+        odd.SetCameraPosition(Vector3(0.0f, 0.15f, 0.5f));
+        odd.SetForward(Vector3(0.0f, 0.0f, -1.0f));
+        odd.SetThreadCount(3);
+        odd.Setup();
+        TraceStats stats;
+        std::vector<Color> pixels = odd.Trace(&stats);
+        assert(pixels.size() == 203 * 77 && stats.threads.size() == 3);
+        size_t tileCount = 0;
+        for (const TraceThreadStats& thread : stats.threads)
+        {
+            tileCount += thread.tileCount;
+            assert(thread.busySeconds >= 0.0 && thread.busySeconds <= stats.seconds);
+        }
+        assert(tileCount == ((203 + TRACE_TILE_SIZE - 1) / TRACE_TILE_SIZE) * ((77 + TRACE_TILE_SIZE - 1) / TRACE_TILE_SIZE));
+        for (uint16_t y = 0; y < 77; ++y)
+        {
+            for (uint16_t x = 0; x < 203; ++x)
+            {
+                Color pixel = odd.GetPixel(x, y);
+                const Color& traced = pixels[y * 203 + x];
+                assert(pixel.r == traced.r && pixel.g == traced.g && pixel.b == traced.b);
+            }
+        }
+    }
+    printf("Testing occlusion queries...\n");
+    {
+        const KDTree& tree = *raytracer.GetKDTree();
+        Vector3 light(-0.3f, 0.5f, 0.4f);
+        std::vector<Ray> rays;
+        std::vector<float> tMax;
+        for (uint16_t y = 0; y < height; y += 2)
+        {
+            for (uint16_t x = 0; x < width; x += 2)
+            {
+                Ray ray = raytracer.GetCameraRay(x, y);
+                uint32_t triangle;
+                float dist;
+                if (!tree.Intersect(ray, &triangle, &dist))
+                    continue;
+                Vector3 n = model->mesh.GetTriangle(triangle).GetNormal();
+                Vector3 origin = ray.origin + ray.direction * dist + n * (Vector3::Dot(ray.direction, n) < 0.0f ? 1e-4f : -1e-4f);
+                //to the light, and a short and a long ray along the camera ray behind the hit
+                rays.push_back(Ray(origin, light - origin));
+                tMax.push_back(1.0f);
+                rays.push_back(Ray(origin, ray.direction));
+                tMax.push_back(0.01f);
+                rays.push_back(Ray(origin, ray.direction));
+                tMax.push_back(1.0f);
+            }
+        }
+        std::unique_ptr<bool[]> batchOccluded(new bool[rays.size()]);
+        size_t occludedCount = tree.Occluded(rays.data(), tMax.data(), rays.size(), batchOccluded.get());
+        size_t nearestCount = 0;
+        for (size_t i = 0; i < rays.size(); ++i)
+        {
+            uint32_t triangle;
+            float dist;
+            bool nearest = tree.Intersect(rays[i], &triangle, &dist) && dist < tMax[i];
+            assert(tree.Occluded(rays[i], tMax[i]) == nearest && batchOccluded[i] == nearest);
+            nearestCount += nearest;
+        }
+        assert(occludedCount == nearestCount && occludedCount > 0 && occludedCount < rays.size());
+    }
+    printf("Testing ropes...\n");
+    {
+        AABB aabb;
+        aabb.min = Vector3(-10, -10, -10);
+        aabb.max = Vector3(10, 10, 10);
+        KDTreeBuildParams params;
+        params.ropes = true;
+        KDTree tree(model->mesh, aabb, params);
+        const KDTreeView& view = tree.GetView();
+        KDTreeStats stats = tree.ComputeStats();
+        assert(tree.HasRopes() && stats.ropeBytes == tree.GetRopeBytes() && stats.ropeBytes >= stats.leafCount * sizeof(KDTreeLeafRopes));
+        for (size_t i = 0; i < view.nodeCount; ++i)
+        {
+            assert(view.nodes[i].IsLeaf() == (view.leafRopeIndices[i] != KDTREE_NO_ROPE));
+        }
+        //camera rays, and rays along the axes from inside the model whose other faces are never crossed
+        std::vector<Ray> rays;
+        for (uint16_t y = 0; y < height; y += 3)
+        {
+            for (uint16_t x = 0; x < width; x += 3)
+            {
+                rays.push_back(raytracer.GetCameraRay(x, y));
+            }
+        }
+        for (int k = 0; k < 3; ++k)
+        {
+            for (float sign : { -1.0f, 1.0f })
+            {
+                Vector3 direction(0.0f, 0.0f, 0.0f);
+                direction[k] = sign;
+                rays.push_back(Ray(Vector3(0.0f, 0.15f, 0.0f), direction));
+            }
+        }
+        KDTraversalStats stackStats, ropeStats;
+        for (const Ray& ray : rays)
+        {
+            uint32_t stackTriangle, triangle;
+            float stackDist, dist;
+            bool stackHit = tree.Intersect(ray, &stackTriangle, &stackDist, &stackStats);
+            assert(tree.IntersectStackless(ray, &triangle, &dist, &ropeStats) == stackHit);
+            assert(!stackHit || (triangle == stackTriangle && dist == stackDist));
+        }
+        assert(ropeStats.leaves == stackStats.leaves && ropeStats.innerNodes <= stackStats.innerNodes);
+    }
+    printf("Testing ray batches...\n");
+    {
+        const KDTree& tree = *raytracer.GetKDTree();
+        //camera rays every other of which points back to the camera, so the batch's order is incoherent
+        RayBatch rays;
+        for (uint16_t y = 0; y < height; y += 3)
+        {
+            for (uint16_t x = 0; x < width; x += 3)
+            {
+                Ray ray = raytracer.GetCameraRay(x, y);
+                rays.Add(rays.GetCount() % 2 ? ray : Ray(ray.origin + ray.direction, ray.direction * -1.0f));
+            }
+        }
+        for (int run = 0; run < 3; ++run)
+        {
+            KDTreeBatchParams params;
+            params.sortRays = run > 0;
+            params.threadCount = run == 2 ? 3 : 1;
+            HitBatch hits;
+            size_t hitCount = tree.Intersect(rays, &hits, params);
+            assert(hits.triangles.size() == rays.GetCount() && hits.distances.size() == rays.GetCount());
+            size_t singleHitCount = 0;
+            for (size_t i = 0; i < rays.GetCount(); ++i)
+            {
+                uint32_t triangle;
+                float dist;
+                bool hit = tree.Intersect(rays.GetRay(i), &triangle, &dist);
+                assert(hit ? hits.triangles[i] == triangle && hits.distances[i] == dist : hits.triangles[i] == HIT_BATCH_MISS);
+                singleHitCount += hit;
+            }
+            assert(hitCount == singleHitCount && hitCount > 0);
+        }
+    }
+    printf("Testing hit records...\n");
+    {
+        const KDTree& tree = *raytracer.GetKDTree();
+        RayBatch rays;
+        for (uint16_t y = 0; y < height; y += 5)
+        {
+            for (uint16_t x = 0; x < width; x += 5)
+            {
+                rays.Add(raytracer.GetCameraRay(x, y));
+            }
+        }
+        HitBatch hits;
+        tree.Intersect(rays, &hits);
+        size_t hitCount = 0;
+        for (size_t i = 0; i < rays.GetCount(); ++i)
+        {
+            Ray ray = rays.GetRay(i);
+            uint32_t triangle;
+            float dist;
+            KDTreeHit hit;
+            bool found = tree.Intersect(ray, &hit);
+            assert(found == tree.Intersect(ray, &triangle, &dist));
+            if (!found)
+                continue;
+            hitCount++;
+            //the barycentrics are the ones the triangle test accepted, and give back the hit point
+            assert(hit.triangle == triangle && hit.t == dist && hit.u >= 0.0f && hit.v >= 0.0f && hit.u + hit.v < 1.0f);
+            assert(hits.u[i] == hit.u && hits.v[i] == hit.v);
+            Triangle t = model->mesh.GetTriangle(hit.triangle);
+            Vector3 point = t.vertices[0] * (1.0f - hit.u - hit.v) + t.vertices[1] * hit.u + t.vertices[2] * hit.v;
+            assert((point - (ray.origin + ray.direction * hit.t)).Magnitude() < 1e-5f);
+        }
+        assert(hitCount > 0);
+        //smooth shading changes the image but never whether a pixel hits, and packets shade like single rays
+        std::vector<Color> flatImage = raytracer.Trace();
+        Compute_Vertex_Normals(model.get());
+        assert(model->vertexNormals.size() == model->mesh.GetVertexCount());
+        raytracer.SetSmoothShading(true);
+        std::vector<Color> smoothImage = raytracer.Trace();
+        size_t differentPixels = 0;
+        for (uint16_t y = 0; y < height; ++y)
+        {
+            for (uint16_t x = 0; x < width; ++x)
+            {
+                const Color& flat = flatImage[y * width + x];
+                const Color& smooth = smoothImage[y * width + x];
+                differentPixels += flat.r != smooth.r || flat.g != smooth.g || flat.b != smooth.b;
+                if (x % 7 == 0 && y % 7 == 0)
+                {
+                    Color single = raytracer.GetPixel(x, y);
+                    assert(single.r == smooth.r && single.g == smooth.g && single.b == smooth.b);
+                }
+            }
+        }
+        assert(differentPixels > 0);
+        raytracer.SetSmoothShading(false);
+        model->vertexNormals.clear();
+    }
+    printf("Testing mailboxes...\n");
+    {
+        AABB aabb;
+        aabb.min = Vector3(-10, -10, -10);
+        aabb.max = Vector3(10, 10, 10);
+        KDTreeBuildParams params;
+        params.mailboxes = true;
+        KDTree tree(model->mesh, aabb, params);
+        const KDTree& reference = *raytracer.GetKDTree();
+        KDTraversalStats stats, referenceStats;
+        for (uint16_t y = 0; y < height; y += 3)
+        {
+            for (uint16_t x = 0; x < width; x += 3)
+            {
+                Ray ray = raytracer.GetCameraRay(x, y);
+                uint32_t triangle, referenceTriangle;
+                float dist, referenceDist;
+                bool hit = reference.Intersect(ray, &referenceTriangle, &referenceDist, &referenceStats);
+                assert(tree.Intersect(ray, &triangle, &dist, &stats) == hit);
+                assert(!hit || (triangle == referenceTriangle && dist == referenceDist));
+                assert(tree.IntersectRecursive(ray, &triangle, &dist) == reference.IntersectRecursive(ray, &referenceTriangle, &referenceDist));
+                assert(tree.Occluded(ray, 0.5f) == reference.Occluded(ray, 0.5f));
+            }
+        }
+        //the same leaves are visited, some of their references are not tested again
+        assert(stats.triangleTests == referenceStats.triangleTests && referenceStats.mailboxSkips == 0);
+        assert(stats.mailboxSkips > 0 && stats.mailboxSkips < stats.triangleTests);
+    }
+    printf("Testing closest points...\n");
+    {
+        //the Voronoi regions of a triangle in the z = 0 plane
+        Triangle triangle(Vector3(0, 0, 0), Vector3(1, 0, 0), Vector3(0, 1, 0));
+        float u, v;
+        Vector3 point = ClosestPointOnTriangle(triangle, Vector3(0.25f, 0.25f, 2.0f), &u, &v);
+        assert(point.x == 0.25f && point.y == 0.25f && point.z == 0.0f && u == 0.25f && v == 0.25f);
+        point = ClosestPointOnTriangle(triangle, Vector3(2.0f, -1.0f, 0.0f), &u, &v);
+        assert(point.x == 1.0f && point.y == 0.0f && u == 1.0f && v == 0.0f);
+        point = ClosestPointOnTriangle(triangle, Vector3(1.0f, 1.0f, 0.0f), &u, &v);
+        assert(point.x == 0.5f && point.y == 0.5f && u == 0.5f && v == 0.5f);
+        point = ClosestPointOnTriangle(triangle, Vector3(-1.0f, 0.5f, 1.0f), &u, &v);
+        assert(point.x == 0.0f && point.y == 0.5f && u == 0.0f && v == 0.5f);
+
+        const KDTree& tree = *raytracer.GetKDTree();
+        std::vector<Vector3> points;
+        srand(3);
+        for (int i = 0; i < 200; ++i)
+        {
+            Vector3 offset(rand() / (float)RAND_MAX - 0.5f, rand() / (float)RAND_MAX - 0.5f, rand() / (float)RAND_MAX - 0.5f);
+            points.push_back(model->mesh.GetVertex((uint32_t)(rand() % model->mesh.GetVertexCount())) + offset * 0.01f);
+        }
+        //one outside the tree's box
+        points.push_back(Vector3(12.0f, 0.0f, 0.0f));
+        std::vector<KDTreeClosestPoint> results(points.size());
+        //the best first search finds the distance of testing every triangle
+        KDTraversalStats stats;
+        for (size_t i = 0; i < points.size(); ++i)
+        {
+            float closest = std::numeric_limits<float>::infinity();
+            for (uint32_t t = 0; t < model->mesh.GetTriangleCount(); ++t)
+            {
+                Vector3 p = ClosestPointOnTriangle(model->mesh.GetTriangle(t), points[i], &u, &v);
+                closest = std::min(closest, (p - points[i]).SqrMagnitude());
+            }
+            assert(tree.ClosestPoint(points[i], std::numeric_limits<float>::infinity(), &results[i], &stats));
+            assert(results[i].distance == std::sqrt(closest));
+            Vector3 p = ClosestPointOnTriangle(model->mesh.GetTriangle(results[i].triangle), points[i], &u, &v);
+            assert(p.x == results[i].point.x && p.y == results[i].point.y && p.z == results[i].point.z && u == results[i].u && v == results[i].v);
+            //nothing is closer than the closest point
+            KDTreeClosestPoint nearer;
+            assert(!tree.ClosestPoint(points[i], results[i].distance * 0.99f, &nearer));
+        }
+        assert(stats.triangleTests < points.size() * model->mesh.GetTriangleCount() / 100);
+        std::vector<KDTreeClosestPoint> batchResults(points.size());
+        assert(tree.ClosestPoints(points.data(), points.size(), std::numeric_limits<float>::infinity(), batchResults.data(), 4) == points.size());
+        for (size_t i = 0; i < points.size(); ++i)
+        {
+            assert(batchResults[i].triangle == results[i].triangle && batchResults[i].distance == results[i].distance);
+        }
+        assert(tree.ClosestPoints(points.data(), points.size(), 0.001f, batchResults.data(), 4) < points.size());
+        assert(batchResults.back().triangle == HIT_BATCH_MISS);
+    }
+    printf("Testing range queries...\n");
+    {
+        Triangle triangle(Vector3(0, 0, 0), Vector3(1, 0, 0), Vector3(0, 1, 0));
+        AABB box;
+        box.min = Vector3(0.4f, 0.4f, -1.0f);
+        box.max = Vector3(1.0f, 1.0f, 1.0f);
+        assert(TriangleOverlapsBox(triangle, box));
+        //the box overlaps the triangle's bounds but lies beyond the hypotenuse
+        box.min = Vector3(0.6f, 0.6f, -1.0f);
+        assert(!TriangleOverlapsBox(triangle, box));
+        box.min = Vector3(0.5f, 0.5f, 0.0f);
+        assert(TriangleOverlapsBox(triangle, box));
+        box.min = Vector3(0.1f, 0.1f, 0.1f);
+        assert(!TriangleOverlapsBox(triangle, box));
+
+        const KDTree& tree = *raytracer.GetKDTree();
+        const TriangleMesh& mesh = model->mesh;
+        std::vector<uint32_t> found(mesh.GetTriangleCount()), expected;
+        srand(5);
+        for (int i = 0; i < 20; ++i)
+        {
+            Vector3 center = mesh.GetVertex((uint32_t)(rand() % mesh.GetVertexCount()));
+            Vector3 half(rand() / (float)RAND_MAX * 0.02f, rand() / (float)RAND_MAX * 0.02f, rand() / (float)RAND_MAX * 0.02f);
+            box.min = center - half;
+            box.max = center + half;
+            expected.clear();
+            for (uint32_t t = 0; t < mesh.GetTriangleCount(); ++t)
+            {
+                if (TriangleOverlapsBox(mesh.GetTriangle(t), box))
+                    expected.push_back(t);
+            }
+            //every overlapping triangle once
+            KDTraversalStats stats;
+            size_t count = tree.FindTriangles(box, found.data(), found.size(), &stats);
+            assert(count == expected.size() && count > 0);
+            std::sort(found.begin(), found.begin() + count);
+            assert(std::equal(expected.begin(), expected.end(), found.begin()));
+            assert(stats.triangleTests < mesh.GetTriangleCount() / 10);
+            //a short buffer gets the first triangles and the total count
+            std::vector<uint32_t> all(count), first(count / 2);
+            tree.FindTriangles(box, all.data(), count);
+            assert(tree.FindTriangles(box, first.data(), first.size()) == count);
+            assert(std::equal(first.begin(), first.end(), all.begin()));
+            //the callback stops when it is told to
+            size_t visited = 0;
+            size_t stopped = tree.ForEachTriangle(box, [&](uint32_t t) {
+                assert(t == all[visited]);
+                return ++visited < 3;
+            });
+            assert(stopped == std::min<size_t>(count, 3) && visited == stopped);
+            //a query inside the visitor keeps marks of its own, so the outer one still reports every triangle once
+            std::vector<uint32_t> outer;
+            tree.ForEachTriangle(box, [&](uint32_t t) {
+                outer.push_back(t);
+                assert(tree.FindTriangles(box, first.data(), first.size()) == count);
+                return true;
+            });
+            assert(outer == all);
+        }
+        //a camera that only sees part of the model, its frustum holds every triangle a primary ray hits
+        Raytracer zoomed;
+        zoomed.SetResolution(width, height);
+        zoomed.SetFOV((float)M_PI / 24.0f);
+        zoomed.SetCameraPosition(Vector3(0.0f, 0.15f, 0.5f));
+        zoomed.SetForward(Vector3(0.0f, 0.0f, -1.0f));
+        Frustum frustum = zoomed.GetFrustum(0.01f, 10.0f);
+        expected.clear();
+        for (uint32_t t = 0; t < mesh.GetTriangleCount(); ++t)
+        {
+            if (frustum.Overlaps(mesh.GetTriangle(t)))
+                expected.push_back(t);
+        }
+        size_t count = tree.FindTriangles(frustum, found.data(), found.size());
+        assert(count == expected.size() && count < mesh.GetTriangleCount());
+        std::sort(found.begin(), found.begin() + count);
+        assert(std::equal(expected.begin(), expected.end(), found.begin()));
+        for (uint16_t y = 0; y < height; y += 4)
+        {
+            for (uint16_t x = 0; x < width; x += 4)
+            {
+                uint32_t triangle;
+                float dist;
+                if (tree.Intersect(zoomed.GetCameraRay(x, y), &triangle, &dist))
+                    assert(std::binary_search(expected.begin(), expected.end(), triangle));
+            }
+        }
+    }
+    printf("Testing leaf formats...\n");
+    {
+        AABB aabb;
+        aabb.min = Vector3(-10, -10, -10);
+        aabb.max = Vector3(10, 10, 10);
+        KDTreeBuildParams edgeParams;
+        edgeParams.leafFormat = kLeafFormatEdges;
+        KDTreeBuildParams waldParams;
+        waldParams.leafFormat = kLeafFormatWald;
+        KDTreeBuildParams blockParams;
+        blockParams.leafFormat = kLeafFormatBlocks;
+        KDTreeBuildParams quantizedParams;
+        quantizedParams.leafFormat = kLeafFormatQuantized;
+        const KDTree& indexTree = *raytracer.GetKDTree();
+        KDTree edgeTree(model->mesh, aabb, edgeParams);
+        KDTree waldTree(model->mesh, aabb, waldParams);
+        KDTree blockTree(model->mesh, aabb, blockParams);
+        KDTree quantizedTree(model->mesh, aabb, quantizedParams);
+        assert(SameTree(indexTree, edgeTree) && SameTree(indexTree, waldTree) && SameTree(indexTree, blockTree) && SameTree(indexTree, quantizedTree));
+        assert(edgeTree.GetLeafTriangleBytes() == edgeTree.GetTriangleIndexCount() * sizeof(EdgeTriangle));
+        assert(blockTree.GetLeafTriangleBytes() == (blockTree.GetTriangleIndexCount() + SIMD_WIDTH - 1) / SIMD_WIDTH * sizeof(TriangleBlock));
+        assert(quantizedTree.GetLeafTriangleBytes() < edgeTree.GetLeafTriangleBytes());
+        size_t quantizedRays = 0;
+        size_t quantizedLostHits = 0;
+        size_t quantizedFarHits = 0;
+        for (int y = 0; y < 480; y += 4)
+        {
+            for (int x = 0; x < 640; x += 4)
+            {
+                Ray ray(Vector3(0.0f, 0.15f, 0.5f), Vector3((x - 320) * 0.001f, (240 - y) * 0.001f, -1.0f).Normalized());
+                uint32_t indexTriangle, edgeTriangle, waldTriangle;
+                float indexDist, edgeDist, waldDist;
+                bool indexHit = indexTree.Intersect(ray, &indexTriangle, &indexDist);
+                //precomputed edges take the same steps
+                assert(edgeTree.Intersect(ray, &edgeTriangle, &edgeDist) == indexHit);
+                assert(!indexHit || (edgeTriangle == indexTriangle && edgeDist == indexDist));
+                //the projection test may round differently, but not by much
+                if (waldTree.Intersect(ray, &waldTriangle, &waldDist) && indexHit)
+                    assert(fabsf(waldDist - indexDist) < 1e-4f);
+                //the blocks test the same references with the same steps, the mirrored ray leaves the surface
+                //and crosses many leaves whose references start and end inside a block
+                Ray rays[2] = { ray, ray };
+                if (indexHit)
+                {
+                    Vector3 n = model->mesh.GetTriangle(indexTriangle).GetNormal();
+                    float cosine = Vector3::Dot(ray.direction, n);
+                    rays[1] = Ray(ray.origin + ray.direction * indexDist + n * (cosine < 0.0f ? 1e-4f : -1e-4f), (ray.direction - n * 2.0f * cosine).Normalized());
+                }
+                for (const Ray& blockRay : rays)
+                {
+                    uint32_t blockTriangle;
+                    float blockDist;
+                    bool edgeHit = edgeTree.Intersect(blockRay, &edgeTriangle, &edgeDist);
+                    assert(blockTree.Intersect(blockRay, &blockTriangle, &blockDist) == edgeHit);
+                    assert(!edgeHit || (blockTriangle == edgeTriangle && blockDist == edgeDist));
+                    //the widened test of the quantized vertices can hit a neighbour first or at a slightly different
+                    //distance, and only loses a hit where it caps the widening, which none of these rays reach
+                    uint32_t quantizedTriangle;
+                    float quantizedDist;
+                    bool quantizedHit = quantizedTree.Intersect(blockRay, &quantizedTriangle, &quantizedDist);
+                    quantizedRays++;
+                    quantizedLostHits += edgeHit && !quantizedHit;
+                    quantizedFarHits += edgeHit && quantizedHit && fabsf(quantizedDist - edgeDist) > 1e-4f;
+                }
+            }
+        }
+        assert(quantizedLostHits == 0 && quantizedFarHits * 1000 <= quantizedRays);
+    }
+    printf("Testing lazy kd-Tree pixels...\n");
+    {
+        Raytracer lazy;
+        lazy.SetModel(model.get());
+        lazy.SetResolution(width, height);
+        lazy.SetCameraPosition(Vector3(0.0f, 0.15f, 0.5f));
+        lazy.SetForward(Vector3(0.0f, 0.0f, -1.0f));
+        lazy.SetLazyBuild(true);
+        lazy.Setup();
+        assert(!lazy.GetKDTree() && lazy.GetLazyKDTree()->GetExpandedNodeCount() == 0);
+        raytracer.SetUseKDTree(false);
+        for (int y = 100; y < 200; ++y)
+        {
+            Color c1 = raytracer.GetPixel(320, y);
+            Color c2 = lazy.GetPixel(320, y);
+            assert(c1.r == c2.r);
+            assert(c1.g == c2.g);
+            assert(c1.b == c2.b);
+        }
+        //one column of rays only expands a part of the eager tree
+        const LazyKDTree* tree = lazy.GetLazyKDTree();
+        assert(tree->GetExpandedNodeCount() > 0 && tree->GetNodeCount() < raytracer.GetKDTree()->GetNodeCount());
+        //the whole frame traced by many threads at once matches the eager tree
+        raytracer.SetUseKDTree(true);
+        std::vector<Color> eagerPixels = raytracer.Trace();
+        lazy.SetThreadCount(8);
+        std::vector<Color> lazyPixels = lazy.Trace();
+        assert(eagerPixels.size() == lazyPixels.size());
+        for (size_t i = 0; i < eagerPixels.size(); ++i)
+        {
+            assert(eagerPixels[i].r == lazyPixels[i].r && eagerPixels[i].g == lazyPixels[i].g && eagerPixels[i].b == lazyPixels[i].b);
+        }
+        //the frame stops at the closest hits, so occluded nodes stay unbuilt
+        assert(tree->GetExpandedNodeCount() < raytracer.GetKDTree()->GetNodeCount());
+        //both walk front to back and ignore hits behind the origin, a ray from inside the model gets the same hit
+        for (int i = 0; i < 200; ++i)
+        {
+            Vector3 direction((i % 7) - 3.0f, (i % 5) - 2.0f, (i % 3) - 1.0f + 0.5f);
+            Ray ray(Vector3(0.0f, 0.12f, 0.0f), direction.Normalized());
+            uint32_t eagerTriangle, lazyTriangle;
+            float eagerDist, lazyDist;
+            bool eagerHit = raytracer.GetKDTree()->Intersect(ray, &eagerTriangle, &eagerDist);
+            assert(tree->Intersect(ray, &lazyTriangle, &lazyDist) == eagerHit);
+            assert(!eagerHit || (lazyTriangle == eagerTriangle && lazyDist == eagerDist));
+        }
+    }
+    printf("Testing instanced scene...\n");
+    {
+        Transform moved = Transform::Translation(Vector3(3.0f, 0.0f, 0.0f)) * Transform::RotationY(0.5f);
+        Transform roundTrip = moved * moved.Inverse();
+        for (int i = 0; i < 3; ++i)
+        {
+            for (int j = 0; j < 4; ++j)
+            {
+                assert(fabsf(roundTrip.m[i][j] - (i == j ? 1.0f : 0.0f)) < 1e-5f);
+            }
+        }
+        Scene scene;
+        uint32_t mesh = scene.AddMesh(model->mesh, KDTreeBuildParams(), model->triangleNormals.data());
+        scene.AddInstance(mesh, Transform::Identity());
+        uint32_t instance = scene.AddInstance(mesh, Transform::Identity());
+        const KDTree* meshTree = &scene.GetMeshTree(mesh);
+        for (int pass = 0; pass < 2; ++pass)
+        {
+            //moving the instance only rebuilds the top level
+            scene.SetTransform(instance, pass ? moved : Transform::Translation(Vector3(-3.0f, 0.0f, 0.0f)));
+            scene.Commit();
+            assert(&scene.GetMeshTree(mesh) == meshTree);
+            Transform transform = pass ? moved : Transform::Translation(Vector3(-3.0f, 0.0f, 0.0f));
+            for (int y = 100; y < 200; ++y)
+            {
+                //a ray hits the identity instance where it hits the model, and the same ray moved along with the
+                //second instance hits that one at the same distance
+                Ray ray(Vector3(0.0f, 0.15f, 0.5f), Vector3(0.0f, (240 - y) * 0.001f, -1.0f).Normalized());
+                uint32_t triangle;
+                float distance;
+                bool found = raytracer.GetKDTree()->Intersect(ray, &triangle, &distance);
+                SceneHit hit;
+                assert(scene.Intersect(ray, &hit) == found);
+                Ray movedRay(transform.TransformPoint(ray.origin), transform.TransformVector(ray.direction));
+                SceneHit movedHit;
+                assert(scene.Intersect(movedRay, &movedHit) == found);
+                if (!found)
+                    continue;
+                assert(hit.instance == 0 && hit.triangle == triangle && hit.distance == distance);
+                assert(movedHit.instance == instance && fabsf(movedHit.distance - distance) < 1e-4f);
+                Vector3 normal = model->mesh.GetTriangle(movedHit.triangle).GetNormal();
+                assert(Vector3::Dot(movedHit.normal, transform.TransformVector(normal)) > 0.999f);
+            }
+        }
+    }
     printf("\x1b[32m[Test Passed]\n");
     return 0;
 }